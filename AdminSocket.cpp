@@ -0,0 +1,176 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "AdminSocket.hpp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "FlightRecorder.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Timestamp.hpp"
+
+AdminSocket::AdminSocket()
+    : m_socketFd{-1}
+{}
+
+AdminSocket::~AdminSocket() {
+    if (m_socketFd != -1) {
+        ::close(m_socketFd);
+    }
+}
+
+int AdminSocket::GetFd() const {
+    return m_socketFd;
+}
+
+SocketType AdminSocket::Identity() const {
+    return SocketType::Admin;
+}
+
+bool AdminSocket::Initialize(std::uint16_t port) {
+    auto sfd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0) {
+        Log(LogSeverity::Error, "Unable to create admin socket");
+        return false;
+    }
+
+    int enable = 1;
+    ::setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+
+    // Only reachable from the proxy host itself
+    auto sockaddr = sockaddr_in{};
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = htons(port);
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((::bind(sfd, reinterpret_cast<struct sockaddr*>(&sockaddr), sizeof(sockaddr)) < 0) ||
+        (::listen(sfd, 8) < 0)) {
+        Log(LogSeverity::Error, "Unable to listen for admin requests on port %d", port);
+        ::close(sfd);
+        return false;
+    }
+
+    m_socketFd = sfd;
+    return true;
+}
+
+int AdminSocket::Accept() {
+    return ::accept4(m_socketFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+AdminConnection::AdminConnection(int fd)
+    : m_fd{fd}
+    , m_openedAt{Timestamp()}
+    , m_sent{0}
+{}
+
+AdminConnection::~AdminConnection() {
+    ::close(m_fd);
+}
+
+int AdminConnection::GetFd() const {
+    return m_fd;
+}
+
+SocketType AdminConnection::Identity() const {
+    return SocketType::AdminConnection;
+}
+
+std::uint64_t AdminConnection::GetOpenedAt() const {
+    return m_openedAt;
+}
+
+bool AdminConnection::ReadRequest() {
+    char buf[2048];
+    auto rc = ::read(m_fd, buf, sizeof(buf) - 1);
+    if (rc <= 0) {
+        return (rc == -1) && (errno == EAGAIN);
+    }
+    buf[rc] = '\0';
+
+    char path[256] = {};
+    if (sscanf(buf, "GET %255s", path) != 1) {
+        return false;
+    }
+    BuildResponse(path);
+    return true;
+}
+
+bool AdminConnection::HasResponse() const {
+    return !m_response.empty();
+}
+
+bool AdminConnection::WriteResponse() {
+    while (m_sent < m_response.size()) {
+        auto rc = ::write(m_fd, m_response.data() + m_sent, m_response.size() - m_sent);
+        if (rc <= 0) {
+            return !((rc == -1) && (errno == EAGAIN));
+        }
+        m_sent += rc;
+    }
+    return true;
+}
+
+void AdminConnection::BuildResponse(const char* path) {
+    auto body = std::string{};
+    auto* status = "200 OK";
+    auto* contentType = "text/plain; version=0.0.4";
+    if (!strcmp(path, "/metrics")) {
+        Metrics::Instance().Render(body);
+    } else if (!strcmp(path, "/flight")) {
+        FlightRecorder::Instance().RenderJson(body);
+        contentType = "application/json";
+    } else if (!strcmp(path, "/flight/trace")) {
+        FlightRecorder::Instance().RenderTrace(body);
+        contentType = "application/json";
+    } else {
+        status = "404 Not Found";
+    }
+
+    char header[256];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n"
+             "\r\n", status, contentType, body.size());
+    m_response.reserve(strlen(header) + body.size());
+    m_response.append(header);
+    m_response.append(body);
+}
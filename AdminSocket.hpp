@@ -0,0 +1,91 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "IGenericSocket.hpp"
+
+/**
+ * @brief The AdminSocket class listens on the loopback interface for requests
+ * to the admin endpoint (metrics, diagnostics).
+ */
+class AdminSocket : public IGenericSocket
+{
+public:
+    AdminSocket();
+    ~AdminSocket();
+
+    int GetFd() const override;
+    SocketType Identity() const override;
+
+    bool Initialize(std::uint16_t port);
+    int Accept();
+
+private:
+    int m_socketFd;
+};
+
+/**
+ * @brief The AdminConnection class is a single request to the admin endpoint.
+ * The request is read once, and the response written without blocking, as
+ * the socket becomes writable.
+ */
+class AdminConnection : public IGenericSocket
+{
+public:
+    AdminConnection(int fd);
+    ~AdminConnection();
+
+    int GetFd() const override;
+    SocketType Identity() const override;
+
+    // When the connection was accepted (ms)
+    std::uint64_t GetOpenedAt() const;
+
+    // Read the request, and build the response.  Returns false on error.
+    bool ReadRequest();
+    bool HasResponse() const;
+
+    // Write as much of the response as the socket will take; returns true when
+    // the whole response has been sent (or the connection failed).
+    bool WriteResponse();
+
+private:
+    void BuildResponse(const char* path);
+
+    int m_fd;
+    std::uint64_t m_openedAt;
+    std::string m_response;
+    std::size_t m_sent;
+};
@@ -33,40 +33,100 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include <thread>
+
 #include "Log.hpp"
+#include "SocketIo.hpp"
 
 AsyncMessenger::~AsyncMessenger() {
-    close(m_pipeFds[readPipe]);
-    close(m_pipeFds[writePipe]);
+    SocketIo::Instance().Close(m_eventFd);
+    delete[] m_cells;
 }
 
 int AsyncMessenger::GetReadFd() {
-    return m_pipeFds[readPipe];
+    return m_eventFd;
 }
 
 bool AsyncMessenger::WriteMessage(const AsyncMessage_t& message) {
-    auto lg = LockGuard{m_writeLock};
+    // Bounded MPMC queue (Dmitry Vyukov) - each cell's sequence number tells producers
+    // whether it's free for the current lap, and the consumer whether it's been filled.
+    auto pos = m_writePos.load(std::memory_order_relaxed);
+    Cell* cell = nullptr;
+    while (1) {
+        cell = &m_cells[pos & (m_capacity - 1)];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+        if (diff == 0) {
+            if (m_writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Queue is full - wait for the event loop to catch up
+            std::this_thread::yield();
+            pos = m_writePos.load(std::memory_order_relaxed);
+        } else {
+            pos = m_writePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->message = message;
+    cell->sequence.store(pos + 1, std::memory_order_release);
 
-    auto numWritten = ::write(m_pipeFds[writePipe], &message, sizeof(message));
-    if (numWritten == sizeof(message)) {
-        return true;
+    if (m_pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        Signal();
     }
-    return false;
+    return true;
 }
 
-void AsyncMessenger::ReadMessage(AsyncMessage_t& message) {
-    auto rc = ::read(m_pipeFds[readPipe], &message, sizeof(message));
-    if (rc == -1) {
-        Log(LogSeverity::Error, "%s: Error writing message, errno=%d", __func__, errno);
+void AsyncMessenger::ClearSignal() {
+    auto value = eventfd_t{};
+    SocketIo::Instance().Read(m_eventFd, &value, sizeof(value));
+}
+
+bool AsyncMessenger::ReadMessage(AsyncMessage_t& message) {
+    auto& cell = m_cells[m_readPos & (m_capacity - 1)];
+    auto sequence = cell.sequence.load(std::memory_order_acquire);
+    if (sequence != (m_readPos + 1)) {
+        // A producer may have claimed this cell but not yet filled it, while later
+        // messages were counted.  Make sure the loop comes back for them.
+        if (m_pending.load(std::memory_order_acquire) > 0) {
+            Signal();
+        }
+        return false;
     }
+
+    message = cell.message;
+    cell.sequence.store(m_readPos + m_capacity, std::memory_order_release);
+    m_readPos++;
+    m_pending.fetch_sub(1, std::memory_order_acq_rel);
+    return true;
 }
 
-AsyncMessenger::AsyncMessenger() {
-    auto rc = ::pipe(m_pipeFds);
-    if (rc != 0) {
-        Log(LogSeverity::Error, "%s: Error creating pipe", __func__);
+void AsyncMessenger::Signal() {
+    auto value = eventfd_t{1};
+    if (-1 == SocketIo::Instance().Write(m_eventFd, &value, sizeof(value))) {
+        Log(LogSeverity::Error, "%s: Error signalling eventfd, errno=%d", __func__, errno);
+    }
+}
+
+AsyncMessenger::AsyncMessenger()
+    : m_eventFd{-1}
+    , m_cells{new Cell[m_capacity]}
+    , m_pending{0}
+    , m_writePos{0}
+    , m_readPos{0}
+{
+    for (auto i = std::size_t{0}; i < m_capacity; i++) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    m_eventFd = SocketIo::Instance().EventFd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventFd == -1) {
+        Log(LogSeverity::Error, "%s: Error creating eventfd", __func__);
         exit(-1);
     }
 }
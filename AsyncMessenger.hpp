@@ -31,8 +31,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <mutex>
 
 #include <unistd.h>
 
@@ -40,6 +41,7 @@
 typedef enum {
     HOST_DETECT_RESULT,
     HOST_CONNECT_RESULT,
+    CACHE_SEND_RESULT,
 } AsyncMessageId_t;
 
 // message struct for IPC data
@@ -55,12 +57,21 @@ typedef struct {
             int proxyFd;
             bool success;            
         } hostConnectResult;
+        struct __attribute__((packed)) {
+            int sessionId;
+            std::uint64_t bytesSent;
+            bool success;
+            bool fromDisk;
+        } cacheSendResult;
     } data;
 } AsyncMessage_t;
 
 /**
  * @brief The AsyncMessenger class is used to send messages asynchronously
- * within the process.
+ * within the process.  Messages from any number of threads are placed on a
+ * bounded, lock-free queue which is drained by the event loop.  An eventfd
+ * wakes the loop, and is only signalled when the queue goes from empty to
+ * non-empty.
  */
 class AsyncMessenger {
 public:
@@ -72,23 +83,37 @@ public:
         return *instance;
     }
 
-    // fd from which the messages can be consumed
+    // fd which becomes readable when messages are waiting
     int GetReadFd();
 
-    // Write a message to the messenger object
+    // Write a message to the messenger object.  Waits for space if the queue is full.
     bool WriteMessage(const AsyncMessage_t& message);
 
-    // Read a message from the messenger object
-    void ReadMessage(AsyncMessage_t& message);
+    // Acknowledge the wakeup, before draining the queue with ReadMessage
+    void ClearSignal();
+
+    // Read a message from the messenger object, returns false if none are waiting.
+    // Must only be called from a single (consumer) thread.
+    bool ReadMessage(AsyncMessage_t& message);
 
 private:
     AsyncMessenger();
 
-    using LockGuard = std::unique_lock<std::mutex>;
+    void Signal();
+
+    static constexpr auto m_capacity = std::size_t{1024}; // must be a power of 2
+
+    typedef struct {
+        std::atomic<std::size_t> sequence;
+        AsyncMessage_t message;
+    } Cell;
 
-    static constexpr auto readPipe = 0;
-    static constexpr auto writePipe = 1;
+    int m_eventFd;
+    Cell* m_cells;
 
-    int m_pipeFds[2];
-    std::mutex m_writeLock;
+    // Number of messages written but not yet read, used to signal the eventfd only
+    // when the queue becomes non-empty.
+    alignas(64) std::atomic<std::int64_t> m_pending;
+    alignas(64) std::atomic<std::size_t> m_writePos;
+    alignas(64) std::size_t m_readPos;
 };
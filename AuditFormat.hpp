@@ -0,0 +1,87 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// On-disk layout of the binary audit store, shared by the proxy and the
+// nermalaudit query tool.
+//
+// The store is a pair of append-only files.  The data file holds one block per
+// audit period:
+//     AuditBlockHeader
+//     AuditUserEntry[userCount]    - each user's range of host records
+//     AuditHostRecord[hostCount]   - grouped by user
+//     char[stringBytes]            - user and host names, not terminated
+// The index file holds one AuditIndexEntry per block, in time order.  A block
+// only counts once its index entry is written, so a torn write is ignored.
+
+constexpr auto auditDataFileName = "audit.dat";
+constexpr auto auditIndexFileName = "audit.idx";
+
+constexpr std::uint32_t auditMagic = 0x4455414e; // "NAUD"
+constexpr std::uint16_t auditVersion = 1;
+
+typedef struct {
+    std::uint32_t magic;
+    std::uint16_t version;
+    std::uint16_t reserved;
+    std::uint64_t periodStart;      // Unix time (s)
+    std::uint64_t periodEnd;        // Unix time (s)
+    std::uint32_t userCount;
+    std::uint32_t hostCount;
+    std::uint32_t stringBytes;
+    std::uint32_t reserved2;
+} AuditBlockHeader;
+
+typedef struct {
+    std::uint32_t nameOffset;       // Into the block's strings
+    std::uint32_t nameLength;
+    std::uint32_t firstHost;
+    std::uint32_t hostCount;
+} AuditUserEntry;
+
+typedef struct {
+    std::uint32_t hostOffset;       // Into the block's strings
+    std::uint32_t hostLength;
+    std::uint64_t rxBytes;
+    std::uint64_t txBytes;
+    std::uint64_t totalTime;        // ms
+    std::uint64_t connections;
+} AuditHostRecord;
+
+typedef struct {
+    std::uint64_t periodStart;
+    std::uint64_t periodEnd;
+    std::uint64_t offset;           // Of the block in the data file
+    std::uint64_t size;
+} AuditIndexEntry;
@@ -0,0 +1,205 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "AuditStore.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+
+namespace {
+
+bool writeAll(int fd, const void* data, size_t size, off_t offset) {
+    auto* bytes = static_cast<const char*>(data);
+    while (size) {
+        auto rc = ::pwrite(fd, bytes, size, offset);
+        if (rc <= 0) {
+            if ((rc == -1) && (errno == EINTR)) {
+                continue;
+            }
+            return false;
+        }
+        bytes += rc;
+        size -= rc;
+        offset += rc;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+AuditStore& AuditStore::Instance() {
+    static AuditStore* instance = new AuditStore;
+    return *instance;
+}
+
+AuditStore::AuditStore()
+    : m_dataFd{-1}
+    , m_indexFd{-1}
+{}
+
+bool AuditStore::Open(const std::string& dir) {
+    if ((-1 == mkdir(dir.c_str(), 0755)) && (errno != EEXIST)) {
+        Log(LogSeverity::Error, "Unable to create audit directory %s", dir.c_str());
+        return false;
+    }
+
+    auto dataPath = dir + "/" + auditDataFileName;
+    auto indexPath = dir + "/" + auditIndexFileName;
+    m_dataFd = ::open(dataPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    m_indexFd = ::open(indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if ((m_dataFd == -1) || (m_indexFd == -1)) {
+        Log(LogSeverity::Error, "Unable to open audit store in %s", dir.c_str());
+        ::close(m_dataFd);
+        ::close(m_indexFd);
+        m_dataFd = -1;
+        m_indexFd = -1;
+        return false;
+    }
+
+    // Drop anything after the last complete block, left by an interrupted write
+    auto st = (struct stat){};
+    fstat(m_indexFd, &st);
+    auto entries = static_cast<off_t>(st.st_size / sizeof(AuditIndexEntry));
+    auto dataSize = off_t{0};
+    if (entries) {
+        auto last = AuditIndexEntry{};
+        if (::pread(m_indexFd, &last, sizeof(last), (entries - 1) * sizeof(last)) == sizeof(last)) {
+            dataSize = last.offset + last.size;
+        } else {
+            entries = 0;
+        }
+    }
+    auto rc = ftruncate(m_indexFd, entries * sizeof(AuditIndexEntry));
+    rc |= ftruncate(m_dataFd, dataSize);
+    if (rc) {
+        Log(LogSeverity::Warn, "Unable to trim audit store");
+    }
+
+    Log(LogSeverity::Info, "Audit store %s: %lld periods", dir.c_str(), static_cast<long long>(entries));
+    return true;
+}
+
+bool AuditStore::IsEnabled() {
+    return (m_dataFd != -1);
+}
+
+void AuditStore::Append(std::uint64_t periodStart, std::uint64_t periodEnd,
+                        std::unordered_map<std::string, UserStats>& userStats) {
+    m_users.clear();
+    m_hosts.clear();
+    m_strings.clear();
+    m_stringOffsets.clear();
+
+    for (auto& stat : userStats) {
+        if (stat.second.GetStatCount() == 0) {
+            continue;
+        }
+
+        auto user = AuditUserEntry{};
+        user.nameOffset = AddString(stat.first);
+        user.nameLength = stat.first.size();
+        user.firstHost = m_hosts.size();
+
+        stat.second.ForEachHost([this](const std::string& host, const SiteCounters& counters) {
+            auto record = AuditHostRecord{};
+            record.hostOffset = AddString(host);
+            record.hostLength = host.size();
+            record.rxBytes = counters.rxBytes;
+            record.txBytes = counters.txBytes;
+            record.totalTime = counters.totalTime;
+            record.connections = counters.connections;
+            m_hosts.push_back(record);
+        });
+
+        user.hostCount = m_hosts.size() - user.firstHost;
+        m_users.push_back(user);
+    }
+
+    if (!m_users.empty() && !WriteBlock(periodStart, periodEnd)) {
+        Log(LogSeverity::Warn, "Error appending to audit store %d(%s)", errno, strerror(errno));
+    }
+}
+
+std::uint32_t AuditStore::AddString(const std::string& value) {
+    auto it = m_stringOffsets.find(value);
+    if (it != m_stringOffsets.end()) {
+        return it->second;
+    }
+    auto offset = static_cast<std::uint32_t>(m_strings.size());
+    m_strings.append(value);
+    m_stringOffsets.emplace(value, offset);
+    return offset;
+}
+
+bool AuditStore::WriteBlock(std::uint64_t periodStart, std::uint64_t periodEnd) {
+    auto header = AuditBlockHeader{};
+    header.magic = auditMagic;
+    header.version = auditVersion;
+    header.periodStart = periodStart;
+    header.periodEnd = periodEnd;
+    header.userCount = m_users.size();
+    header.hostCount = m_hosts.size();
+    header.stringBytes = m_strings.size();
+
+    auto dataStat = (struct stat){};
+    auto indexStat = (struct stat){};
+    if (fstat(m_dataFd, &dataStat) || fstat(m_indexFd, &indexStat)) {
+        return false;
+    }
+
+    auto entry = AuditIndexEntry{};
+    entry.periodStart = periodStart;
+    entry.periodEnd = periodEnd;
+    entry.offset = dataStat.st_size;
+    entry.size = sizeof(header) +
+                 (m_users.size() * sizeof(AuditUserEntry)) +
+                 (m_hosts.size() * sizeof(AuditHostRecord)) +
+                 m_strings.size();
+
+    // The block must be on disk before the index entry that makes it visible
+    auto offset = static_cast<off_t>(entry.offset);
+    auto ok = writeAll(m_dataFd, &header, sizeof(header), offset);
+    offset += sizeof(header);
+    ok = ok && writeAll(m_dataFd, m_users.data(), m_users.size() * sizeof(AuditUserEntry), offset);
+    offset += m_users.size() * sizeof(AuditUserEntry);
+    ok = ok && writeAll(m_dataFd, m_hosts.data(), m_hosts.size() * sizeof(AuditHostRecord), offset);
+    offset += m_hosts.size() * sizeof(AuditHostRecord);
+    ok = ok && writeAll(m_dataFd, m_strings.data(), m_strings.size(), offset);
+    ok = ok && (fdatasync(m_dataFd) == 0);
+    ok = ok && writeAll(m_indexFd, &entry, sizeof(entry), indexStat.st_size);
+    ok = ok && (fdatasync(m_indexFd) == 0);
+    return ok;
+}
@@ -0,0 +1,73 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AuditFormat.hpp"
+#include "UserAuth.hpp"
+
+/**
+ * @brief The AuditStore class appends each audit period's stats to a compact
+ * binary store (see AuditFormat.hpp), which nermalaudit can query across
+ * periods.
+ */
+class AuditStore {
+public:
+    static AuditStore& Instance();
+
+    // Open (creating if needed) the store in the given directory
+    bool Open(const std::string& dir);
+    bool IsEnabled();
+
+    // Append one period's stats as a new block
+    void Append(std::uint64_t periodStart, std::uint64_t periodEnd,
+                std::unordered_map<std::string, UserStats>& userStats);
+
+private:
+    AuditStore();
+
+    std::uint32_t AddString(const std::string& value);
+    bool WriteBlock(std::uint64_t periodStart, std::uint64_t periodEnd);
+
+    int m_dataFd;
+    int m_indexFd;
+
+    // Block being built, reused between periods
+    std::vector<AuditUserEntry> m_users;
+    std::vector<AuditHostRecord> m_hosts;
+    std::string m_strings;
+    std::unordered_map<std::string, std::uint32_t> m_stringOffsets;
+};
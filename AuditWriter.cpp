@@ -0,0 +1,79 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "AuditWriter.hpp"
+
+#include <thread>
+#include <utility>
+
+#include "AuditStore.hpp"
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+AuditWriter& AuditWriter::Instance() {
+    static AuditWriter* instance = new AuditWriter;
+    return *instance;
+}
+
+void AuditWriter::Start() {
+    auto* writerThread = new std::thread(&AuditWriter::WriterMain, this);
+    writerThread->detach();
+}
+
+void AuditWriter::Submit(AuditSnapshot& snapshot) {
+    auto lg = LockGuard{m_lock};
+    m_pending.emplace_back(AuditSnapshot{snapshot.logNumber, snapshot.periodStart, snapshot.periodEnd,
+                                         std::move(snapshot.userStats)});
+    snapshot.userStats.clear();
+    m_signal.notify_one();
+}
+
+void AuditWriter::WriterMain() {
+    while (true) {
+        auto snapshot = AuditSnapshot{};
+        {
+            auto lg = LockGuard{m_lock};
+            m_signal.wait(lg, [this]() { return !m_pending.empty(); });
+            snapshot = std::move(m_pending.front());
+            m_pending.pop_front();
+        }
+
+        auto start = Timestamp();
+        for (auto& stat : snapshot.userStats) {
+            stat.second.LogToFile(snapshot.logNumber);
+        }
+        if (AuditStore::Instance().IsEnabled()) {
+            AuditStore::Instance().Append(snapshot.periodStart, snapshot.periodEnd, snapshot.userStats);
+        }
+        Log(LogSeverity::Debug, "Wrote audit log %d for %zu users in %llums", snapshot.logNumber,
+            snapshot.userStats.size(), static_cast<unsigned long long>(Timestamp() - start));
+    }
+}
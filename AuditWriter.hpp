@@ -0,0 +1,74 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "UserAuth.hpp"
+
+// A period's audit stats, handed off to be written to disk
+typedef struct {
+    int logNumber;
+    std::uint64_t periodStart;      // Unix time (s)
+    std::uint64_t periodEnd;
+    std::unordered_map<std::string, UserStats> userStats;
+} AuditSnapshot;
+
+/**
+ * @brief The AuditWriter class writes audit logs on a background thread, so
+ * that the file I/O (and fsync) never holds up the event loop.
+ */
+class AuditWriter {
+public:
+    static AuditWriter& Instance();
+
+    void Start();
+
+    // Queue a snapshot to be written; the snapshot is moved from
+    void Submit(AuditSnapshot& snapshot);
+
+private:
+    AuditWriter() = default;
+
+    void WriterMain();
+
+    using LockGuard = std::unique_lock<std::mutex>;
+
+    std::mutex m_lock;
+    std::condition_variable m_signal;
+    std::deque<AuditSnapshot> m_pending;
+};
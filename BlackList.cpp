@@ -38,7 +38,8 @@
 #include <string.h>
 
 Blacklist::Blacklist(const std::string& name) :
-    m_name{name}
+    m_name{name},
+    m_hits{0}
 {}
 
 void Blacklist::Clear() {
@@ -86,9 +87,14 @@ bool Blacklist::IsHostAllowed(const std::string& host) {
     if (m_blacklist.find(host) == m_blacklist.end()) {
         return true;
     }
+    m_hits.fetch_add(1, std::memory_order_relaxed);
     return false;
 }
 
+std::uint64_t Blacklist::GetHits() const {
+    return m_hits.load(std::memory_order_relaxed);
+}
+
 BlacklistList& BlacklistList::Instance() {
     static BlacklistList* instance = new BlacklistList();
     return *instance;
@@ -107,6 +113,12 @@ bool BlacklistList::IsAllowedInList(const std::string& name, const std::string&
     return false; // No list for name...
 }
 
+void BlacklistList::ForEachList(const std::function<void(Blacklist&)>& visitor) {
+    for (auto& list : m_blacklists) {
+        visitor(*list);
+    }
+}
+
 bool BlacklistList::HasList(const std::string& name) {
     for (auto& list : m_blacklists) {
         if (name == list->GetName()) {
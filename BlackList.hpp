@@ -32,6 +32,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <list>
 #include <set>
 #include <memory>
@@ -59,9 +62,13 @@ public:
     // Check to see whether or not a domain is allowed or blocked in this list
     bool IsHostAllowed(const std::string& host);
 
+    // Number of hosts blocked by this list
+    std::uint64_t GetHits() const;
+
 private:
     std::string m_name;
     std::set<std::string> m_blacklist;
+    std::atomic<std::uint64_t> m_hits;
 };
 
 /**
@@ -80,6 +87,8 @@ public:
     // Check to see if a blacklist exists in the object
     bool HasList(const std::string& name);
 
+    void ForEachList(const std::function<void(Blacklist&)>& visitor);
+
 private:
     std::list<std::unique_ptr<Blacklist>> m_blacklists;
 };
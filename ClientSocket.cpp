@@ -39,6 +39,23 @@
 #include <unistd.h>
 
 #include "Log.hpp"
+#include "ObjectPool.hpp"
+#include "SocketIo.hpp"
+
+namespace {
+
+// Two sockets per proxied connection; SocketManager prunes beyond a few hundred
+using SocketPool = ObjectPool<ClientSocket, 512>;
+
+} // anonymous namespace
+
+void* ClientSocket::operator new(std::size_t size) {
+    return SocketPool::Instance("sockets").Allocate(size);
+}
+
+void ClientSocket::operator delete(void* block) {
+    SocketPool::Instance("sockets").Free(block);
+}
 
 ClientSocket::ClientSocket(const int socketFd, const int proxyFd, const int sessionId, const bool isClientToProxy)
     : m_isActive{true}
@@ -49,7 +66,9 @@ ClientSocket::ClientSocket(const int socketFd, const int proxyFd, const int sess
 {}
 
 ClientSocket::~ClientSocket() {
-    ::close(m_socketFd);
+    if (m_socketFd >= 0) {
+        SocketIo::Instance().Close(m_socketFd);
+    }
     m_socketFd = -1;
 }
 int ClientSocket::GetFd() const {
@@ -75,7 +94,7 @@ std::size_t ClientSocket::Read(void* readBuf_, std::size_t bytesToRead_, bool* i
     auto done = false;
     auto numRead = size_t{};
     while (!done) {
-        numRead = ::read(m_socketFd, readBuf_, bytesToRead_);
+        numRead = SocketIo::Instance().Read(m_socketFd, readBuf_, bytesToRead_);
         if (numRead <= 0) {
             if ((numRead == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
                 // Recoverable errors
@@ -111,7 +130,7 @@ std::size_t ClientSocket::Write(const void* writeBuf_, std::size_t bytesToWrite_
 
     while (bytesToWrite_) {
 
-        auto numWritten = ::write(m_peerFd, writePtr, bytesToWrite_);
+        auto numWritten = SocketIo::Instance().Write(m_peerFd, writePtr, bytesToWrite_);
         if (numWritten <= 0) {
             // Recoverable errors
             if ((numWritten == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
@@ -145,6 +164,13 @@ bool ClientSocket::IsClientToProxy() {
     return m_isClientToProxy;
 }
 
+int ClientSocket::DetachFd() {
+    auto fd = m_socketFd;
+    m_socketFd = -1;
+    m_isActive = false;
+    return fd;
+}
+
 void ClientSocket::OnError() {
     if (m_isActive) {
         m_isActive = false;
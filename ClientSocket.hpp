@@ -45,6 +45,10 @@ public:
     ClientSocket(const int socketFd, const int proxyFd, const int sessionId, const bool clientToProxy);
     virtual ~ClientSocket();
 
+    // Sockets are allocated from a fixed pool rather than the heap
+    static void* operator new(std::size_t size);
+    static void operator delete(void* block);
+
     // Get the fd representing the connection
     int GetFd() const override;
 
@@ -68,6 +72,10 @@ public:
     // (as opposed to a target-to-proxy channel)
     bool IsClientToProxy();
 
+    // Hand ownership of the underlying fd to the caller - it is no longer closed
+    // when this object is destroyed.
+    int DetachFd();
+
 private:
     void OnError();
 
@@ -0,0 +1,442 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "DiskCache.hpp"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <unordered_set>
+
+#include "DiskCacheWriter.hpp"
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+namespace {
+
+constexpr auto indexFileName = "index";
+constexpr auto indexVersion = "nermal-cache 1";
+
+// FNV-1a hash of the cache key, used to name the file holding the response
+std::string getFileName(const std::string& key) {
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    for (auto c : key) {
+        hash ^= static_cast<std::uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return std::string{name};
+}
+
+// Fields in the index are tab-separated, one entry per line
+bool isIndexSafe(const std::string& value) {
+    return (value.find_first_of("\t\r\n") == std::string::npos);
+}
+
+} // anonymous namespace
+
+DiskCache& DiskCache::Instance() {
+    static DiskCache* instance = new DiskCache;
+    return *instance;
+}
+
+DiskCache::DiskCache()
+    : m_enabled{false}
+    , m_dirty{false}
+    , m_maxSize{1024ULL * 1024 * 1024}
+    , m_maxObjectSize{1024ULL * 1024 * 1024}
+    , m_size{0}
+    , m_hits{0}
+    , m_misses{0}
+    , m_revalidations{0}
+    , m_bytesServed{0}
+    , m_bytesSaved{0}
+    , m_lastSync{Timestamp()}
+    , m_lastReport{Timestamp()}
+{}
+
+bool DiskCache::Open(const std::string& directory) {
+    if ((-1 == mkdir(directory.c_str(), 0755)) && (errno != EEXIST)) {
+        Log(LogSeverity::Error, "Unable to create cache directory %s", directory.c_str());
+        return false;
+    }
+
+    m_directory = directory;
+    LoadIndex();
+
+    // Anything not in the index is either a partial download or an entry written
+    // after the index was last saved - neither can be trusted.
+    auto* dir = opendir(m_directory.c_str());
+    if (!dir) {
+        Log(LogSeverity::Error, "Unable to open cache directory %s", directory.c_str());
+        return false;
+    }
+
+    auto fileNames = std::unordered_set<std::string>{};
+    for (auto& entry : m_entries) {
+        fileNames.insert(entry.fileName);
+    }
+
+    while (auto* dirEntry = readdir(dir)) {
+        auto name = std::string{dirEntry->d_name};
+        if ((dirEntry->d_type != DT_REG) || (name == indexFileName) || fileNames.count(name)) {
+            continue;
+        }
+        unlink(GetFilePath(name).c_str());
+    }
+    closedir(dir);
+
+    m_enabled = true;
+    Evict();
+
+    Log(LogSeverity::Info, "Disk cache %s: %zu entries (%llu bytes)", m_directory.c_str(), m_entries.size(), m_size);
+    return true;
+}
+
+bool DiskCache::IsEnabled() {
+    return m_enabled;
+}
+
+void DiskCache::SetMaxSize(std::uint64_t maxBytes) {
+    m_maxSize = maxBytes;
+    Evict();
+}
+
+void DiskCache::SetMaxObjectSize(std::uint64_t maxBytes) {
+    m_maxObjectSize = maxBytes;
+}
+
+std::uint64_t DiskCache::GetMaxObjectSize() {
+    return m_maxObjectSize;
+}
+
+ResponseCache::Result DiskCache::Lookup(const std::string& key, const DiskCacheEntry*& entry, int& fileFd) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        m_misses++;
+        return ResponseCache::Result::Miss;
+    }
+
+    // Move to the front of the LRU list
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    m_dirty = true;
+    entry = &(*it->second);
+
+    if (entry->expires > time(nullptr)) {
+        // Not written out yet - not servable, but not missing either
+        if (DiskCacheWriter::Instance().IsPending(GetFilePath(entry->fileName))) {
+            m_misses++;
+            return ResponseCache::Result::Miss;
+        }
+
+        fileFd = OpenEntry(*entry);
+        if (fileFd == -1) {
+            Erase(it->second);
+            m_misses++;
+            return ResponseCache::Result::Miss;
+        }
+        m_hits++;
+        return ResponseCache::Result::Hit;
+    }
+
+    if (entry->etag.empty() && entry->lastModified.empty()) {
+        m_misses++;
+        return ResponseCache::Result::Miss;
+    }
+    return ResponseCache::Result::Stale;
+}
+
+const DiskCacheEntry* DiskCache::Find(const std::string& key) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        return nullptr;
+    }
+    return &(*it->second);
+}
+
+int DiskCache::OpenEntry(const DiskCacheEntry& entry) {
+    auto fd = ::open(GetFilePath(entry.fileName).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    auto info = (struct stat){};
+    if ((-1 == fstat(fd, &info)) || (static_cast<std::uint64_t>(info.st_size) != entry.size)) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool DiskCache::BeginStore(int sessionId, std::string& data) {
+    if (!m_enabled || !DiskCacheWriter::Instance().HasRoom(data.size())) {
+        return false;
+    }
+    DiskCacheWriter::Instance().Append(GetTempPath(sessionId), data);
+    return true;
+}
+
+bool DiskCache::AppendStore(int sessionId, const void* data, std::size_t size) {
+    // Give up on the response rather than queue without limit behind a slow disk
+    if (!DiskCacheWriter::Instance().HasRoom(size)) {
+        return false;
+    }
+    auto chunk = std::string{static_cast<const char*>(data), size};
+    DiskCacheWriter::Instance().Append(GetTempPath(sessionId), chunk);
+    return true;
+}
+
+void DiskCache::CommitStore(int sessionId, const std::string& key, const ResponseTracker& tracker, std::uint64_t size) {
+    auto tempPath = GetTempPath(sessionId);
+    auto entry = DiskCacheEntry{};
+    entry.key = key;
+    entry.size = size;
+    if ((size > m_maxObjectSize) ||
+        !ResponseCache::IsStorable(tracker, entry.etag, entry.lastModified, entry.expires) ||
+        !Insert(entry, tempPath)) {
+        DiskCacheWriter::Instance().Remove(tempPath);
+    }
+}
+
+void DiskCache::AbortStore(int sessionId) {
+    DiskCacheWriter::Instance().Remove(GetTempPath(sessionId));
+}
+
+void DiskCache::StoreResponse(CachedResponse& response) {
+    if (!m_enabled || (response.response.size() > m_maxObjectSize)) {
+        return;
+    }
+
+    // Expired entries are only worth keeping if they can be revalidated
+    if ((response.expires <= time(nullptr)) && response.etag.empty() && response.lastModified.empty()) {
+        return;
+    }
+
+    auto& writer = DiskCacheWriter::Instance();
+    if (!writer.HasRoom(response.response.size())) {
+        return;
+    }
+
+    auto entry = DiskCacheEntry{};
+    entry.key = response.key;
+    entry.size = response.response.size();
+    entry.etag = response.etag;
+    entry.lastModified = response.lastModified;
+    entry.expires = response.expires;
+
+    auto tempPath = GetTempPath(-1);
+    writer.Append(tempPath, response.response);
+    if (!Insert(entry, tempPath)) {
+        writer.Remove(tempPath);
+    }
+}
+
+void DiskCache::Remove(const std::string& key) {
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        Erase(it->second);
+    }
+}
+
+void DiskCache::Refresh(const std::string& key, const ResponseTracker& tracker) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        return;
+    }
+
+    auto& entry = *it->second;
+    ResponseCache::GetFreshness(tracker, entry.expires);
+    tracker.GetHeaderValue("ETag", entry.etag);
+    tracker.GetHeaderValue("Last-Modified", entry.lastModified);
+    m_revalidations++;
+    m_dirty = true;
+}
+
+void DiskCache::AddServedBytes(std::uint64_t bytes, std::uint64_t bytesFetched) {
+    m_bytesServed += bytes;
+    if (bytes > bytesFetched) {
+        m_bytesSaved += (bytes - bytesFetched);
+    }
+}
+
+void DiskCache::Sync() {
+    if (!m_enabled) {
+        return;
+    }
+
+    if (DiskCacheWriter::Instance().TakeFailure()) {
+        m_dirty = true;
+    }
+
+    if (m_dirty && ((Timestamp() - m_lastSync) >= m_syncInterval)) {
+        m_lastSync = Timestamp();
+        SaveIndex();
+        m_dirty = false;
+    }
+
+    if ((Timestamp() - m_lastReport) >= m_reportInterval) {
+        m_lastReport = Timestamp();
+
+        auto lookups = m_hits + m_revalidations + m_misses;
+        auto hitRatio = lookups ? (100.0 * (m_hits + m_revalidations)) / lookups : 0.0;
+        Log(LogSeverity::Info, "Disk cache: %zu entries (%llu bytes), %.1f%% hit ratio (%llu hits, %llu revalidated, %llu misses), %llu bytes served, %llu bytes saved",
+            m_entries.size(), m_size, hitRatio, m_hits, m_revalidations, m_misses, m_bytesServed, m_bytesSaved);
+    }
+}
+
+std::string DiskCache::GetFilePath(const std::string& fileName) {
+    return m_directory + "/" + fileName;
+}
+
+std::string DiskCache::GetTempPath(int sessionId) {
+    return m_directory + "/tmp." + std::to_string(sessionId);
+}
+
+bool DiskCache::Insert(DiskCacheEntry& entry, const std::string& tempPath) {
+    if (!isIndexSafe(entry.key) || !isIndexSafe(entry.etag) || !isIndexSafe(entry.lastModified)) {
+        return false;
+    }
+
+    Remove(entry.key);
+
+    // Two keys hashing to the same name can't both be stored - keep the newest.
+    entry.fileName = getFileName(entry.key);
+    for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+        if (it->fileName == entry.fileName) {
+            Erase(it);
+            break;
+        }
+    }
+
+    // Queued ahead of any eviction below, so the file is renamed before it's removed
+    DiskCacheWriter::Instance().Commit(tempPath, GetFilePath(entry.fileName));
+
+    m_size += entry.size;
+    m_entries.emplace_front(std::move(entry));
+    m_index[m_entries.front().key] = m_entries.begin();
+    m_dirty = true;
+    Log(LogSeverity::Debug, "Cached %s on disk (%llu bytes)", m_entries.front().key.c_str(), m_entries.front().size);
+
+    Evict();
+    return true;
+}
+
+void DiskCache::Erase(std::list<DiskCacheEntry>::iterator it) {
+    DiskCacheWriter::Instance().Remove(GetFilePath(it->fileName));
+    m_size -= it->size;
+    m_index.erase(it->key);
+    m_entries.erase(it);
+    m_dirty = true;
+}
+
+bool DiskCache::LoadIndex() {
+    auto* file = fopen(GetFilePath(indexFileName).c_str(), "r");
+    if (!file) {
+        return false;
+    }
+
+    char* lineBuf = nullptr;
+    auto lineSize = size_t{};
+    auto valid = (-1 != getline(&lineBuf, &lineSize, file)) && (0 == strncmp(lineBuf, indexVersion, strlen(indexVersion)));
+
+    // Each line holds: file name, size, expiry time, ETag, Last-Modified, key
+    while (valid && (-1 != getline(&lineBuf, &lineSize, file))) {
+        auto line = std::string{lineBuf};
+        if (!line.empty() && (line.back() == '\n')) {
+            line.pop_back();
+        }
+
+        std::string fields[6];
+        auto start = std::size_t{0};
+        auto count = 0;
+        for (; count < 6; count++) {
+            auto end = (count < 5) ? line.find('\t', start) : line.size();
+            if (end == std::string::npos) {
+                break;
+            }
+            fields[count].assign(line, start, end - start);
+            start = end + 1;
+        }
+        if ((count != 6) || fields[5].empty() || m_index.count(fields[5])) {
+            continue;
+        }
+
+        auto entry = DiskCacheEntry{};
+        entry.fileName = fields[0];
+        entry.size = strtoull(fields[1].c_str(), nullptr, 10);
+        entry.expires = static_cast<std::time_t>(strtoll(fields[2].c_str(), nullptr, 10));
+        entry.etag = fields[3];
+        entry.lastModified = fields[4];
+        entry.key = fields[5];
+
+        // Skip entries whose file went missing or was only partly written
+        auto info = (struct stat){};
+        if ((-1 == stat(GetFilePath(entry.fileName).c_str(), &info)) ||
+            (static_cast<std::uint64_t>(info.st_size) != entry.size)) {
+            continue;
+        }
+
+        m_size += entry.size;
+        m_entries.emplace_back(std::move(entry));
+        m_index[m_entries.back().key] = std::prev(m_entries.end());
+    }
+
+    free(lineBuf);
+    fclose(file);
+    return valid;
+}
+
+void DiskCache::SaveIndex() {
+    auto contents = std::string{indexVersion} + "\n";
+    for (auto& entry : m_entries) {
+        contents += entry.fileName + "\t" + std::to_string(entry.size) + "\t" +
+                    std::to_string(static_cast<long long>(entry.expires)) + "\t" + entry.etag + "\t" +
+                    entry.lastModified + "\t" + entry.key + "\n";
+    }
+    DiskCacheWriter::Instance().Replace(GetFilePath(indexFileName), contents);
+}
+
+void DiskCache::Evict() {
+    while ((m_size > m_maxSize) && !m_entries.empty()) {
+        Log(LogSeverity::Debug, "Evicting %s from disk cache", m_entries.back().key.c_str());
+        Erase(std::prev(m_entries.end()));
+    }
+}
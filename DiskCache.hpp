@@ -0,0 +1,153 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "ResponseCache.hpp"
+#include "ResponseTracker.hpp"
+
+/**
+ * @brief The DiskCacheEntry struct describes a response stored in the disk
+ * cache.  The response itself (headers + body) is held in its own file.
+ */
+typedef struct {
+    std::string key;
+    std::string fileName;
+    std::uint64_t size;
+    std::string etag;
+    std::string lastModified;
+    std::time_t expires;
+} DiskCacheEntry;
+
+/**
+ * @brief The DiskCache class is the second tier of the response cache, holding
+ * responses too large for the in-memory ResponseCache as well as entries evicted
+ * from it.  Each response is stored in a file under the cache directory, with an
+ * index file that allows the cache to survive a restart.  Total size is bounded,
+ * with the least recently used responses evicted first.  Like the ResponseCache,
+ * it is only accessed from the event loop thread; the file I/O it needs is handed
+ * to the DiskCacheWriter.
+ */
+class DiskCache {
+public:
+    static DiskCache& Instance();
+
+    // Set the directory holding cached responses, and load the index stored in it
+    bool Open(const std::string& directory);
+    bool IsEnabled();
+
+    // Set the limit on total disk space used by cached responses
+    void SetMaxSize(std::uint64_t maxBytes);
+
+    // Set the largest response that will be stored on disk
+    void SetMaxObjectSize(std::uint64_t maxBytes);
+    std::uint64_t GetMaxObjectSize();
+
+    // Find the entry for a given key.  On Hit, fileFd is an open descriptor for the
+    // response, which the caller must close.  On Hit or Stale, entry points to the entry.
+    ResponseCache::Result Lookup(const std::string& key, const DiskCacheEntry*& entry, int& fileFd);
+
+    // Find the entry for a given key without affecting statistics, or nullptr if not present
+    const DiskCacheEntry* Find(const std::string& key);
+
+    // Open the file holding an entry's response, returns -1 on failure
+    int OpenEntry(const DiskCacheEntry& entry);
+
+    // Begin storing a response as it arrives, starting with data (moved from).
+    // Returns false if it can't be stored.
+    bool BeginStore(int sessionId, std::string& data);
+
+    // Add more of a response begun via BeginStore, returns false if it can't be stored
+    bool AppendStore(int sessionId, const void* data, std::size_t size);
+
+    // Store a response written via BeginStore, if the server allows it
+    void CommitStore(int sessionId, const std::string& key, const ResponseTracker& tracker, std::uint64_t size);
+
+    // Discard a response written via BeginStore
+    void AbortStore(int sessionId);
+
+    // Store a response that has been evicted from the in-memory cache; its
+    // response data is moved from
+    void StoreResponse(CachedResponse& response);
+
+    // Remove an entry (i.e. when a newer response is held in memory)
+    void Remove(const std::string& key);
+
+    // Refresh the lifetime and validators (ETag, Last-Modified) of an entry after the
+    // server confirmed it's unchanged (304).
+    void Refresh(const std::string& key, const ResponseTracker& tracker);
+
+    // Account for a response served from the disk cache
+    void AddServedBytes(std::uint64_t bytes, std::uint64_t bytesFetched);
+
+    // Write out the index if it has changed, and periodically log statistics
+    void Sync();
+
+private:
+    DiskCache();
+
+    std::string GetFilePath(const std::string& fileName);
+    std::string GetTempPath(int sessionId);
+    bool Insert(DiskCacheEntry& entry, const std::string& tempPath);
+    void Erase(std::list<DiskCacheEntry>::iterator it);
+    bool LoadIndex();
+    void SaveIndex();
+    void Evict();
+
+    static constexpr auto m_syncInterval = 30 * 1000; // ms
+    static constexpr auto m_reportInterval = 300 * 1000; // ms
+
+    bool m_enabled;
+    bool m_dirty;
+    std::string m_directory;
+    std::uint64_t m_maxSize;
+    std::uint64_t m_maxObjectSize;
+    std::uint64_t m_size;
+
+    std::uint64_t m_hits;
+    std::uint64_t m_misses;
+    std::uint64_t m_revalidations;
+    std::uint64_t m_bytesServed;
+    std::uint64_t m_bytesSaved;
+    std::uint64_t m_lastSync;
+    std::uint64_t m_lastReport;
+
+    // Most recently used entries are kept at the front of the list
+    std::list<DiskCacheEntry> m_entries;
+    std::unordered_map<std::string, std::list<DiskCacheEntry>::iterator> m_index;
+};
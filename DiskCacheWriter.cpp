@@ -0,0 +1,201 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "DiskCacheWriter.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <thread>
+#include <utility>
+
+#include "Log.hpp"
+
+namespace {
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size) {
+        auto rc = ::write(fd, data, size);
+        if (rc <= 0) {
+            if ((rc == -1) && (errno == EINTR)) {
+                continue;
+            }
+            return false;
+        }
+        data += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+DiskCacheWriter& DiskCacheWriter::Instance() {
+    static DiskCacheWriter* instance = new DiskCacheWriter;
+    return *instance;
+}
+
+void DiskCacheWriter::Start() {
+    auto* writerThread = new std::thread(&DiskCacheWriter::WriterMain, this);
+    writerThread->detach();
+}
+
+bool DiskCacheWriter::HasRoom(std::size_t size) {
+    auto lg = LockGuard{m_lock};
+    return (m_queuedBytes + size) <= m_maxQueuedBytes;
+}
+
+void DiskCacheWriter::Append(const std::string& path, std::string& data) {
+    Submit(DiskCacheOp::Append, path, std::string{}, data);
+}
+
+void DiskCacheWriter::Commit(const std::string& path, const std::string& target) {
+    auto data = std::string{};
+    Submit(DiskCacheOp::Commit, path, target, data);
+}
+
+void DiskCacheWriter::Remove(const std::string& path) {
+    auto data = std::string{};
+    Submit(DiskCacheOp::Remove, path, std::string{}, data);
+}
+
+void DiskCacheWriter::Replace(const std::string& path, std::string& contents) {
+    Submit(DiskCacheOp::Replace, path, std::string{}, contents);
+}
+
+bool DiskCacheWriter::IsPending(const std::string& path) {
+    auto lg = LockGuard{m_lock};
+    return m_commits.count(path);
+}
+
+bool DiskCacheWriter::TakeFailure() {
+    auto lg = LockGuard{m_lock};
+    auto failed = m_failed;
+    m_failed = false;
+    return failed;
+}
+
+void DiskCacheWriter::Submit(DiskCacheOp op, const std::string& path, const std::string& target, std::string& data) {
+    auto lg = LockGuard{m_lock};
+    m_queuedBytes += data.size();
+    if (op == DiskCacheOp::Commit) {
+        m_commits[target]++;
+    }
+    m_pending.emplace_back(DiskCacheJob{op, path, target, std::move(data)});
+    data.clear();
+    m_signal.notify_one();
+}
+
+void DiskCacheWriter::WriterMain() {
+    while (true) {
+        auto job = DiskCacheJob{};
+        {
+            auto lg = LockGuard{m_lock};
+            m_signal.wait(lg, [this]() { return !m_pending.empty(); });
+            job = std::move(m_pending.front());
+            m_pending.pop_front();
+        }
+
+        // Data stays counted against the limit until it's been written
+        auto size = job.data.size();
+        Run(job);
+
+        auto lg = LockGuard{m_lock};
+        m_queuedBytes -= size;
+        if (job.op == DiskCacheOp::Commit) {
+            auto it = m_commits.find(job.target);
+            if (--it->second == 0) {
+                m_commits.erase(it);
+            }
+        }
+    }
+}
+
+void DiskCacheWriter::Run(DiskCacheJob& job) {
+    switch (job.op) {
+    case DiskCacheOp::Append: {
+        auto it = m_files.find(job.path);
+        if (it == m_files.end()) {
+            auto fd = ::open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            it = m_files.emplace(job.path, fd).first;
+        }
+        if ((it->second != -1) && !writeAll(it->second, job.data.data(), job.data.size())) {
+            ::close(it->second);
+            it->second = -1;
+        }
+        break;
+    }
+
+    case DiskCacheOp::Commit: {
+        // A file that failed to write, or was never written, can't be committed
+        auto it = m_files.find(job.path);
+        auto ok = (it != m_files.end()) && (it->second != -1);
+        if (it != m_files.end()) {
+            ok = (0 == ::close(it->second)) && ok;
+            m_files.erase(it);
+        }
+        if (!ok || (-1 == rename(job.path.c_str(), job.target.c_str()))) {
+            Log(LogSeverity::Warn, "Unable to store %s in disk cache", job.target.c_str());
+            unlink(job.path.c_str());
+        }
+        break;
+    }
+
+    case DiskCacheOp::Remove: {
+        auto it = m_files.find(job.path);
+        if (it != m_files.end()) {
+            if (it->second != -1) {
+                ::close(it->second);
+            }
+            m_files.erase(it);
+        }
+        unlink(job.path.c_str());
+        break;
+    }
+
+    case DiskCacheOp::Replace: {
+        // Write to a temporary file first so a crash never leaves a truncated file behind
+        auto tempPath = job.path + ".tmp";
+        auto fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        auto ok = (fd != -1) && writeAll(fd, job.data.data(), job.data.size()) && (0 == fsync(fd));
+        ok = (fd != -1) && (0 == ::close(fd)) && ok;
+        if (!ok || (-1 == rename(tempPath.c_str(), job.path.c_str()))) {
+            Log(LogSeverity::Warn, "Unable to write %s", job.path.c_str());
+            unlink(tempPath.c_str());
+            auto lg = LockGuard{m_lock};
+            m_failed = true;
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,112 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+enum class DiskCacheOp {
+    Append,
+    Commit,
+    Remove,
+    Replace
+};
+
+// A file operation queued for the disk cache writer
+typedef struct {
+    DiskCacheOp op;
+    std::string path;
+    std::string target;
+    std::string data;
+} DiskCacheJob;
+
+/**
+ * @brief The DiskCacheWriter class does the disk cache's file I/O on a background
+ * thread, so that storing responses and saving the index never holds up the event
+ * loop.  Operations are carried out in the order they were queued.
+ */
+class DiskCacheWriter {
+public:
+    static DiskCacheWriter& Instance();
+
+    void Start();
+
+    // Whether another size bytes can be queued without exceeding the limit on
+    // data waiting to be written
+    bool HasRoom(std::size_t size);
+
+    // Append to the file at path, creating it on the first append; data is moved from
+    void Append(const std::string& path, std::string& data);
+
+    // Close the file at path and rename it to target
+    void Commit(const std::string& path, const std::string& target);
+
+    // Close and remove the file at path
+    void Remove(const std::string& path);
+
+    // Replace the file at path with contents, synced to disk before it's renamed
+    // into place; contents is moved from
+    void Replace(const std::string& path, std::string& contents);
+
+    // Whether a commit to the file at path is still queued
+    bool IsPending(const std::string& path);
+
+    // Whether a Replace has failed since the last call
+    bool TakeFailure();
+
+private:
+    DiskCacheWriter() = default;
+
+    void Submit(DiskCacheOp op, const std::string& path, const std::string& target, std::string& data);
+    void WriterMain();
+    void Run(DiskCacheJob& job);
+
+    using LockGuard = std::unique_lock<std::mutex>;
+
+    static constexpr std::size_t m_maxQueuedBytes = 64 * 1024 * 1024;
+
+    std::mutex m_lock;
+    std::condition_variable m_signal;
+    std::deque<DiskCacheJob> m_pending;
+    std::size_t m_queuedBytes = 0;
+    bool m_failed = false;
+
+    // Number of queued commits to each target, so entries aren't read before they exist
+    std::unordered_map<std::string, int> m_commits;
+
+    // Files being appended to, only touched by the writer thread.  -1 once a write failed.
+    std::unordered_map<std::string, int> m_files;
+};
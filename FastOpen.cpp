@@ -0,0 +1,120 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FastOpen.hpp"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "SocketIo.hpp"
+#include "Timestamp.hpp"
+
+FastOpen& FastOpen::Instance() {
+    static FastOpen* instance = new FastOpen;
+    return *instance;
+}
+
+FastOpen::FastOpen()
+    : m_enabled{false}
+    , m_lastReport{Timestamp()}
+{}
+
+void FastOpen::SetEnabled(bool enable) {
+    m_enabled = enable;
+}
+
+bool FastOpen::IsEnabled() {
+    return m_enabled;
+}
+
+int FastOpen::Connect(int fd, const struct sockaddr* address, socklen_t addressSize, const char* data, std::size_t size) {
+    auto& io = SocketIo::Instance();
+    auto& metrics = Metrics::Instance();
+    metrics.Increment(Counter::FastOpenAttempts);
+
+    // On a blocking socket, this returns once the connection is established.  Without a
+    // cookie for the server, the kernel sends a plain SYN and the data follows the handshake.
+    auto rc = io.SendTo(fd, data, size, MSG_FASTOPEN, address, addressSize);
+    if (rc == -1) {
+        if ((errno != EOPNOTSUPP) && (errno != EPIPE)) {
+            return -1;
+        }
+
+        // Fast Open is disabled locally (net.ipv4.tcp_fastopen) - use a regular connect
+        metrics.Increment(Counter::FastOpenFallbacks);
+        if (-1 == io.Connect(fd, address, addressSize)) {
+            return -1;
+        }
+        rc = 0;
+    } else {
+        auto info = (struct tcp_info){};
+        auto infoSize = socklen_t{sizeof(info)};
+        if ((0 == io.GetSockOpt(fd, IPPROTO_TCP, TCP_INFO, &info, &infoSize)) &&
+            (info.tcpi_options & TCPI_OPT_SYN_DATA)) {
+            Log(LogSeverity::Debug, "Fast Open: request sent in SYN");
+            metrics.Increment(Counter::FastOpenSynData);
+        } else {
+            Log(LogSeverity::Debug, "Fast Open: request sent after handshake");
+            metrics.Increment(Counter::FastOpenFallbacks);
+        }
+    }
+
+    // Anything that didn't fit in the SYN goes out the regular way
+    auto sent = static_cast<std::size_t>(rc);
+    while (sent < size) {
+        auto written = io.Write(fd, data + sent, size - sent);
+        if (written <= 0) {
+            if ((written == -1) && (errno == EINTR)) {
+                continue;
+            }
+            return -1;
+        }
+        sent += written;
+    }
+    return 0;
+}
+
+void FastOpen::ReportStats() {
+    if (!m_enabled || ((Timestamp() - m_lastReport) < m_reportInterval)) {
+        return;
+    }
+    m_lastReport = Timestamp();
+
+    auto& metrics = Metrics::Instance();
+    auto attempts = metrics.Get(Counter::FastOpenAttempts);
+    auto accepted = metrics.Get(Counter::FastOpenSynData);
+    auto ratio = attempts ? (100.0 * accepted) / attempts : 0.0;
+    Log(LogSeverity::Info, "TCP Fast Open: %llu connections, %.1f%% carried data in the SYN (%llu accepted, %llu fell back)",
+        attempts, ratio, accepted, metrics.Get(Counter::FastOpenFallbacks));
+}
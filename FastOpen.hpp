@@ -0,0 +1,67 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+/**
+ * @brief The FastOpen class connects upstream sockets using TCP Fast Open, so
+ * that a plain-HTTP request goes out in the SYN to servers that support it,
+ * saving a round trip.  How often the server accepted the data in the SYN,
+ * versus falling back to a regular handshake, is counted in Metrics.
+ */
+class FastOpen {
+public:
+    static FastOpen& Instance();
+
+    void SetEnabled(bool enable);
+    bool IsEnabled();
+
+    // Connect fd to the given address, sending the first size bytes of data along
+    // with the SYN where possible.  On success, the whole of data has been sent.
+    // Returns -1 with errno set on failure, as connect() would.
+    int Connect(int fd, const struct sockaddr* address, socklen_t addressSize, const char* data, std::size_t size);
+
+    // Periodically log how often data was carried in the SYN
+    void ReportStats();
+
+private:
+    FastOpen();
+
+    static constexpr auto m_reportInterval = 300 * 1000; // ms
+
+    bool m_enabled;
+    std::uint64_t m_lastReport;
+};
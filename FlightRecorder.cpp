@@ -0,0 +1,264 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FlightRecorder.hpp"
+
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "Timestamp.hpp"
+
+namespace {
+
+// Names of the spans ending at each phase, for the trace view
+const char* spanNames[] = { "accept", "detect", "auth", "resolve", "connect", "first_byte" };
+const char* phaseNames[] = { "accepted", "parsed", "authorized", "resolved", "connected", "first_byte" };
+static_assert(sizeof(spanNames) / sizeof(spanNames[0]) == static_cast<int>(Phase::NumPhases), "Missing span name");
+static_assert(sizeof(phaseNames) / sizeof(phaseNames[0]) == static_cast<int>(Phase::NumPhases), "Missing phase name");
+
+void append(std::string& out, const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    auto length = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (length > 0) {
+        out.append(buf, std::min(static_cast<std::size_t>(length), sizeof(buf) - 1));
+    }
+}
+
+// Host names come from requests, so may hold anything
+void appendString(std::string& out, const char* value) {
+    out += '"';
+    for (auto* c = value; *c; c++) {
+        if ((*c == '"') || (*c == '\\')) {
+            out += '\\';
+            out += *c;
+        } else if (static_cast<unsigned char>(*c) < 0x20) {
+            append(out, "\\u%04x", *c);
+        } else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+void appendAddresses(std::string& out, const FlightRecord& record) {
+    out += '[';
+    for (auto i = 0; i < record.numTriedAddresses; i++) {
+        auto& tried = record.triedAddresses[i];
+        char address[INET6_ADDRSTRLEN] = {};
+        inet_ntop((tried.ipVersion == 4) ? AF_INET : AF_INET6, tried.address, address, sizeof(address));
+        append(out, "%s\"%s\"", i ? "," : "", address);
+    }
+    out += ']';
+}
+
+void appendDetails(std::string& out, const FlightRecord& record) {
+    out += "\"host\":";
+    appendString(out, record.host);
+    out += ",\"user\":";
+    appendString(out, record.userName);
+    append(out, ",\"port\":%d,\"transparent\":%s,\"close\":\"%s\",\"rx_bytes\":%llu,\"tx_bytes\":%llu",
+           record.port, record.transparent ? "true" : "false", FlightRecorder::GetReasonName(record.reason),
+           record.rxBytes, record.txBytes);
+    append(out, ",\"resolve_cached\":%s,\"addresses\":", record.resolveCached ? "true" : "false");
+    appendAddresses(out, record);
+}
+
+} // anonymous namespace
+
+FlightRecorder& FlightRecorder::Instance() {
+    static FlightRecorder* instance = new FlightRecorder;
+    return *instance;
+}
+
+FlightRecorder::FlightRecorder()
+    : m_capacity{0}
+    , m_next{0}
+{}
+
+void FlightRecorder::SetCapacity(std::size_t capacity) {
+    m_slots.reset(capacity ? new Slot[capacity] : nullptr);
+    for (auto i = std::size_t{0}; i < capacity; i++) {
+        m_slots[i].sequence = 0;
+    }
+    m_capacity = capacity;
+    m_next = 0;
+}
+
+void FlightRecorder::Record(Session* session, CloseReason reason) {
+    if (!m_capacity) {
+        return;
+    }
+
+    // Sessions end on any thread - each takes the next slot, marking it while it's written
+    auto index = m_next.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = m_slots[index % m_capacity];
+    slot.sequence.store((index * 2) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto& record = slot.record;
+    record.sessionId = session->GetSessionId();
+    record.reason = reason;
+    record.transparent = session->GetTransparent();
+    record.resolveCached = session->IsResolveCached();
+    record.port = session->GetPort();
+    record.endTime = time(nullptr);
+    record.endUs = TimestampUs();
+    for (auto i = 0; i < static_cast<int>(Phase::NumPhases); i++) {
+        record.phaseTimes[i] = session->GetPhaseTime(static_cast<Phase>(i));
+    }
+    record.rxBytes = session->GetRxBytes();
+    record.txBytes = session->GetTxBytes();
+    record.numTriedAddresses = static_cast<std::uint8_t>(session->GetNumTriedAddresses());
+    for (auto i = 0; i < record.numTriedAddresses; i++) {
+        record.triedAddresses[i] = session->GetTriedAddress(i);
+    }
+    auto& host = session->GetHost();
+    auto length = std::min(host.size(), sizeof(record.host) - 1);
+    memcpy(record.host, host.data(), length);
+    record.host[length] = '\0';
+    auto& userName = session->GetUserName();
+    length = std::min(userName.size(), sizeof(record.userName) - 1);
+    memcpy(record.userName, userName.data(), length);
+    record.userName[length] = '\0';
+
+    slot.sequence.store((index * 2) + 2, std::memory_order_release);
+}
+
+template<typename Visitor>
+void FlightRecorder::ForEachRecord(Visitor visitor) {
+    auto next = m_next.load(std::memory_order_acquire);
+    auto first = (next > m_capacity) ? (next - m_capacity) : 0;
+    for (auto index = first; index < next; index++) {
+        // Skip slots that are being written, or have already been reused
+        auto& slot = m_slots[index % m_capacity];
+        auto sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != (index * 2) + 2) {
+            continue;
+        }
+        auto record = slot.record;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+        visitor(record);
+    }
+}
+
+void FlightRecorder::RenderJson(std::string& out) {
+    out += "{\"sessions\":[";
+    auto first = true;
+    ForEachRecord([&out, &first](const FlightRecord& record) {
+        auto accepted = record.phaseTimes[static_cast<int>(Phase::Accepted)];
+        append(out, "%s\n{\"id\":%d,\"end_time\":%lld,\"duration_us\":%llu,",
+               first ? "" : ",", record.sessionId, static_cast<long long>(record.endTime), record.endUs - accepted);
+        appendDetails(out, record);
+
+        // Phases are given as the time since the connection was accepted
+        out += ",\"phases_us\":{";
+        auto firstPhase = true;
+        for (auto i = static_cast<int>(Phase::Accepted) + 1; i < static_cast<int>(Phase::NumPhases); i++) {
+            if (record.phaseTimes[i]) {
+                append(out, "%s\"%s\":%llu", firstPhase ? "" : ",", phaseNames[i], record.phaseTimes[i] - accepted);
+                firstPhase = false;
+            }
+        }
+        out += "}}";
+        first = false;
+    });
+    out += "\n]}\n";
+}
+
+void FlightRecorder::RenderTrace(std::string& out) {
+    out += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    auto first = true;
+    ForEachRecord([&out, &first](const FlightRecord& record) {
+        // One row per session: the whole session, with a span for each phase below it
+        auto accepted = record.phaseTimes[static_cast<int>(Phase::Accepted)];
+        append(out, "%s\n{\"name\":", first ? "" : ",");
+        appendString(out, record.host);
+        append(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"args\":{",
+               record.sessionId, accepted, record.endUs - accepted);
+        appendDetails(out, record);
+        out += "}}";
+
+        auto start = accepted;
+        for (auto i = static_cast<int>(Phase::Accepted) + 1; i < static_cast<int>(Phase::NumPhases); i++) {
+            if (record.phaseTimes[i]) {
+                append(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu}",
+                       spanNames[i], record.sessionId, start, record.phaseTimes[i] - start);
+                start = record.phaseTimes[i];
+            }
+        }
+        append(out, ",\n{\"name\":\"transfer\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu}",
+               record.sessionId, start, record.endUs - start);
+        first = false;
+    });
+    out += "\n]}\n";
+}
+
+const char* FlightRecorder::GetReasonName(CloseReason reason) {
+    switch (reason) {
+    case CloseReason::ClientClosed:
+        return "client_closed";
+    case CloseReason::ServerClosed:
+        return "server_closed";
+    case CloseReason::BadRequest:
+        return "bad_request";
+    case CloseReason::AuthRequired:
+        return "auth_required";
+    case CloseReason::AuthFailed:
+        return "auth_failed";
+    case CloseReason::TimeDenied:
+        return "time_denied";
+    case CloseReason::Blocked:
+        return "blocked";
+    case CloseReason::Overloaded:
+        return "overloaded";
+    case CloseReason::ResolveFailed:
+        return "resolve_failed";
+    case CloseReason::ConnectFailed:
+        return "connect_failed";
+    case CloseReason::CacheServed:
+        return "cache_served";
+    case CloseReason::Pruned:
+        return "pruned";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,96 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "Session.hpp"
+
+// What the flight recorder keeps of a finished session
+typedef struct {
+    int sessionId;
+    CloseReason reason;
+    bool transparent;
+    bool resolveCached;
+    std::uint8_t numTriedAddresses;
+    std::uint16_t port;
+    std::int64_t endTime;   // Unix time, in seconds
+    std::uint64_t endUs;    // Monotonic, like the phase times
+    std::uint64_t phaseTimes[static_cast<int>(Phase::NumPhases)];
+    std::uint64_t rxBytes;
+    std::uint64_t txBytes;
+    UpstreamAddress triedAddresses[Session::m_maxTriedAddresses];
+    char host[64];
+    char userName[32];
+} FlightRecord;
+
+/**
+ * @brief The FlightRecorder class keeps the most recent finished sessions in
+ * a fixed-size ring, so a slow page load can be looked at after the fact.
+ * Recording copies the session into a preallocated slot without locking, so
+ * it's cheap enough to leave on.  The ring is dumped through the admin
+ * endpoint, as JSON or in Chrome's trace event format.
+ */
+class FlightRecorder {
+public:
+    static FlightRecorder& Instance();
+
+    // Allocate a ring of the given number of sessions; 0 disables recording
+    void SetCapacity(std::size_t capacity);
+
+    void Record(Session* session, CloseReason reason);
+
+    void RenderJson(std::string& out);
+    void RenderTrace(std::string& out);
+
+    static const char* GetReasonName(CloseReason reason);
+
+private:
+    FlightRecorder();
+
+    // A slot's sequence is odd while the record is being written
+    typedef struct {
+        std::atomic<std::uint64_t> sequence;
+        FlightRecord record;
+    } Slot;
+
+    template<typename Visitor>
+    void ForEachRecord(Visitor visitor);
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::size_t m_capacity;
+    std::atomic<std::uint64_t> m_next;
+};
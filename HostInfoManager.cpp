@@ -34,19 +34,28 @@
 #include "Log.hpp"
 #include "Timestamp.hpp"
 
-std::vector<HostInfo> HostInfoCache::GetCachedResults(const std::string& url) {
+void HostInfoCache::GetCachedResults(const std::string& url, std::vector<HostInfo>& results) {
     auto lg = LockGuard{m_cacheLock};
-    auto results = std::vector<HostInfo>{};
-    for (auto it = m_hostInfo.begin(); it != m_hostInfo.end(); it++) {
-        if ((Timestamp() - it->Timestamp) > maxAge) {
+    auto now = Timestamp();
+    auto count = std::size_t{};
+    for (auto it = m_hostInfo.begin(); it != m_hostInfo.end();) {
+        if ((now - it->Timestamp) > maxAge) {
             Log(LogSeverity::Debug, "pruning old entry: %s->%s", it->url.c_str(), it->address.c_str());
-            m_hostInfo.erase(it++);
-        } else if (it->url == url) {
+            it = m_hostInfo.erase(it);
+            continue;
+        }
+        if (it->url == url) {
             Log(LogSeverity::Debug, "cache hit for : %s->%s", it->url.c_str(), it->address.c_str());
-            results.push_back(*it);
+            if (count < results.size()) {
+                results[count] = *it;
+            } else {
+                results.push_back(*it);
+            }
+            ++count;
         }
+        ++it;
     }
-    return results;
+    results.resize(count);
 }
 
 void HostInfoCache::ClearCacheForHost(const std::string& url) {
@@ -53,8 +53,9 @@ typedef struct {
  */
 class HostInfoCache {
 public:
-    // Get the cached host info results for a given host
-    std::vector<HostInfo> GetCachedResults(const std::string& url);    
+    // Get the cached host info results for a given host, assigned into results
+    // so that the caller's vector (and its strings) can be reused.
+    void GetCachedResults(const std::string& url, std::vector<HostInfo>& results);
 
     // Add a host lookup entry to the cache
     void AddResult(const HostInfo& hostInfo);
@@ -45,14 +45,13 @@ HostResolver::HostResolver(std::unique_ptr<HostInfoCache> cache)
     : m_hostCache{std::move(cache)}
 {}
 
-std::vector<HostInfo> HostResolver::GetAddressesForHost(const std::string &host, const uint16_t port, bool& cached) {
+bool HostResolver::GetAddressesForHost(const std::string &host, const uint16_t port, std::vector<HostInfo>& results, bool& cached) {
 
-    auto resultVector = std::vector<HostInfo>{};
-    resultVector = m_hostCache->GetCachedResults(host);
+    m_hostCache->GetCachedResults(host, results);
 
-    if (resultVector.size() > 0) {
+    if (results.size() > 0) {
         cached = true;
-        return resultVector;
+        return true;
     }
 
     auto hints = addrinfo{};
@@ -60,16 +59,16 @@ std::vector<HostInfo> HostResolver::GetAddressesForHost(const std::string &host,
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    auto* results = (addrinfo*){};
+    auto* addrResults = (addrinfo*){};
     auto portString = std::to_string(port);
-    auto rc = getaddrinfo(host.c_str(), portString.c_str(), &hints, &results);
+    auto rc = getaddrinfo(host.c_str(), portString.c_str(), &hints, &addrResults);
 
     if (rc != 0) {
         Log(LogSeverity::Debug, "could not resolve address");
-        return {};
+        return false;
     }
 
-    for (auto result = results; result != nullptr; result = result->ai_next) {
+    for (auto result = addrResults; result != nullptr; result = result->ai_next) {
         char ipString[INET6_ADDRSTRLEN] = {0};
 
         auto hostInfo = HostInfo{};
@@ -83,7 +82,7 @@ std::vector<HostInfo> HostResolver::GetAddressesForHost(const std::string &host,
             hostInfo.url = host;
             hostInfo.Timestamp = Timestamp();
 
-            resultVector.push_back(hostInfo);
+            results.push_back(hostInfo);
             m_hostCache->AddResult(hostInfo);
 
             break;
@@ -97,8 +96,8 @@ std::vector<HostInfo> HostResolver::GetAddressesForHost(const std::string &host,
 #endif
     }
 
-    freeaddrinfo(results);
-    return resultVector;
+    freeaddrinfo(addrResults);
+    return results.size() > 0;
 }
 
 void HostResolver::ClearCacheForHost(const std::string& host) {
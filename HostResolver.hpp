@@ -48,7 +48,7 @@ public:
     }
 
     HostResolver(std::unique_ptr<HostInfoCache> cache);
-    std::vector<HostInfo> GetAddressesForHost(const std::string &host, const uint16_t port, bool& cached) override;
+    bool GetAddressesForHost(const std::string &host, const uint16_t port, std::vector<HostInfo>& results, bool& cached) override;
     void ClearCacheForHost(const std::string& host) override;
 
 public:
@@ -0,0 +1,197 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "HostSketch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+
+namespace {
+
+// FNV-1a hash of the host; the sketch rows are derived from its two halves
+std::uint64_t hashHost(const std::string& host) {
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    for (auto c : host) {
+        hash ^= static_cast<std::uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Worst-case overcount of a Count-Min estimate, given the total counted
+std::uint64_t errorBound(std::uint64_t total, int width) {
+    return static_cast<std::uint64_t>(std::ceil(std::exp(1.0) * total / width));
+}
+
+bool writeLine(int fd, const char* line) {
+    auto length = strlen(line);
+    auto rc = ::write(fd, line, length);
+    if (rc != static_cast<ssize_t>(length)) {
+        Log(LogSeverity::Warn, "Error writing audit log %d=%d", rc, errno);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+HostSketch::HostSketch(std::size_t topHosts)
+    : m_cells(m_depth * m_width, Cell{})
+    , m_topHosts{topHosts}
+    , m_totalRxBytes{0}
+    , m_totalTxBytes{0}
+    , m_totalTime{0}
+    , m_totalConnections{0}
+{
+    m_top.reserve(m_topHosts);
+    m_topIndex.reserve(m_topHosts);
+}
+
+void HostSketch::Add(const std::string& host, std::uint64_t rxBytes, std::uint64_t txBytes,
+                     std::uint64_t totalTime, std::uint64_t connections) {
+    auto hash = hashHost(host);
+    for (auto row = 0; row < m_depth; row++) {
+        auto& cell = m_cells[CellIndex(hash, row)];
+        cell.rxBytes += rxBytes;
+        cell.txBytes += txBytes;
+        cell.totalTime += totalTime;
+    }
+    m_totalRxBytes += rxBytes;
+    m_totalTxBytes += txBytes;
+    m_totalTime += totalTime;
+    m_totalConnections += connections;
+
+    AddTop(host, connections);
+}
+
+std::size_t HostSketch::GetHostCount() const {
+    return m_top.size();
+}
+
+std::size_t HostSketch::CellIndex(std::uint64_t hash, int row) const {
+    // Double hashing gives each row an independent-enough column
+    auto h1 = static_cast<std::uint32_t>(hash);
+    auto h2 = static_cast<std::uint32_t>(hash >> 32) | 1;
+    return (row * m_width) + ((h1 + row * h2) % m_width);
+}
+
+HostSketch::Cell HostSketch::Estimate(const std::string& host) const {
+    auto hash = hashHost(host);
+    auto estimate = m_cells[CellIndex(hash, 0)];
+    for (auto row = 1; row < m_depth; row++) {
+        auto& cell = m_cells[CellIndex(hash, row)];
+        estimate.rxBytes = std::min(estimate.rxBytes, cell.rxBytes);
+        estimate.txBytes = std::min(estimate.txBytes, cell.txBytes);
+        estimate.totalTime = std::min(estimate.totalTime, cell.totalTime);
+    }
+    return estimate;
+}
+
+void HostSketch::AddTop(const std::string& host, std::uint64_t connections) {
+    auto it = m_topIndex.find(host);
+    if (it != m_topIndex.end()) {
+        m_top[it->second].connections += connections;
+        return;
+    }
+
+    if (m_top.size() < m_topHosts) {
+        m_topIndex.emplace(host, m_top.size());
+        m_top.push_back(TopEntry{host, connections, 0});
+        return;
+    }
+
+    // Table is full - the new host takes over the least-connected entry, inheriting
+    // its count as the possible error
+    auto minIdx = std::size_t{0};
+    for (auto i = std::size_t{1}; i < m_top.size(); i++) {
+        if (m_top[i].connections < m_top[minIdx].connections) {
+            minIdx = i;
+        }
+    }
+
+    auto& entry = m_top[minIdx];
+    m_topIndex.erase(entry.host);
+    entry.host.assign(host);
+    entry.error = entry.connections;
+    entry.connections += connections;
+    m_topIndex.emplace(host, minIdx);
+}
+
+void HostSketch::ForEachHost(const HostVisitor& visitor) const {
+    for (auto& entry : m_top) {
+        auto estimate = Estimate(entry.host);
+        visitor(entry.host, estimate.rxBytes, estimate.txBytes, estimate.totalTime, entry.connections);
+    }
+}
+
+void HostSketch::LogToFile(int fd) const {
+    char tmpBuf[1024];
+    snprintf(tmpBuf, sizeof(tmpBuf),
+             "# approximate: top %zu hosts of %llu connections; rxBytes/txBytes/totalTime may "
+             "overcount by up to %llu/%llu/%llu (98%% confidence)\n"
+             "host,rxBytes,txBytes,totalTime,connections,connectionsError\n",
+             m_top.size(),
+             static_cast<unsigned long long>(m_totalConnections),
+             static_cast<unsigned long long>(errorBound(m_totalRxBytes, m_width)),
+             static_cast<unsigned long long>(errorBound(m_totalTxBytes, m_width)),
+             static_cast<unsigned long long>(errorBound(m_totalTime, m_width)));
+    if (!writeLine(fd, tmpBuf)) {
+        return;
+    }
+
+    auto order = std::vector<std::size_t>(m_top.size());
+    for (auto i = std::size_t{0}; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b) {
+        return m_top[a].connections > m_top[b].connections;
+    });
+
+    for (auto idx : order) {
+        auto& entry = m_top[idx];
+        auto estimate = Estimate(entry.host);
+        snprintf(tmpBuf, sizeof(tmpBuf), "%s,%llu,%llu,%llu,%llu,%llu\n",
+                 entry.host.c_str(),
+                 static_cast<unsigned long long>(estimate.rxBytes),
+                 static_cast<unsigned long long>(estimate.txBytes),
+                 static_cast<unsigned long long>(estimate.totalTime),
+                 static_cast<unsigned long long>(entry.connections),
+                 static_cast<unsigned long long>(entry.error));
+        if (!writeLine(fd, tmpBuf)) {
+            return;
+        }
+    }
+}
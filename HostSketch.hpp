@@ -0,0 +1,98 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief The HostSketch class summarizes a user's per-host traffic in fixed
+ * memory.  A Space-Saving table tracks the most-connected hosts, and a
+ * Count-Min sketch estimates each host's bytes and connection time.  Both
+ * estimates only ever overcount; LogToFile reports the bounds on the error.
+ */
+class HostSketch {
+public:
+    HostSketch(std::size_t topHosts);
+
+    void Add(const std::string& host, std::uint64_t rxBytes, std::uint64_t txBytes,
+             std::uint64_t totalTime, std::uint64_t connections);
+
+    // Number of hosts currently tracked in the top-K table
+    std::size_t GetHostCount() const;
+
+    // Write the tracked hosts, busiest first, with the error bounds
+    void LogToFile(int fd) const;
+
+    // Visit each tracked host with its estimated rx/tx bytes, time and connections
+    using HostVisitor = std::function<void(const std::string&, std::uint64_t, std::uint64_t,
+                                           std::uint64_t, std::uint64_t)>;
+    void ForEachHost(const HostVisitor& visitor) const;
+
+private:
+    // Count-Min dimensions - estimates exceed the true value by at most e/width of
+    // the total, with probability 1 - e^-depth (~98%)
+    static constexpr auto m_depth = 4;
+    static constexpr auto m_width = 512;
+
+    typedef struct {
+        std::uint64_t rxBytes;
+        std::uint64_t txBytes;
+        std::uint64_t totalTime;
+    } Cell;
+
+    // A host in the top-K table.  Its connection count may include up to 'error'
+    // connections that belonged to the host it displaced.
+    typedef struct {
+        std::string host;
+        std::uint64_t connections;
+        std::uint64_t error;
+    } TopEntry;
+
+    std::size_t CellIndex(std::uint64_t hash, int row) const;
+    Cell Estimate(const std::string& host) const;
+    void AddTop(const std::string& host, std::uint64_t connections);
+
+    std::vector<Cell> m_cells;
+    std::vector<TopEntry> m_top;
+    std::unordered_map<std::string, std::size_t> m_topIndex;
+    std::size_t m_topHosts;
+
+    std::uint64_t m_totalRxBytes;
+    std::uint64_t m_totalTxBytes;
+    std::uint64_t m_totalTime;
+    std::uint64_t m_totalConnections;
+};
@@ -37,6 +37,8 @@ enum class SocketType : std::uint8_t {
     Server,
     Client,
     Command,
+    Admin,
+    AdminConnection,
 };
 
 /**
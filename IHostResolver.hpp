@@ -40,6 +40,7 @@
 class IHostResolver {
 public:
     ~IHostResolver() {}
-    virtual std::vector<HostInfo> GetAddressesForHost(const std::string &host, const std::uint16_t port, bool& cached) = 0;
+    // Fills results in place (reusing its capacity); returns false if the host could not be resolved
+    virtual bool GetAddressesForHost(const std::string &host, const std::uint16_t port, std::vector<HostInfo>& results, bool& cached) = 0;
     virtual void ClearCacheForHost(const std::string& host) = 0;
 };
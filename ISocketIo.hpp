@@ -0,0 +1,67 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/**
+ * @brief The ISocketIo class covers the system calls the event loop and the
+ * connector make on sockets, so the proxy can be run against a simulated network.
+ * Each call behaves as the system call of the same name, setting errno on failure.
+ */
+class ISocketIo {
+public:
+    virtual ~ISocketIo() = default;
+
+    virtual int Socket(int domain, int type, int protocol) = 0;
+    virtual int Bind(int fd, const struct sockaddr* address, socklen_t addressSize) = 0;
+    virtual int Listen(int fd, int backlog) = 0;
+    virtual int Accept(int fd, struct sockaddr* address, socklen_t* addressSize) = 0;
+    virtual int Connect(int fd, const struct sockaddr* address, socklen_t addressSize) = 0;
+    virtual int SetSockOpt(int fd, int level, int name, const void* value, socklen_t size) = 0;
+    virtual int GetSockOpt(int fd, int level, int name, void* value, socklen_t* size) = 0;
+    virtual ssize_t Read(int fd, void* buf, std::size_t size) = 0;
+    virtual ssize_t Write(int fd, const void* buf, std::size_t size) = 0;
+    virtual ssize_t Recv(int fd, void* buf, std::size_t size, int flags) = 0;
+    virtual ssize_t SendTo(int fd, const void* buf, std::size_t size, int flags, const struct sockaddr* address, socklen_t addressSize) = 0;
+    virtual int Close(int fd) = 0;
+
+    virtual int EventFd(unsigned int initial, int flags) = 0;
+
+    virtual int EpollCreate(int flags) = 0;
+    virtual int EpollCtl(int epollFd, int op, int fd, struct epoll_event* event) = 0;
+    virtual int EpollWait(int epollFd, struct epoll_event* events, int maxEvents, int timeout) = 0;
+};
@@ -0,0 +1,107 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram() {
+    Reset();
+}
+
+void LatencyHistogram::Record(std::uint64_t valueUs) {
+    m_buckets[BucketIndex(valueUs)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+
+    auto current = m_max.load(std::memory_order_relaxed);
+    while ((valueUs > current) && !m_max.compare_exchange_weak(current, valueUs, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::Summarize(HistogramSummary& summary) const {
+    summary.count = m_count.load(std::memory_order_relaxed);
+    summary.max = m_max.load(std::memory_order_relaxed);
+    summary.p50 = 0;
+    summary.p90 = 0;
+    summary.p99 = 0;
+    if (!summary.count) {
+        return;
+    }
+
+    auto p50 = (summary.count * 50 + 99) / 100;
+    auto p90 = (summary.count * 90 + 99) / 100;
+    auto p99 = (summary.count * 99 + 99) / 100;
+    auto seen = std::uint64_t{0};
+    for (auto i = std::size_t{0}; i < m_numBuckets; i++) {
+        auto count = m_buckets[i].load(std::memory_order_relaxed);
+        if (!count) {
+            continue;
+        }
+        seen += count;
+        auto bound = std::min(BucketUpperBound(i), summary.max);
+        if (!summary.p50 && (seen >= p50)) {
+            summary.p50 = bound;
+        }
+        if (!summary.p90 && (seen >= p90)) {
+            summary.p90 = bound;
+        }
+        if (seen >= p99) {
+            summary.p99 = bound;
+            break;
+        }
+    }
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+std::size_t LatencyHistogram::BucketIndex(std::uint64_t value) {
+    if (value < m_subBuckets) {
+        return value;
+    }
+    // Values in [2^n, 2^(n+1)) share a power, and are split by their next 4 bits
+    auto shift = (63 - __builtin_clzll(value)) - m_subBucketBits;
+    return ((shift + 1) * m_subBuckets) + ((value >> shift) & (m_subBuckets - 1));
+}
+
+std::uint64_t LatencyHistogram::BucketUpperBound(std::size_t index) {
+    if (index < m_subBuckets) {
+        return index;
+    }
+    auto shift = (index / m_subBuckets) - 1;
+    auto lower = static_cast<std::uint64_t>(m_subBuckets + (index % m_subBuckets)) << shift;
+    return lower + ((std::uint64_t{1} << shift) - 1);
+}
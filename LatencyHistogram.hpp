@@ -0,0 +1,76 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Summary of a histogram's contents
+typedef struct {
+    std::uint64_t count;
+    std::uint64_t p50;
+    std::uint64_t p90;
+    std::uint64_t p99;
+    std::uint64_t max;
+} HistogramSummary;
+
+/**
+ * @brief The LatencyHistogram class records durations (in microseconds) into
+ * log-linear buckets, HDR-style: each power of two is split into 16 buckets,
+ * so percentiles are accurate to within ~6% across the whole range.  Recording
+ * is a couple of relaxed atomic increments, safe from any thread.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Record(std::uint64_t valueUs);
+
+    // Percentiles are reported as the upper bound of the bucket they fall in
+    void Summarize(HistogramSummary& summary) const;
+
+    // Zero all the buckets - racing recordings may or may not be kept
+    void Reset();
+
+private:
+    static constexpr auto m_subBucketBits = 4;
+    static constexpr auto m_subBuckets = 1 << m_subBucketBits;
+    static constexpr auto m_numBuckets = (64 - m_subBucketBits + 1) * m_subBuckets;
+
+    static std::size_t BucketIndex(std::uint64_t value);
+    static std::uint64_t BucketUpperBound(std::size_t index);
+
+    std::atomic<std::uint64_t> m_buckets[m_numBuckets];
+    std::atomic<std::uint64_t> m_count;
+    std::atomic<std::uint64_t> m_max;
+};
@@ -31,62 +31,241 @@
 
 #include "Log.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include "Timestamp.hpp"
 
 namespace {
-    auto m_verbosity = LogSeverity::Debug;
+    // Per-thread ring of formatted log lines.  The owning thread is the only
+    // producer, and the writer thread the only consumer.
+    struct LogRing {
+        static constexpr auto slots = 256;
+        static constexpr auto slotSize = 512;
+
+        char text[slots][slotSize];
+        std::uint16_t length[slots];
+        std::atomic<std::uint32_t> head;    // Next slot to write out
+        std::atomic<std::uint32_t> tail;    // Next slot to fill
+        std::atomic<std::uint64_t> dropped;
+    };
+
     auto m_toFile = false;
+    auto m_maxFileBytes = std::size_t{16 * 1024 * 1024};
+    auto m_maxFiles = 3;
+
+    constexpr auto logFileName = "logs.txt";
+    constexpr auto writerIdleUs = 10 * 1000;
+
+    std::atomic<bool> m_async{false};
+
+    // Rings are registered once per thread and never removed; m_writeLock also
+    // serializes the writer thread with LogFlush.
+    std::mutex m_ringLock;
+    std::vector<LogRing*> m_rings;
+    std::mutex m_writeLock;
+    FILE* m_logFile = nullptr;
+    auto m_fileBytes = std::size_t{0};
+
+    // Format the line prefix and message into buf, returning its length
+    std::size_t formatLine(char* buf, std::size_t size, LogSeverity severity, const char* format, va_list args) {
+        auto ts = Timestamp();
+        auto length = snprintf(buf, size, "[%04lu.%03lu]", ts / 1000, ts % 1000);
+        switch (severity) {
+        case LogSeverity::Error: {
+            length += snprintf(buf + length, size - length, "\tERR\t");
+        } break;
+        case LogSeverity::Warn: {
+            length += snprintf(buf + length, size - length, "\tWRN\t");
+        } break;
+        case LogSeverity::Info: {
+            length += snprintf(buf + length, size - length, "\tNFO\t");
+        } break;
+        case LogSeverity::Debug: {
+            length += snprintf(buf + length, size - length, "\tDBG\t");
+        } break;
+        default:
+            break;
+        }
+
+        auto rc = vsnprintf(buf + length, size - length, format, args);
+        if (rc > 0) {
+            length += rc;
+        }
+        return std::min(static_cast<std::size_t>(length), size - 1);
+    }
+
+    void rotateFile() {
+        fclose(m_logFile);
+        m_logFile = nullptr;
+        for (auto i = m_maxFiles - 1; i > 0; i--) {
+            auto from = std::string{logFileName} + "." + std::to_string(i);
+            auto to = std::string{logFileName} + "." + std::to_string(i + 1);
+            rename(from.c_str(), to.c_str());
+        }
+        if (m_maxFiles > 0) {
+            rename(logFileName, (std::string{logFileName} + ".1").c_str());
+        }
+    }
+
+    void writeFile(const char* data, std::size_t size) {
+        if (m_logFile == nullptr) {
+            m_logFile = fopen(logFileName, "w");
+            m_fileBytes = 0;
+            if (m_logFile == nullptr) {
+                return;
+            }
+        }
+        fwrite(data, 1, size, m_logFile);
+        fflush(m_logFile);
+        m_fileBytes += size;
+        if (m_fileBytes >= m_maxFileBytes) {
+            rotateFile();
+        }
+    }
+
+    void writeLine(const char* buf, std::size_t length) {
+        printf("%.*s\n", static_cast<int>(length), buf);
+        if (m_toFile) {
+            writeFile(buf, length);
+            writeFile("\n", 1);
+        }
+    }
+
+    LogRing* localRing() {
+        thread_local LogRing* ring = nullptr;
+        if (!ring) {
+            ring = new LogRing;
+            ring->head = 0;
+            ring->tail = 0;
+            ring->dropped = 0;
+            auto lg = std::unique_lock<std::mutex>{m_ringLock};
+            m_rings.push_back(ring);
+        }
+        return ring;
+    }
+
+    // Move everything buffered in the rings out to stdout/file; returns false if
+    // there was nothing to write.
+    bool drainRings(std::string& batch) {
+        auto rings = std::vector<LogRing*>{};
+        {
+            auto lg = std::unique_lock<std::mutex>{m_ringLock};
+            rings = m_rings;
+        }
+
+        batch.clear();
+        auto dropped = std::uint64_t{0};
+        for (auto* ring : rings) {
+            auto head = ring->head.load(std::memory_order_relaxed);
+            auto tail = ring->tail.load(std::memory_order_acquire);
+            for (; head != tail; head++) {
+                auto slot = head % LogRing::slots;
+                batch.append(ring->text[slot], ring->length[slot]);
+                batch.push_back('\n');
+            }
+            ring->head.store(head, std::memory_order_release);
+            dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+        }
+
+        if (dropped) {
+            char buf[128];
+            auto ts = Timestamp();
+            batch.append(buf, snprintf(buf, sizeof(buf), "[%04lu.%03lu]\tWRN\tDropped %llu log messages\n",
+                                       ts / 1000, ts % 1000, static_cast<unsigned long long>(dropped)));
+        }
+
+        if (batch.empty()) {
+            return false;
+        }
+
+        fwrite(batch.data(), 1, batch.size(), stdout);
+        fflush(stdout);
+        if (m_toFile) {
+            writeFile(batch.data(), batch.size());
+        }
+        return true;
+    }
+
+    void writerMain() {
+        auto batch = std::string{};
+        batch.reserve(64 * 1024);
+        while (true) {
+            auto wrote = false;
+            {
+                auto lg = std::unique_lock<std::mutex>{m_writeLock};
+                wrote = drainRings(batch);
+            }
+            if (!wrote) {
+                usleep(writerIdleUs);
+            }
+        }
+    }
 } // anonymous namespace
 
-void Log(LogSeverity severity, const char* format, ...) {
-    if (static_cast<int>(m_verbosity) < static_cast<int>(severity)) {
+LogSeverity g_logVerbosity = LogSeverity::Debug;
+
+void LogWrite(LogSeverity severity, const char* format, ...) {
+    if (static_cast<int>(g_logVerbosity) < static_cast<int>(severity)) {
         return;
     }
-    static FILE* logFile = nullptr;
-
-    char buf[1024];
-    char* tmpBuf = buf;
-
-    auto ts = Timestamp();
-    tmpBuf += sprintf(tmpBuf, "[%04lu.%03lu]", ts / 1000, ts % 1000);
-    switch (severity) {
-    case LogSeverity::Error: {
-        tmpBuf += sprintf(tmpBuf, "\tERR\t");
-    } break;
-    case LogSeverity::Warn: {
-        tmpBuf += sprintf(tmpBuf, "\tWRN\t");
-    } break;
-    case LogSeverity::Info: {
-        tmpBuf += sprintf(tmpBuf, "\tNFO\t");
-    } break;
-    case LogSeverity::Debug: {
-        tmpBuf += sprintf(tmpBuf, "\tDBG\t");
-    } break;
-    }
 
     va_list args;
+    if (!m_async.load(std::memory_order_acquire)) {
+        char buf[1024];
+        va_start(args, format);
+        auto length = formatLine(buf, sizeof(buf), severity, format, args);
+        va_end(args);
+        auto lg = std::unique_lock<std::mutex>{m_writeLock};
+        writeLine(buf, length);
+        return;
+    }
 
+    // Format straight into the next free slot of this thread's ring
+    auto* ring = localRing();
+    auto tail = ring->tail.load(std::memory_order_relaxed);
+    if ((tail - ring->head.load(std::memory_order_acquire)) >= LogRing::slots) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto slot = tail % LogRing::slots;
     va_start(args, format);
-    tmpBuf += vsprintf(tmpBuf, format, args);
+    ring->length[slot] = formatLine(ring->text[slot], LogRing::slotSize, severity, format, args);
     va_end(args);
-    *tmpBuf = '\0';
-    printf("%s\n", buf);
-    if (m_toFile) {
-        if (logFile == nullptr) {
-            logFile = fopen("logs.txt", "w");
-        }
-        fprintf(logFile, "%s\n", buf);
-    }
+    ring->tail.store(tail + 1, std::memory_order_release);
 }
 
 void LogSetVerbosity(LogSeverity verbosity) {
-    m_verbosity = verbosity;
+    g_logVerbosity = verbosity;
 }
 
 void LogStoreToDisk(bool enable) {
-    m_toFile = true;
+    m_toFile = enable;
+}
+
+void LogSetRotation(std::size_t maxBytes, int maxFiles) {
+    m_maxFileBytes = maxBytes;
+    m_maxFiles = maxFiles;
+}
+
+void LogStart() {
+    fflush(stdout);
+    auto* writerThread = new std::thread(writerMain);
+    writerThread->detach();
+    m_async.store(true, std::memory_order_release);
+}
+
+void LogFlush() {
+    auto batch = std::string{};
+    auto lg = std::unique_lock<std::mutex>{m_writeLock};
+    drainRings(batch);
 }
@@ -30,6 +30,7 @@
  */
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <stdarg.h>
 
@@ -42,8 +43,26 @@ enum class LogSeverity : std::uint8_t {
     Verbose
 };
 
-// Write a log with a given severity
-void Log(LogSeverity severity, const char* format, ...);
+// Least severe level compiled in, as a LogSeverity value - set by the
+// NERMAL_LOG_FLOOR CMake option.  Logs below it compile to nothing.
+#ifndef NERMAL_LOG_FLOOR
+#define NERMAL_LOG_FLOOR 3 // Debug
+#endif
+
+// Runtime verbosity, applied on top of the compile-time floor
+extern LogSeverity g_logVerbosity;
+
+// Write a log with a given severity.  Use Log() rather than calling this directly,
+// so that filtered-out logs don't evaluate their arguments.
+void LogWrite(LogSeverity severity, const char* format, ...);
+
+#define Log(severity, ...)                                                                      \
+    do {                                                                                        \
+        if ((static_cast<int>(severity) <= NERMAL_LOG_FLOOR) &&                                 \
+            (static_cast<int>(severity) <= static_cast<int>(g_logVerbosity))) {                 \
+            LogWrite(severity, __VA_ARGS__);                                                    \
+        }                                                                                       \
+    } while (0)
 
 // Set the default verbosity - only logs at or above the given severity are emitted
 void LogSetVerbosity(LogSeverity verbosity);
@@ -51,3 +70,14 @@ void LogSetVerbosity(LogSeverity verbosity);
 // Set whether or not the logs should be stored to disk.
 void LogStoreToDisk(bool enable);
 
+// Rotate the log file once it reaches maxBytes, keeping up to maxFiles old logs
+void LogSetRotation(std::size_t maxBytes, int maxFiles);
+
+// Start the background log writer.  Until then, logs are written by the calling
+// thread; afterwards, each thread formats into its own ring buffer and never
+// blocks on I/O.  Logs are dropped (and counted) if a thread's ring fills up.
+void LogStart();
+
+// Write out any logs still buffered
+void LogFlush();
+
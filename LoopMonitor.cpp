@@ -0,0 +1,112 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "LoopMonitor.hpp"
+
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+LoopMonitor& LoopMonitor::Instance() {
+    static LoopMonitor* instance = new LoopMonitor;
+    return *instance;
+}
+
+LoopMonitor::LoopMonitor()
+    : m_stallThreshold{50 * 1000}
+{
+    for (auto& stalls : m_stalls) {
+        stalls = 0;
+    }
+}
+
+void LoopMonitor::SetStallThreshold(unsigned thresholdMs) {
+    m_stallThreshold = std::uint64_t{thresholdMs} * 1000;
+}
+
+void LoopMonitor::RecordIteration(std::uint64_t startUs) {
+    m_lag.Record(TimestampUs() - startUs);
+}
+
+void LoopMonitor::RecordHandler(LoopHandler handler, int sessionId, std::uint64_t startUs) {
+    auto elapsed = TimestampUs() - startUs;
+    if (elapsed < m_stallThreshold) {
+        return;
+    }
+
+    m_stallTimes.Record(elapsed);
+    m_stalls[static_cast<int>(handler)].fetch_add(1, std::memory_order_relaxed);
+    if (sessionId != -1) {
+        Log(LogSeverity::Warn, "Event loop stalled for %llums in %s handler (session %d)",
+            elapsed / 1000, GetHandlerName(handler), sessionId);
+    } else {
+        Log(LogSeverity::Warn, "Event loop stalled for %llums in %s handler",
+            elapsed / 1000, GetHandlerName(handler));
+    }
+}
+
+void LoopMonitor::GetLagSummary(HistogramSummary& summary) const {
+    m_lag.Summarize(summary);
+}
+
+void LoopMonitor::GetStallSummary(HistogramSummary& summary) const {
+    m_stallTimes.Summarize(summary);
+}
+
+std::uint64_t LoopMonitor::GetStalls(LoopHandler handler) const {
+    return m_stalls[static_cast<int>(handler)].load(std::memory_order_relaxed);
+}
+
+const char* LoopMonitor::GetHandlerName(LoopHandler handler) {
+    switch (handler) {
+    case LoopHandler::Server:
+        return "server";
+    case LoopHandler::Client:
+        return "client";
+    case LoopHandler::Command:
+        return "command";
+    case LoopHandler::Admin:
+        return "admin";
+    case LoopHandler::AdminConnection:
+        return "admin_connection";
+    case LoopHandler::Maintenance:
+        return "maintenance";
+    default:
+        return "unknown";
+    }
+}
+
+LoopIteration::LoopIteration()
+    : m_start{TimestampUs()}
+{}
+
+LoopIteration::~LoopIteration() {
+    LoopMonitor::Instance().RecordIteration(m_start);
+}
@@ -0,0 +1,96 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "LatencyHistogram.hpp"
+
+// Work done on the event loop thread, for attributing stalls
+enum class LoopHandler : std::uint8_t {
+    Server,             // Accepting client connections
+    Client,             // Relaying data for a session
+    Command,            // Results from the thread pool
+    Admin,              // Accepting admin connections
+    AdminConnection,    // Serving an admin request
+    Maintenance,        // Pruning, stats and audit logging while idle
+    NumHandlers
+};
+
+/**
+ * @brief The LoopMonitor class measures how long the event loop spends between
+ * epoll_wait calls and in each handler, and logs any handler which blocks the
+ * loop - and so every other session - for longer than the stall threshold.
+ */
+class LoopMonitor {
+public:
+    static LoopMonitor& Instance();
+
+    void SetStallThreshold(unsigned thresholdMs);
+
+    // Time from epoll_wait returning until the loop waits again
+    void RecordIteration(std::uint64_t startUs);
+
+    // Time spent in a single handler, started at startUs.  sessionId is -1 if
+    // the handler wasn't working for a session.
+    void RecordHandler(LoopHandler handler, int sessionId, std::uint64_t startUs);
+
+    void GetLagSummary(HistogramSummary& summary) const;
+    void GetStallSummary(HistogramSummary& summary) const;
+    std::uint64_t GetStalls(LoopHandler handler) const;
+    static const char* GetHandlerName(LoopHandler handler);
+
+private:
+    LoopMonitor();
+
+    std::uint64_t m_stallThreshold; // us
+    LatencyHistogram m_lag;
+    LatencyHistogram m_stallTimes;
+    std::atomic<std::uint64_t> m_stalls[static_cast<int>(LoopHandler::NumHandlers)];
+};
+
+/**
+ * @brief The LoopIteration class records an event loop iteration against the
+ * LoopMonitor when it goes out of scope.
+ */
+class LoopIteration {
+public:
+    LoopIteration();
+    ~LoopIteration();
+
+    LoopIteration(const LoopIteration&) = delete;
+    LoopIteration& operator=(const LoopIteration&) = delete;
+
+private:
+    std::uint64_t m_start;
+};
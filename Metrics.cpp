@@ -0,0 +1,164 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "BlackList.hpp"
+#include "LoopMonitor.hpp"
+#include "PhaseStats.hpp"
+#include "Session.hpp"
+#include "ThreadPool.hpp"
+
+namespace {
+
+void append(std::string& out, const char* format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    auto length = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (length > 0) {
+        out.append(buf, std::min(static_cast<std::size_t>(length), sizeof(buf) - 1));
+    }
+}
+
+void header(std::string& out, const char* name, const char* type, const char* help) {
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Emit a histogram as a Prometheus summary, with the max as the 1.0 quantile
+void summary(std::string& out, const char* name, const char* labels, const HistogramSummary& values) {
+    append(out, "%s{%s,quantile=\"0.5\"} %llu\n", name, labels, values.p50);
+    append(out, "%s{%s,quantile=\"0.9\"} %llu\n", name, labels, values.p90);
+    append(out, "%s{%s,quantile=\"0.99\"} %llu\n", name, labels, values.p99);
+    append(out, "%s{%s,quantile=\"1\"} %llu\n", name, labels, values.max);
+    append(out, "%s_count{%s} %llu\n", name, labels, values.count);
+}
+
+} // anonymous namespace
+
+Metrics& Metrics::Instance() {
+    static Metrics* instance = new Metrics;
+    return *instance;
+}
+
+Metrics::Metrics() {
+    for (auto& counter : m_counters) {
+        counter = 0;
+    }
+}
+
+std::uint64_t Metrics::Get(Counter counter) {
+    return m_counters[static_cast<int>(counter)].load(std::memory_order_relaxed);
+}
+
+void Metrics::Render(std::string& out) {
+    header(out, "nermal_sessions_active", "gauge", "Proxy sessions in progress");
+    append(out, "nermal_sessions_active %zu\n", SessionManager::Instance().GetActiveSessions());
+
+    header(out, "nermal_accepts_total", "counter", "Client connections accepted");
+    append(out, "nermal_accepts_total %llu\n", Get(Counter::Accepts));
+
+    header(out, "nermal_sessions_refused_total", "counter", "Client connections refused with the session table full");
+    append(out, "nermal_sessions_refused_total %llu\n", Get(Counter::SessionsRefused));
+
+    header(out, "nermal_auth_total", "counter", "Authentication outcomes");
+    append(out, "nermal_auth_total{method=\"basic\",result=\"ok\"} %llu\n", Get(Counter::AuthBasicOk));
+    append(out, "nermal_auth_total{method=\"basic\",result=\"failed\"} %llu\n", Get(Counter::AuthBasicFailed));
+    append(out, "nermal_auth_total{method=\"ip\",result=\"ok\"} %llu\n", Get(Counter::AuthIpOk));
+    append(out, "nermal_auth_total{method=\"none\",result=\"challenged\"} %llu\n", Get(Counter::AuthChallenged));
+    append(out, "nermal_auth_total{method=\"any\",result=\"time_denied\"} %llu\n", Get(Counter::AuthTimeDenied));
+
+    header(out, "nermal_blacklist_hits_total", "counter", "Requests blocked, by blacklist");
+    BlacklistList::Instance().ForEachList([&out](Blacklist& list) {
+        append(out, "nermal_blacklist_hits_total{list=\"%s\"} %llu\n", list.GetName().c_str(), list.GetHits());
+    });
+
+    header(out, "nermal_dns_lookups_total", "counter", "Host lookups, by result");
+    append(out, "nermal_dns_lookups_total{result=\"cache_hit\"} %llu\n", Get(Counter::DnsCacheHits));
+    append(out, "nermal_dns_lookups_total{result=\"cache_miss\"} %llu\n", Get(Counter::DnsCacheMisses));
+    append(out, "nermal_dns_lookups_total{result=\"failed\"} %llu\n", Get(Counter::DnsFailures));
+
+    auto pool = ThreadPoolStats{};
+    ThreadPool::Instance().GetStats(pool);
+    header(out, "nermal_thread_pool_workers", "gauge", "Thread pool workers");
+    append(out, "nermal_thread_pool_workers %d\n", pool.workers);
+    header(out, "nermal_thread_pool_queue_depth", "gauge", "Tasks waiting for a thread pool worker");
+    append(out, "nermal_thread_pool_queue_depth %zu\n", pool.queued);
+    header(out, "nermal_thread_pool_tasks_total", "counter", "Thread pool tasks, by outcome");
+    append(out, "nermal_thread_pool_tasks_total{result=\"completed\"} %llu\n", pool.completed);
+    append(out, "nermal_thread_pool_tasks_total{result=\"rejected\"} %llu\n", pool.rejected);
+
+    header(out, "nermal_relayed_bytes_total", "counter", "Bytes relayed between clients and servers");
+    append(out, "nermal_relayed_bytes_total{direction=\"upstream\"} %llu\n", Get(Counter::BytesFromClients));
+    append(out, "nermal_relayed_bytes_total{direction=\"downstream\"} %llu\n", Get(Counter::BytesFromServers));
+
+    header(out, "nermal_pruned_total", "counter", "Connections closed by pruning");
+    append(out, "nermal_pruned_total{kind=\"session\"} %llu\n", Get(Counter::PrunedSessions));
+    append(out, "nermal_pruned_total{kind=\"upstream\"} %llu\n", Get(Counter::PrunedUpstreams));
+
+    header(out, "nermal_fastopen_attempts_total", "counter", "Upstream connections attempted with TCP Fast Open");
+    append(out, "nermal_fastopen_attempts_total %llu\n", Get(Counter::FastOpenAttempts));
+    header(out, "nermal_fastopen_total", "counter", "Upstream Fast Open connections, by whether the request went in the SYN");
+    append(out, "nermal_fastopen_total{result=\"syn_data\"} %llu\n", Get(Counter::FastOpenSynData));
+    append(out, "nermal_fastopen_total{result=\"fallback\"} %llu\n", Get(Counter::FastOpenFallbacks));
+
+    header(out, "nermal_phase_latency_us", "summary", "Time spent in each stage of a connection, in microseconds");
+    for (auto i = 0; i < static_cast<int>(Stage::NumStages); i++) {
+        auto stage = static_cast<Stage>(i);
+        auto values = HistogramSummary{};
+        PhaseStats::Instance().GetSummary(stage, values);
+        char labels[64];
+        snprintf(labels, sizeof(labels), "phase=\"%s\"", PhaseStats::GetStageName(stage));
+        summary(out, "nermal_phase_latency_us", labels, values);
+    }
+
+    auto lag = HistogramSummary{};
+    LoopMonitor::Instance().GetLagSummary(lag);
+    header(out, "nermal_loop_lag_us", "summary", "Time the event loop spent handling events between waits, in microseconds");
+    summary(out, "nermal_loop_lag_us", "loop=\"main\"", lag);
+
+    auto stalls = HistogramSummary{};
+    LoopMonitor::Instance().GetStallSummary(stalls);
+    header(out, "nermal_loop_stall_us", "summary", "Duration of handlers which stalled the event loop, in microseconds");
+    summary(out, "nermal_loop_stall_us", "loop=\"main\"", stalls);
+
+    header(out, "nermal_loop_stalls_total", "counter", "Event loop stalls, by handler");
+    for (auto i = 0; i < static_cast<int>(LoopHandler::NumHandlers); i++) {
+        auto handler = static_cast<LoopHandler>(i);
+        append(out, "nermal_loop_stalls_total{handler=\"%s\"} %llu\n", LoopMonitor::GetHandlerName(handler),
+               LoopMonitor::Instance().GetStalls(handler));
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Counters exported by the metrics endpoint
+enum class Counter : std::uint8_t {
+    Accepts,
+    SessionsRefused,
+    AuthBasicOk,
+    AuthBasicFailed,
+    AuthIpOk,
+    AuthChallenged,
+    AuthTimeDenied,
+    DnsCacheHits,
+    DnsCacheMisses,
+    DnsFailures,
+    BytesFromClients,
+    BytesFromServers,
+    PrunedSessions,
+    PrunedUpstreams,
+    FastOpenAttempts,
+    FastOpenSynData,
+    FastOpenFallbacks,
+    NumCounters
+};
+
+/**
+ * @brief The Metrics class holds the proxy's counters, and renders them (along
+ * with gauges read from the other subsystems) in the Prometheus text format.
+ * Counters are relaxed atomics, so they can be updated from any thread.
+ */
+class Metrics {
+public:
+    static Metrics& Instance();
+
+    void Increment(Counter counter, std::uint64_t amount = 1) {
+        m_counters[static_cast<int>(counter)].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    // Current value of a counter
+    std::uint64_t Get(Counter counter);
+
+    // Append the current metrics to out
+    void Render(std::string& out);
+
+private:
+    Metrics();
+
+    std::atomic<std::uint64_t> m_counters[static_cast<int>(Counter::NumCounters)];
+};
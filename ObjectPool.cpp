@@ -0,0 +1,90 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ObjectPool.hpp"
+
+#include <list>
+
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+namespace {
+
+std::mutex g_registryLock;
+std::list<PoolCounters*>& registry() {
+    static auto* pools = new std::list<PoolCounters*>;
+    return *pools;
+}
+
+} // anonymous namespace
+
+PoolCounters::PoolCounters(const char* name, std::size_t capacity)
+    : m_name{name}
+    , m_capacity{capacity}
+    , m_inUse{0}
+    , m_highWater{0}
+    , m_overflows{0}
+{
+    auto lg = std::unique_lock<std::mutex>{g_registryLock};
+    registry().push_back(this);
+}
+
+void PoolCounters::Acquired(bool overflow) {
+    auto inUse = ++m_inUse;
+    auto highWater = m_highWater.load(std::memory_order_relaxed);
+    while ((inUse > highWater) && !m_highWater.compare_exchange_weak(highWater, inUse, std::memory_order_relaxed)) {
+    }
+    if (overflow) {
+        m_overflows++;
+    }
+}
+
+void PoolCounters::Released() {
+    m_inUse--;
+}
+
+std::size_t PoolCounters::GetInUse() const {
+    return m_inUse.load(std::memory_order_relaxed);
+}
+
+void PoolCounters::ReportAll() {
+    static auto lastReport = Timestamp();
+    if ((Timestamp() - lastReport) < m_reportInterval) {
+        return;
+    }
+    lastReport = Timestamp();
+
+    auto lg = std::unique_lock<std::mutex>{g_registryLock};
+    for (auto* pool : registry()) {
+        Log(LogSeverity::Info, "Pool %s: %zu/%zu in use, high-water %zu, %llu heap overflows",
+            pool->m_name, pool->m_inUse.load(), pool->m_capacity, pool->m_highWater.load(), pool->m_overflows.load());
+    }
+}
@@ -0,0 +1,178 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ * @brief The PoolCounters class tracks occupancy of a fixed-size pool of
+ * objects.  Every instance registers itself so that all pools can be reported
+ * together.
+ */
+class PoolCounters {
+public:
+    PoolCounters(const char* name, std::size_t capacity);
+
+    // Account for an object taken from, or returned to, the pool
+    void Acquired(bool overflow);
+    void Released();
+
+    std::size_t GetInUse() const;
+
+    // Periodically log occupancy and high-water marks of all pools
+    static void ReportAll();
+
+private:
+    static constexpr auto m_reportInterval = 300 * 1000; // ms
+
+    const char* m_name;
+    std::size_t m_capacity;
+    std::atomic<std::size_t> m_inUse;
+    std::atomic<std::size_t> m_highWater;
+    std::atomic<std::uint64_t> m_overflows;
+};
+
+/**
+ * @brief The ObjectPool class is a fixed-size slab of blocks for objects of
+ * type T, used through class-level operator new/delete.  Each thread keeps a
+ * small cache of free blocks, so the shared free list (and its lock) is only
+ * touched in batches.  Once the slab is exhausted, allocations fall back to
+ * the heap.
+ */
+template <typename T, std::size_t Capacity>
+class ObjectPool {
+public:
+    static ObjectPool& Instance(const char* name) {
+        static ObjectPool* instance = new ObjectPool{name};
+        return *instance;
+    }
+
+    void* Allocate(std::size_t size) {
+        if (size != sizeof(T)) {
+            return ::operator new(size);
+        }
+
+        auto& cache = GetCache();
+        if (!cache.count) {
+            Refill(cache);
+        }
+        if (!cache.count) {
+            m_counters.Acquired(true);
+            return ::operator new(size);
+        }
+
+        m_counters.Acquired(false);
+        return cache.blocks[--cache.count];
+    }
+
+    void Free(void* block) {
+        if (!block) {
+            return;
+        }
+        if (!Contains(block)) {
+            m_counters.Released();
+            ::operator delete(block);
+            return;
+        }
+
+        m_counters.Released();
+        auto& cache = GetCache();
+        if (cache.count == m_cacheSize) {
+            Flush(cache, m_cacheSize / 2);
+        }
+        cache.blocks[cache.count++] = block;
+    }
+
+private:
+    static constexpr auto m_cacheSize = std::size_t{16};
+    static constexpr auto m_blockSize = ((sizeof(T) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t)) * alignof(std::max_align_t);
+
+    typedef struct LocalCache {
+        ObjectPool* pool = nullptr;
+        std::size_t count = 0;
+        void* blocks[m_cacheSize];
+
+        // Blocks held by an exiting thread go back to the shared list
+        ~LocalCache() {
+            if (pool) {
+                pool->Flush(*this, count);
+            }
+        }
+    } LocalCache;
+
+    explicit ObjectPool(const char* name)
+        : m_counters{name, Capacity}
+        , m_slab{static_cast<std::uint8_t*>(::operator new(m_blockSize * Capacity))}
+    {
+        m_free.reserve(Capacity);
+        for (auto i = Capacity; i > 0; i--) {
+            m_free.push_back(m_slab + ((i - 1) * m_blockSize));
+        }
+    }
+
+    LocalCache& GetCache() {
+        static thread_local LocalCache cache;
+        cache.pool = this;
+        return cache;
+    }
+
+    bool Contains(void* block) {
+        auto* bytes = static_cast<std::uint8_t*>(block);
+        return (bytes >= m_slab) && (bytes < (m_slab + (m_blockSize * Capacity)));
+    }
+
+    void Refill(LocalCache& cache) {
+        auto lg = std::unique_lock<std::mutex>{m_lock};
+        while (!m_free.empty() && (cache.count < (m_cacheSize / 2))) {
+            cache.blocks[cache.count++] = m_free.back();
+            m_free.pop_back();
+        }
+    }
+
+    void Flush(LocalCache& cache, std::size_t count) {
+        auto lg = std::unique_lock<std::mutex>{m_lock};
+        while (count-- && cache.count) {
+            m_free.push_back(cache.blocks[--cache.count]);
+        }
+    }
+
+    PoolCounters m_counters;
+    std::uint8_t* m_slab;
+
+    std::mutex m_lock;
+    std::vector<void*> m_free;
+};
@@ -0,0 +1,92 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PhaseStats.hpp"
+
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+PhaseStats& PhaseStats::Instance() {
+    static PhaseStats* instance = new PhaseStats;
+    return *instance;
+}
+
+PhaseStats::PhaseStats()
+    : m_lastReport{Timestamp()}
+{}
+
+void PhaseStats::Mark(Session* session, Phase phase, Phase since, Stage stage) {
+    session->MarkPhase(phase);
+    auto start = session->GetPhaseTime(since);
+    if (start) {
+        m_histograms[static_cast<int>(stage)].Record(session->GetPhaseTime(phase) - start);
+    }
+}
+
+void PhaseStats::GetSummary(Stage stage, HistogramSummary& summary) const {
+    m_histograms[static_cast<int>(stage)].Summarize(summary);
+}
+
+const char* PhaseStats::GetStageName(Stage stage) {
+    switch (stage) {
+    case Stage::Detect:
+        return "detect";
+    case Stage::Auth:
+        return "auth";
+    case Stage::ResolveCached:
+        return "resolve_cached";
+    case Stage::ResolveUncached:
+        return "resolve_uncached";
+    case Stage::Connect:
+        return "connect";
+    case Stage::FirstByte:
+        return "first_byte";
+    default:
+        return "unknown";
+    }
+}
+
+void PhaseStats::ReportStats() {
+    if ((Timestamp() - m_lastReport) < m_reportInterval) {
+        return;
+    }
+    m_lastReport = Timestamp();
+
+    for (auto i = 0; i < static_cast<int>(Stage::NumStages); i++) {
+        auto summary = HistogramSummary{};
+        GetSummary(static_cast<Stage>(i), summary);
+        if (!summary.count) {
+            continue;
+        }
+        Log(LogSeverity::Info, "Latency %s: %llu samples, p50 %lluus p90 %lluus p99 %lluus max %lluus",
+            GetStageName(static_cast<Stage>(i)), summary.count, summary.p50, summary.p90, summary.p99, summary.max);
+    }
+}
@@ -0,0 +1,76 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "LatencyHistogram.hpp"
+#include "Session.hpp"
+
+// Spans of the connection lifecycle, each between two session phases
+enum class Stage : std::uint8_t {
+    Detect,             // Accepted -> Parsed
+    Auth,               // Parsed -> Authorized
+    ResolveCached,      // Authorized -> Resolved, from the DNS cache
+    ResolveUncached,    // Authorized -> Resolved, by lookup
+    Connect,            // Resolved -> Connected
+    FirstByte,          // Connected -> FirstByte
+    NumStages
+};
+
+/**
+ * @brief The PhaseStats class keeps a latency histogram for each stage of the
+ * connection lifecycle, so slow page loads can be pinned on the proxy, DNS or
+ * the server.
+ */
+class PhaseStats {
+public:
+    static PhaseStats& Instance();
+
+    // Mark the session reaching a phase, and record the time since an earlier
+    // phase against a stage.  Nothing is recorded if the earlier phase was skipped.
+    void Mark(Session* session, Phase phase, Phase since, Stage stage);
+
+    void GetSummary(Stage stage, HistogramSummary& summary) const;
+    static const char* GetStageName(Stage stage);
+
+    // Periodically log the percentiles for each stage
+    void ReportStats();
+
+private:
+    PhaseStats();
+
+    static constexpr auto m_reportInterval = 300 * 1000; // ms
+
+    LatencyHistogram m_histograms[static_cast<int>(Stage::NumStages)];
+    std::uint64_t m_lastReport;
+};
@@ -60,6 +60,10 @@ bool UserPolicy::GetDomain(int idx, std::string& domain) {
     return false;
 }
 
+const std::list<std::string>& UserPolicy::GetDomains() {
+    return m_domains;
+}
+
 void UserPolicyList::AddPolicy(std::unique_ptr<UserPolicy> policy) {
     m_policies.emplace_back(std::move(policy));
 }
@@ -69,6 +73,15 @@ UserPolicyList& UserPolicyList::Instance() {
     return *instance;
 }
 
+const std::list<std::string>* UserPolicyList::GetUserDomains(const std::string& user) {
+    for (auto it = m_policies.begin(); it != m_policies.end(); it++) {
+        if (it->get()->GetName() == user) {
+            return &it->get()->GetDomains();
+        }
+    }
+    return nullptr;
+}
+
 bool UserPolicyList::GetUserDomain(int idx, const std::string& user, std::string &domain) {
     for (auto it = m_policies.begin(); it != m_policies.end(); it++) {
         if (it->get()->GetName() == user) {
@@ -33,6 +33,7 @@
 
 #include <list>
 #include <memory>
+#include <string>
 
 /**
  * @brief The UserPolicy class manages the domain black-lists that are
@@ -45,6 +46,7 @@ public:
     const std::string& GetName();
     void AddDomain(const std::string& domain);
     bool GetDomain(int idx, std::string& domain);
+    const std::list<std::string>& GetDomains();
 
 private:
     std::string m_name;
@@ -61,6 +63,9 @@ public:
     static UserPolicyList& Instance();
     bool GetUserDomain(int idx, const std::string& user, std::string &domain);
 
+    // Get all domains that apply to a user, or nullptr if the user has no policy
+    const std::list<std::string>* GetUserDomains(const std::string& user);
+
 private:
     std::list<std::unique_ptr<UserPolicy>> m_policies;
 };
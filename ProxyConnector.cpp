@@ -34,32 +34,40 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-#include <mutex>
-#include <semaphore.h>
-#include <thread>
+#include <list>
 
 #include "AsyncMessenger.hpp"
+#include "DiskCache.hpp"
+#include "FastOpen.hpp"
 #include "HostResolver.hpp"
+#include "Metrics.hpp"
+#include "ObjectPool.hpp"
+#include "PhaseStats.hpp"
+#include "ResponseCache.hpp"
 #include "Session.hpp"
+#include "SocketIo.hpp"
+#include "ThreadPool.hpp"
+#include "UpstreamPool.hpp"
 #include "UserAuth.hpp"
 #include "Log.hpp"
 #include "BlackList.hpp"
 #include "Policy.hpp"
 
-using ThreadFunc = void (*)(void* context);
-
-typedef struct {
-    ThreadFunc handler;
-    void* context;
-} WorkPackage;
-
 struct proxyDeets {
     int sessionId;
+    static void* operator new(std::size_t size) {
+        return ObjectPool<proxyDeets, 1024>::Instance("proxyDeets").Allocate(size);
+    }
+    static void operator delete(void* block) {
+        ObjectPool<proxyDeets, 1024>::Instance("proxyDeets").Free(block);
+    }
     void cleanup() {
         delete this;
     }
@@ -67,6 +75,29 @@ struct proxyDeets {
 
 struct connectDeets {
     int sessionId;
+    IHostResolver* resolver;
+    static void* operator new(std::size_t size) {
+        return ObjectPool<connectDeets, 1024>::Instance("connectDeets").Allocate(size);
+    }
+    static void operator delete(void* block) {
+        ObjectPool<connectDeets, 1024>::Instance("connectDeets").Free(block);
+    }
+    void cleanup() {
+        delete this;
+    }
+};
+
+struct cacheSendDeets {
+    int sessionId;
+    int fileFd;             // -1 when sending data from the memory cache
+    std::uint64_t size;
+    std::string data;
+    static void* operator new(std::size_t size) {
+        return ObjectPool<cacheSendDeets, 1024>::Instance("cacheSendDeets").Allocate(size);
+    }
+    static void operator delete(void* block) {
+        ObjectPool<cacheSendDeets, 1024>::Instance("cacheSendDeets").Free(block);
+    }
     void cleanup() {
         delete this;
     }
@@ -88,58 +119,184 @@ void sendErrorResponse(int sessionId_) {
     sendResponse(-1, sessionId_, false);
 }
 
+// Returns false if the host is blocked by any of the domains in the list
+bool isAllowedByDomains(const std::list<std::string>* domains_, const std::string& host_) {
+    if (!domains_) {
+        return true;
+    }
+    for (auto& domain : *domains_) {
+        if (!BlacklistList::Instance().IsAllowedInList(domain, host_)) {
+            Log(LogSeverity::Debug, "host %s not allowed in domain %s", host_.c_str(), domain.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
 bool isAllowed(Session* session_) {
-    int idx = 0;
-    bool allowed = true;
-    std::string domain;
-
-    while (UserPolicyList::Instance().GetUserDomain(idx++, session_->GetUserName(), domain)) {
-        if (!BlacklistList::Instance().IsAllowedInList(domain, session_->GetHost())) {
-            Log(LogSeverity::Debug, "host %s not allowed in domain %s", session_->GetHost().c_str(), domain.c_str());
-            allowed = false;
-            break;
+    static const auto globalDomain = std::string{"<global>"};
+    auto& policies = UserPolicyList::Instance();
+    auto& host = session_->GetHost();
+
+    return isAllowedByDomains(policies.GetUserDomains(session_->GetUserName()), host) &&
+           isAllowedByDomains(policies.GetUserDomains(globalDomain), host);
+}
+
+bool writeAll(int fd_, const char* data_, size_t size_) {
+    while (size_) {
+        auto rc = SocketIo::Instance().Write(fd_, data_, size_);
+        if (rc <= 0) {
+            if ((rc == -1) && (errno == EINTR)) {
+                continue;
+            }
+            return false;
         }
+        data_ += rc;
+        size_ -= rc;
     }
+    return true;
+}
 
-    idx = 0;
-    if (allowed) {
-        auto globalDomain = std::string{"<global>"};
-        while (UserPolicyList::Instance().GetUserDomain(idx++, globalDomain, domain)) {
-            if (!BlacklistList::Instance().IsAllowedInList(domain, session_->GetHost())) {
-                Log(LogSeverity::Debug, "host %s not allowed in domain %s", session_->GetHost().c_str(), domain.c_str());
-                allowed = false;
-                break;
+// Returns true if a blocked request is most likely for an image, in which case a
+// transparent pixel is sent so the page lays out as if the image had loaded.
+bool isImageRequest(const std::string& request_) {
+    auto lineEnd = request_.find("\r\n");
+    auto urlEnd = request_.rfind(' ', lineEnd);
+    if ((lineEnd != std::string::npos) && (urlEnd != std::string::npos)) {
+        auto url = request_.substr(0, urlEnd);
+        auto query = url.find('?');
+        if (query != std::string::npos) {
+            url.resize(query);
+        }
+        static const char* imageTypes[] = {".gif", ".png", ".jpg", ".jpeg", ".webp", ".ico", ".svg", ".bmp"};
+        for (const auto* type : imageTypes) {
+            auto length = strlen(type);
+            if ((url.size() > length) && (0 == strcasecmp(url.c_str() + url.size() - length, type))) {
+                return true;
             }
         }
     }
+    return (strcasestr(request_.c_str(), "\r\nAccept: image/") != nullptr);
+}
+
+// Shed load when the thread pool can't take any more work
+void sendOverloadResponse(Session* session_) {
+    static const char* unavailableMessage =
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Retry-After: 1\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n"
+            "\r\n";
+    Log(LogSeverity::Warn, "Thread pool overloaded, rejecting session %d", session_->GetSessionId());
+    writeAll(session_->GetClientFd(), unavailableMessage, strlen(unavailableMessage));
+    SocketIo::Instance().Close(session_->GetClientFd());
+    SessionManager::Instance().EndSession(session_->GetSessionId(), CloseReason::Overloaded);
+}
+
+// Answer a request denied by policy straight away, with a response that browsers
+// won't retry or wait on.
+void sendBlockedResponse(Session* session_) {
+    static const char* connectRefused =
+            "HTTP/1.1 403 Forbidden\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n"
+            "\r\n";
+    static const char* noContent =
+            "HTTP/1.1 204 No Content\r\n"
+            "Connection: close\r\n"
+            "\r\n";
+
+    // 1x1 transparent GIF
+    static const auto transparentImage = []() {
+        static const unsigned char gif[] = {
+            0x47, 0x49, 0x46, 0x38, 0x39, 0x61, 0x01, 0x00, 0x01, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0xff, 0xff, 0xff, 0x21, 0xf9, 0x04, 0x01, 0x00, 0x00, 0x00, 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00,
+            0x01, 0x00, 0x01, 0x00, 0x00, 0x02, 0x02, 0x44, 0x01, 0x00, 0x3b,
+        };
+        auto response = std::string{
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: image/gif\r\n"
+                "Cache-Control: no-store\r\n"
+                "Connection: close\r\n"
+                "Content-Length: "};
+        response += std::to_string(sizeof(gif)) + "\r\n\r\n";
+        response.append(reinterpret_cast<const char*>(gif), sizeof(gif));
+        return response;
+    }();
+
+    auto written = false;
+    if (!session_->GetTransparent()) {
+        written = writeAll(session_->GetClientFd(), connectRefused, strlen(connectRefused));
+    } else if (isImageRequest(session_->GetRequest())) {
+        written = writeAll(session_->GetClientFd(), transparentImage.data(), transparentImage.size());
+    } else {
+        written = writeAll(session_->GetClientFd(), noContent, strlen(noContent));
+    }
+    if (!written) {
+        Log(LogSeverity::Debug, "%s: Unable to write blocked response", __func__);
+    }
 
-    return allowed;
+    SocketIo::Instance().Close(session_->GetClientFd());
+    SessionManager::Instance().EndSession(session_->GetSessionId(), CloseReason::Blocked);
 }
 
 void asyncConnector(void* ctx) {
     Log(LogSeverity::Debug, "%s:enter", __func__);
     auto* deets = static_cast<struct connectDeets*>(ctx);
     auto sessionId = deets->sessionId;
-    auto* session = SessionManager::Instance().GetSession(sessionId);
+    auto session = SessionManager::Instance().AcquireSession(sessionId);
+    if (!session) {
+        deets->cleanup();
+        return;
+    }
+
+    auto& io = SocketIo::Instance();
+
+    // Plain-HTTP requests to a server we've recently talked to can go out over an idle
+    // connection, skipping both the DNS lookup and the TCP handshake.
+    auto reusable = session->GetTransparent() && UpstreamPool::Instance().IsEnabled() &&
+                    UpstreamPool::IsPoolableRequest(session->GetRequest());
+    session->SetUpstreamReusable(reusable);
+    if (reusable) {
+        auto pooledFd = UpstreamPool::Instance().Acquire(session->GetHost(), session->GetPort());
+        if (pooledFd != -1) {
+            auto rc = io.Write(pooledFd, session->GetRequest().c_str(), session->GetRequest().length());
+            if (rc == static_cast<ssize_t>(session->GetRequest().length())) {
+                sendResponse(pooledFd, sessionId, true);
+                deets->cleanup();
+                return;
+            }
+            Log(LogSeverity::Debug, "%s: pooled connection failed, reconnecting", __func__);
+            io.Close(pooledFd);
+        }
+    }
 
     // Resolve the host -- this is the most time consuming part of the function usually, which is why we
     // run this asynchronously from the rest of the connection process
+    // Each pool thread keeps its own result vector so lookups reuse its storage
+    thread_local auto hostAddresses = std::vector<HostInfo>{};
     auto cached = false;
-    auto hostAddresses = HostResolver::Instance().GetAddressesForHost(session->GetHost(), session->GetPort(), cached);
-    if (hostAddresses.size() == 0) {
+    auto resolved = deets->resolver->GetAddressesForHost(session->GetHost(), session->GetPort(), hostAddresses, cached);
+    Metrics::Instance().Increment(!resolved ? Counter::DnsFailures : (cached ? Counter::DnsCacheHits : Counter::DnsCacheMisses));
+    if (!resolved) {
         sendErrorResponse(sessionId);
         deets->cleanup();
         return;
     }
+    session->SetResolveCached(cached);
+    PhaseStats::Instance().Mark(session.get(), Phase::Resolved, Phase::Authorized,
+                                cached ? Stage::ResolveCached : Stage::ResolveUncached);
 
     // Successful DNS query - Create socket to connect to the target server
-    auto sockFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto sockFd = io.Socket(AF_INET, SOCK_STREAM, 0);
     if (sockFd == -1) {
         sendErrorResponse(sessionId);
         deets->cleanup();
         return;
     }
 
+    // Transparent requests can go out in the SYN, to servers that support it
+    auto fastOpen = session->GetTransparent() && FastOpen::Instance().IsEnabled();
     auto connected = false;
     auto rc = int{-1};
     for (auto& address : hostAddresses) {
@@ -162,6 +319,7 @@ void asyncConnector(void* ctx) {
                 Log(LogSeverity::Debug, "Can't convert address");
                 continue;
             }
+            session->AddTriedAddress(4, &dest4->sin_addr);
         } else {
             auto* dest6 = reinterpret_cast<struct sockaddr_in6*>(&dest);
             dest6->sin6_family = AF_INET6;
@@ -172,8 +330,14 @@ void asyncConnector(void* ctx) {
                 Log(LogSeverity::Debug, "Can't convert address");
                 continue;
             }
+            session->AddTriedAddress(6, &dest6->sin6_addr);
+        }
+        if (fastOpen) {
+            rc = FastOpen::Instance().Connect(sockFd, (const sockaddr*)&dest, sizeof(sockaddr_in6),
+                                              session->GetRequest().c_str(), session->GetRequest().length());
+        } else {
+            rc = io.Connect(sockFd, (const sockaddr*)&dest, sizeof(sockaddr_in6));
         }
-        rc = ::connect(sockFd, (const sockaddr*)&dest, sizeof(sockaddr_in6));
 
         if (rc != -1) {
             Log(LogSeverity::Debug, "Connected to %s:d", address.url.c_str(), sessionId);
@@ -185,21 +349,23 @@ void asyncConnector(void* ctx) {
     if (!connected) {
         Log(LogSeverity::Debug, "Couldn't connect");
         sendErrorResponse(sessionId);
-        deets->cleanup();
         // If we couldn't connect to any of the cached URLs, clear the cache.
-        HostResolver::Instance().ClearCacheForHost(session->GetHost());
+        deets->resolver->ClearCacheForHost(session->GetHost());
+        deets->cleanup();
         return;
     }
 
-    if (session->GetTransparent()) {
+    if (fastOpen) {
+        // Request was sent while connecting
+    } else if (session->GetTransparent()) {
         // GET mode proxying is assumed to be transparent - resend the request.
-        auto rc = ::write(sockFd, session->GetRequest().c_str(), session->GetRequest().length());
+        auto rc = io.Write(sockFd, session->GetRequest().c_str(), session->GetRequest().length());
         if (rc == -1) {
             Log(LogSeverity::Error, "%s: Unable to resend initial request", __func__);
         }
     } else {
         static const char* responseString = "HTTP/1.0 200 OK\r\n\r\n";
-        auto rc = ::write(session->GetClientFd(), responseString, strlen(responseString));
+        auto rc = io.Write(session->GetClientFd(), responseString, strlen(responseString));
         if (rc == -1) {
             Log(LogSeverity::Error, "%s: Unable to write success code", __func__);
         }
@@ -208,10 +374,10 @@ void asyncConnector(void* ctx) {
     // Parse out headers...
     auto alive = int{1};
     if (0 == strstr(session->GetRequest().c_str(), "Connection: keep-alive")) {
-        setsockopt(sockFd, SOL_SOCKET, SO_KEEPALIVE, &alive, sizeof(alive));
+        io.SetSockOpt(sockFd, SOL_SOCKET, SO_KEEPALIVE, &alive, sizeof(alive));
     }
     if (0 == strstr(session->GetRequest().c_str(), "Proxy-Connection: keep-alive")) {
-        setsockopt(session->GetClientFd(), SOL_SOCKET, SO_KEEPALIVE, &alive, sizeof(alive));
+        io.SetSockOpt(session->GetClientFd(), SOL_SOCKET, SO_KEEPALIVE, &alive, sizeof(alive));
     }
 
     // Set a timeout on the socket when reading/writing to prevent getting stuck waiting for
@@ -219,78 +385,95 @@ void asyncConnector(void* ctx) {
     struct timeval timeout = {};
     timeout.tv_sec = 10;
     timeout.tv_usec = 0;
-    ::setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-    ::setsockopt(sockFd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+    io.SetSockOpt(sockFd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    io.SetSockOpt(sockFd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
 
     // Send an asynchronous message back to the main thread
     sendResponse(sockFd, sessionId, true);
     deets->cleanup();
 }
 
+void asyncCacheSender(void* ctx) {
+    Log(LogSeverity::Debug, "%s:enter", __func__);
+    auto* deets = static_cast<struct cacheSendDeets*>(ctx);
+    auto session = SessionManager::Instance().AcquireSession(deets->sessionId);
+    if (!session) {
+        if (deets->fileFd != -1) {
+            ::close(deets->fileFd);
+        }
+        deets->cleanup();
+        return;
+    }
+    auto clientFd = session->GetClientFd();
+
+    // Don't let a client that stops reading hold on to this thread forever
+    struct timeval timeout = {};
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+    SocketIo::Instance().SetSockOpt(clientFd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+
+    auto offset = off_t{0};
+    auto success = true;
+    if (deets->fileFd == -1) {
+        success = writeAll(clientFd, deets->data.data(), deets->data.size());
+        offset = success ? static_cast<off_t>(deets->data.size()) : 0;
+    } else {
+        // The kernel copies straight from the page cache to the socket
+        while (static_cast<std::uint64_t>(offset) < deets->size) {
+            auto rc = ::sendfile(clientFd, deets->fileFd, &offset, deets->size - offset);
+            if (rc <= 0) {
+                if ((rc == -1) && (errno == EINTR)) {
+                    continue;
+                }
+                success = false;
+                break;
+            }
+        }
+        ::close(deets->fileFd);
+    }
+
+    auto msg = AsyncMessage_t{};
+    msg.msgId = CACHE_SEND_RESULT;
+    msg.data.cacheSendResult.sessionId = deets->sessionId;
+    msg.data.cacheSendResult.bytesSent = static_cast<std::uint64_t>(offset);
+    msg.data.cacheSendResult.success = success;
+    msg.data.cacheSendResult.fromDisk = (deets->fileFd != -1);
+
+    deets->cleanup();
+    AsyncMessenger::Instance().WriteMessage(msg);
+}
+
 void asyncDetector(void* ctx) {
     Log(LogSeverity::Debug, "%s:enter", __func__);
     auto* deets = static_cast<struct proxyDeets*>(ctx);
     auto sessionId = deets->sessionId;
-    auto* session = SessionManager::Instance().GetSession(sessionId);
+    auto session = SessionManager::Instance().AcquireSession(sessionId);
+    if (!session) {
+        deets->cleanup();
+        return;
+    }
     int clientFd = session->GetClientFd();
 
     char buf[4096] = {};
-    auto transparent = false;
-    auto numRead = ::read(clientFd, buf, sizeof(buf));
+    auto numRead = SocketIo::Instance().Read(clientFd, buf, sizeof(buf) - 1);
     auto success = true;
-    auto port = int{80};
-    char url[1024] = {};
+    auto head = RequestHead{};
 
     if (numRead <= 0) {
         Log(LogSeverity::Debug, "Bail on read - fd=%d, errno%d", clientFd, errno);
         success = false;
+    } else if (!ProxyConnector::ParseRequestHead(buf, head)) {
+        Log(LogSeverity::Debug, "Invalid proxy connect string - %s", buf);
+        success = false;
     } else {
-
-        // Parse out the connect string...
-        char mode[1024] = {};
-        auto numScanned = ::sscanf(buf, "%1024s %1024s HTTP/1.%*d", mode, url);
-
-        if (0 == strcmp("CONNECT", mode)) {
-            Log(LogSeverity::Debug, "fd=%d connect-mode proxy", clientFd);
-            transparent = false;
-        } else if (0 == strcmp("GET", mode)) {
-            Log(LogSeverity::Debug, "fd=%d get-mode proxy", clientFd);
-            transparent = true;
-        } else if (0 == strcmp("POST", mode)) {
-            Log(LogSeverity::Debug, "fd=%d post-mode proxy", clientFd);
-            transparent = true;
-        }
-
-        if (!transparent) {
-            // Parse out the port from the url
-            auto* lastColon = strchr(url, ':');
-            if (lastColon) {
-                ::sscanf(lastColon, ":%d", &port);
-                *lastColon = '\0';
-            }
-        } else {
-            // Support transparent mode proxy for HTTP traffic only (GET/POST)
-            numScanned = ::sscanf(buf, "%*s http://%1024s HTTP/1.%*d", url);
-            if (numScanned != 1) {
-                Log(LogSeverity::Debug, "Invalid proxy connect string - %s", buf);
-                success = false;
-            } else {
-                // Parse out any trailing slashes
-                auto* lastSlash = strchr(url, '/');
-                if (lastSlash) {
-                    *lastSlash = '\0';
-                }
-            }
-        }
+        Log(LogSeverity::Debug, "fd=%d %s-mode proxy", clientFd, head.transparent ? "transparent" : "connect");
     }
 
-    auto urlString = std::string(url);
-    auto requestString = std::string(buf);
     if (success) {
-        session->SetHost(urlString);
-        session->SetPort(port);
-        session->SetRequest(requestString);
-        session->SetTransparent(transparent);
+        session->SetHost(head.host, strlen(head.host));
+        session->SetPort(head.port);
+        session->SetRequest(buf, strlen(buf));
+        session->SetTransparent(head.transparent);
     }
 
     auto msg = AsyncMessage_t{};
@@ -304,66 +487,57 @@ void asyncDetector(void* ctx) {
 
 } // anonymous namespace
 
-class ThreadPool {
-public:
-    static ThreadPool& Instance() {
-        static ThreadPool* instance= new ThreadPool{};
-        return *instance;
-    }
-
-    void Begin() {
-        auto workerTask = [&]() {
-            while(1) {
-                sem_wait(&m_poolSem);
-                auto package= WorkPackage{};
-                {
-                    auto lg = LockGuard{m_workMutex};
-                    package = m_work.front();
-                    m_work.pop_front();
-                }
-                if (package.handler) {
-                    package.handler(package.context);
-                }
-            }
-        };
+ProxyConnector::ProxyConnector()
+    : ProxyConnector(HostResolver::Instance())
+{}
 
-        for (auto i = 0; i < threadPoolSize; i++) {
-            auto* newThread = new std::thread(workerTask);
-            newThread->detach();
+ProxyConnector::ProxyConnector(IHostResolver& resolver)
+    : m_resolver{resolver}
+{}
+
+bool ProxyConnector::ParseRequestHead(const char* request, RequestHead& head) {
+    char mode[1024] = {};
+    head.host[0] = '\0';
+    head.port = 80;
+    ::sscanf(request, "%1023s %1023s HTTP/1.%*d", mode, head.host);
+    head.transparent = (0 == strcmp("GET", mode)) || (0 == strcmp("POST", mode));
+
+    if (!head.transparent) {
+        // Parse out the port from the url
+        auto* lastColon = strchr(head.host, ':');
+        if (lastColon) {
+            ::sscanf(lastColon, ":%d", &head.port);
+            *lastColon = '\0';
         }
+        return true;
     }
 
-    void Dispatch(WorkPackage& package) {
-        auto lg = LockGuard{m_workMutex};
-        m_work.push_back(package);
-        sem_post(&m_poolSem);
+    // Support transparent mode proxy for HTTP traffic only (GET/POST)
+    if (::sscanf(request, "%*s http://%1023s HTTP/1.%*d", head.host) != 1) {
+        return false;
     }
-
-private:
-    ThreadPool()
-    {
-        sem_init(&m_poolSem, 0, 0);
-        Begin();
+    // Parse out any trailing slashes, then the port if one is given
+    auto* lastSlash = strchr(head.host, '/');
+    if (lastSlash) {
+        *lastSlash = '\0';
     }
-
-    static constexpr auto threadPoolSize = 20; // threads
-
-    using LockGuard = std::unique_lock<std::mutex>;
-    sem_t m_poolSem;
-
-    std::mutex m_workMutex;
-    std::list<WorkPackage> m_work;
-};
-
-ProxyConnector::ProxyConnector()
-{}
+    auto* lastColon = strchr(head.host, ':');
+    if (lastColon) {
+        ::sscanf(lastColon, ":%d", &head.port);
+        *lastColon = '\0';
+    }
+    return true;
+}
 
 void ProxyConnector::BeginProxyDetect(const int sessionId) {
     // Figure out what kind of proxy connection this is...
     auto* deets = new proxyDeets{.sessionId = sessionId};
-    auto work = WorkPackage{.handler = asyncDetector, .context = deets};
+    auto work = WorkPackage{.handler = asyncDetector, .context = deets, .enqueued = 0};
 
-    ThreadPool::Instance().Dispatch(work);
+    if (!ThreadPool::Instance().Dispatch(work)) {
+        deets->cleanup();
+        sendOverloadResponse(SessionManager::Instance().GetSession(sessionId));
+    }
 }
 
 void ProxyConnector::ConnectProxy(const int sessionId) {
@@ -373,14 +547,120 @@ void ProxyConnector::ConnectProxy(const int sessionId) {
     // this site in this session.
     auto* session = SessionManager::Instance().GetSession(sessionId);
     if (!isAllowed(session)) {
-        sendErrorResponse(sessionId);
+        sendBlockedResponse(session);
         return;
     }
 
+    // Plain-HTTP requests may be answered straight from the response cache
+    if (session->GetTransparent() && ResponseCache::Instance().IsEnabled()) {
+        if (ServeFromCache(session)) {
+            return;
+        }
+    }
+
     // Dispatch an async event to the threadpool to handle the connection process
     auto* deets = new connectDeets{};
     deets->sessionId = sessionId;
-    auto work = WorkPackage{.handler = asyncConnector, .context = deets};
+    deets->resolver = &m_resolver;
+    auto work = WorkPackage{.handler = asyncConnector, .context = deets, .enqueued = 0};
+
+    if (!ThreadPool::Instance().Dispatch(work)) {
+        deets->cleanup();
+        sendOverloadResponse(session);
+    }
+}
+
+void ProxyConnector::SendCachedResponse(const int sessionId, const int fileFd, const std::uint64_t size) {
+    auto* deets = new cacheSendDeets{};
+    deets->sessionId = sessionId;
+    deets->fileFd = fileFd;
+    deets->size = size;
+    auto work = WorkPackage{.handler = asyncCacheSender, .context = deets, .enqueued = 0};
+
+    if (!ThreadPool::Instance().Dispatch(work)) {
+        ::close(fileFd);
+        deets->cleanup();
+        sendOverloadResponse(SessionManager::Instance().GetSession(sessionId));
+    }
+}
+
+void ProxyConnector::SendCachedResponse(const int sessionId, const std::string& response) {
+    auto* deets = new cacheSendDeets{};
+    deets->sessionId = sessionId;
+    deets->fileFd = -1;
+    deets->size = response.size();
+    deets->data = response;
+    auto work = WorkPackage{.handler = asyncCacheSender, .context = deets, .enqueued = 0};
+
+    if (!ThreadPool::Instance().Dispatch(work)) {
+        deets->cleanup();
+        sendOverloadResponse(SessionManager::Instance().GetSession(sessionId));
+    }
+}
+
+// Answer a plain-HTTP request from the response cache if possible.  Returns true if
+// the session was handled, false if it must go to the server.
+bool ProxyConnector::ServeFromCache(Session* session) {
+    auto& cache = ResponseCache::Instance();
+    auto key = std::string{};
+    if (!ResponseCache::GetKeyForRequest(session->GetRequest(), key)) {
+        return false;
+    }
+
+    const CachedResponse* entry = nullptr;
+    auto result = cache.Lookup(key, entry);
+    if (result == ResponseCache::Result::Hit) {
+        Log(LogSeverity::Debug, "Session %d - cache hit for %s", session->GetSessionId(), key.c_str());
+        if (entry->response.size() > inlineSendLimit) {
+            // The client may not drain a large response quickly - don't hold up the loop for it
+            SendCachedResponse(session->GetSessionId(), entry->response);
+            return true;
+        }
+        if (!writeAll(session->GetClientFd(), entry->response.data(), entry->response.size())) {
+            Log(LogSeverity::Debug, "%s: Unable to write cached response", __func__);
+        }
+        cache.AddServedBytes(entry->response.size(), 0);
+        session->AddTxBytes(entry->response.size());
+        SocketIo::Instance().Close(session->GetClientFd());
+        SessionManager::Instance().EndSession(session->GetSessionId(), CloseReason::CacheServed);
+        return true;
+    }
+
+    if (result == ResponseCache::Result::Stale) {
+        Log(LogSeverity::Debug, "Session %d - revalidating %s", session->GetSessionId(), key.c_str());
+        auto conditional = ResponseCache::MakeConditionalRequest(session->GetRequest(), entry->etag, entry->lastModified);
+        session->SetRequest(conditional);
+        session->SetCacheState(CacheState::Revalidating);
+        session->SetCacheKey(key);
+        return false;
+    }
+
+    if (result != ResponseCache::Result::Miss) {
+        return false;
+    }
+
+    // Not in memory - try the disk cache
+    if (DiskCache::Instance().IsEnabled()) {
+        const DiskCacheEntry* diskEntry = nullptr;
+        auto fileFd = int{-1};
+        switch (DiskCache::Instance().Lookup(key, diskEntry, fileFd)) {
+        case ResponseCache::Result::Hit: {
+            Log(LogSeverity::Debug, "Session %d - disk cache hit for %s", session->GetSessionId(), key.c_str());
+            SendCachedResponse(session->GetSessionId(), fileFd, diskEntry->size);
+        } return true;
+        case ResponseCache::Result::Stale: {
+            Log(LogSeverity::Debug, "Session %d - revalidating %s", session->GetSessionId(), key.c_str());
+            auto conditional = ResponseCache::MakeConditionalRequest(session->GetRequest(), diskEntry->etag, diskEntry->lastModified);
+            session->SetRequest(conditional);
+            session->SetCacheState(CacheState::Revalidating);
+            session->SetCacheKey(key);
+        } return false;
+        default: {
+        } break;
+        }
+    }
 
-    ThreadPool::Instance().Dispatch(work);
+    session->SetCacheState(CacheState::Filling);
+    session->SetCacheKey(key);
+    return false;
 }
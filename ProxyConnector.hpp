@@ -30,9 +30,19 @@
  */
 
 #pragma once
+#include <cstdint>
 #include <string>
 #include "IHostResolver.hpp"
 
+class Session;
+
+// Where a proxy request is headed, parsed from the head of the request
+typedef struct {
+    char host[1024];
+    int port;
+    bool transparent;   // GET/POST - the request is passed on to the server
+} RequestHead;
+
 /**
  * @brief The ProxyConnector class establishes a proxy connection on behalf of a
  * client for a given session.  This includes initial proxy detection (correct headers
@@ -43,9 +53,29 @@ class ProxyConnector {
 public:
     ProxyConnector();
 
+    // Resolve hosts with the given resolver, rather than the system's
+    explicit ProxyConnector(IHostResolver& resolver);
+
     void BeginProxyDetect(const int sessionId);
     void ConnectProxy(const int sessionId);
 
+    // Send a response from the disk cache to the session's client, in the background
+    void SendCachedResponse(const int sessionId, const int fileFd, const std::uint64_t size);
+
+    // Send a copy of a response from the memory cache to the session's client, in the background
+    void SendCachedResponse(const int sessionId, const std::string& response);
+
+    // Memory cache hits up to this size fit in an empty socket send buffer, so are
+    // written straight from the event loop; larger ones are sent from the pool.
+    static constexpr std::size_t inlineSendLimit = 16 * 1024;
+
+    // Parse the request line of a null-terminated request; returns false if it isn't understood
+    static bool ParseRequestHead(const char* request, RequestHead& head);
+
 private:
+    bool ServeFromCache(Session* session);
+
+    IHostResolver& m_resolver;
+
     static constexpr auto maxAsyncTasks = 8;
 };
@@ -0,0 +1,353 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ResponseCache.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <string>
+
+#include "DiskCache.hpp"
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+namespace {
+
+// Returns true if the request contains a header with the given name
+bool hasRequestHeader(const std::string& request, const char* name) {
+    char search[64];
+    snprintf(search, sizeof(search), "\r\n%s:", name);
+    return (strcasestr(request.c_str(), search) != nullptr);
+}
+
+// Parse an RFC 7231 HTTP-date (i.e. "Sun, 06 Nov 1994 08:49:37 GMT")
+bool parseHttpDate(const std::string& value, std::time_t& time) {
+    auto tm = (struct tm){};
+    if (strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm) == nullptr) {
+        return false;
+    }
+    time = timegm(&tm);
+    return true;
+}
+
+// Find a numeric Cache-Control directive (i.e. "max-age=3600")
+bool getDirective(const std::string& cacheControl, const char* directive, long& value) {
+    const auto* match = strcasestr(cacheControl.c_str(), directive);
+    if (!match) {
+        return false;
+    }
+    match += strlen(directive);
+    if (*match != '=') {
+        return false;
+    }
+    value = strtol(match + 1, nullptr, 10);
+    return true;
+}
+
+} // anonymous namespace
+
+ResponseCache& ResponseCache::Instance() {
+    static ResponseCache* instance = new ResponseCache;
+    return *instance;
+}
+
+ResponseCache::ResponseCache()
+    : m_enabled{false}
+    , m_maxSize{16 * 1024 * 1024}
+    , m_maxObjectSize{1024 * 1024}
+    , m_size{0}
+    , m_hits{0}
+    , m_misses{0}
+    , m_revalidations{0}
+    , m_bytesServed{0}
+    , m_bytesSaved{0}
+    , m_lastReport{Timestamp()}
+{}
+
+void ResponseCache::SetEnabled(bool enable) {
+    m_enabled = enable;
+}
+
+bool ResponseCache::IsEnabled() {
+    return m_enabled;
+}
+
+void ResponseCache::SetMaxSize(std::size_t maxBytes) {
+    m_maxSize = maxBytes;
+    Evict();
+}
+
+void ResponseCache::SetMaxObjectSize(std::size_t maxBytes) {
+    m_maxObjectSize = maxBytes;
+}
+
+std::size_t ResponseCache::GetMaxObjectSize() {
+    return m_maxObjectSize;
+}
+
+bool ResponseCache::GetKeyForRequest(const std::string& request, std::string& key) {
+    if (0 != strncmp(request.c_str(), "GET ", 4)) {
+        return false;
+    }
+
+    // Requests carrying credentials, partial requests, and clients doing their own
+    // revalidation or asking to bypass caches go straight to the server.
+    if (hasRequestHeader(request, "Authorization") ||
+        hasRequestHeader(request, "Range") ||
+        hasRequestHeader(request, "If-None-Match") ||
+        hasRequestHeader(request, "If-Modified-Since") ||
+        hasRequestHeader(request, "Pragma") ||
+        strcasestr(request.c_str(), "\r\nCache-Control: no-")) {
+        return false;
+    }
+
+    // The key is the absolute URI from the request line
+    auto urlStart = std::size_t{4};
+    auto urlEnd = request.find(' ', urlStart);
+    auto lineEnd = request.find("\r\n");
+    if ((urlEnd == std::string::npos) || (lineEnd == std::string::npos) || (urlEnd > lineEnd)) {
+        return false;
+    }
+    key.assign(request, urlStart, urlEnd - urlStart);
+    return true;
+}
+
+ResponseCache::Result ResponseCache::Lookup(const std::string& key, const CachedResponse*& entry) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        m_misses++;
+        return Result::Miss;
+    }
+
+    // Move to the front of the LRU list
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    entry = &(*it->second);
+
+    if (entry->expires > time(nullptr)) {
+        m_hits++;
+        return Result::Hit;
+    }
+
+    if (entry->etag.empty() && entry->lastModified.empty()) {
+        m_misses++;
+        return Result::Miss;
+    }
+    return Result::Stale;
+}
+
+const CachedResponse* ResponseCache::Find(const std::string& key) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        return nullptr;
+    }
+    return &(*it->second);
+}
+
+std::string ResponseCache::MakeConditionalRequest(const std::string& request, const std::string& etag, const std::string& lastModified) {
+    auto result = request;
+    auto headerEnd = result.find("\r\n\r\n");
+    if (headerEnd == std::string::npos) {
+        return result;
+    }
+
+    auto conditions = std::string{};
+    if (!etag.empty()) {
+        conditions += "\r\nIf-None-Match: " + etag;
+    }
+    if (!lastModified.empty()) {
+        conditions += "\r\nIf-Modified-Since: " + lastModified;
+    }
+    result.insert(headerEnd, conditions);
+    return result;
+}
+
+void ResponseCache::Store(const std::string& key, const ResponseTracker& tracker, std::string& response) {
+    if (response.size() > m_maxObjectSize) {
+        return;
+    }
+
+    auto entry = CachedResponse{};
+    entry.key = key;
+    if (!IsStorable(tracker, entry.etag, entry.lastModified, entry.expires)) {
+        return;
+    }
+
+    entry.response.swap(response);
+    Remove(key);
+
+    m_size += entry.response.size() + entry.key.size();
+    m_entries.emplace_front(std::move(entry));
+    m_index[key] = m_entries.begin();
+    Log(LogSeverity::Debug, "Cached %s (%zu bytes)", key.c_str(), m_entries.front().response.size());
+
+    // The disk cache may hold an older copy
+    DiskCache::Instance().Remove(key);
+
+    Evict();
+}
+
+bool ResponseCache::IsStorable(const ResponseTracker& tracker, std::string& etag, std::string& lastModified, std::time_t& expires) {
+    if ((tracker.GetStatus() != 200) || !tracker.IsComplete()) {
+        return false;
+    }
+
+    auto value = std::string{};
+    if (tracker.GetHeaderValue("Cache-Control", value) &&
+        (strcasestr(value.c_str(), "no-store") || strcasestr(value.c_str(), "private"))) {
+        return false;
+    }
+
+    // We don't keep per-client variants, or anything tied to a client's identity.
+    if (tracker.GetHeaderValue("Vary", value) || tracker.GetHeaderValue("Set-Cookie", value)) {
+        return false;
+    }
+
+    tracker.GetHeaderValue("ETag", etag);
+    tracker.GetHeaderValue("Last-Modified", lastModified);
+    GetFreshness(tracker, expires);
+
+    // Nothing to gain from an entry that's already stale and can't be revalidated
+    if ((expires <= time(nullptr)) && etag.empty() && lastModified.empty()) {
+        return false;
+    }
+    return true;
+}
+
+void ResponseCache::Remove(const std::string& key) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        return;
+    }
+    m_size -= (it->second->response.size() + it->second->key.size());
+    m_entries.erase(it->second);
+    m_index.erase(it);
+}
+
+void ResponseCache::Refresh(const std::string& key, const ResponseTracker& tracker) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        return;
+    }
+
+    auto& entry = *it->second;
+    GetFreshness(tracker, entry.expires);
+    tracker.GetHeaderValue("ETag", entry.etag);
+    tracker.GetHeaderValue("Last-Modified", entry.lastModified);
+    m_revalidations++;
+}
+
+void ResponseCache::AddServedBytes(std::uint64_t bytes, std::uint64_t bytesFetched) {
+    m_bytesServed += bytes;
+    if (bytes > bytesFetched) {
+        m_bytesSaved += (bytes - bytesFetched);
+    }
+}
+
+void ResponseCache::ReportStats() {
+    if (!m_enabled || ((Timestamp() - m_lastReport) < m_reportInterval)) {
+        return;
+    }
+    m_lastReport = Timestamp();
+
+    auto lookups = m_hits + m_revalidations + m_misses;
+    auto hitRatio = lookups ? (100.0 * (m_hits + m_revalidations)) / lookups : 0.0;
+    Log(LogSeverity::Info, "Response cache: %zu entries (%zu bytes), %.1f%% hit ratio (%llu hits, %llu revalidated, %llu misses), %llu bytes served, %llu bytes saved",
+        m_entries.size(), m_size, hitRatio, m_hits, m_revalidations, m_misses, m_bytesServed, m_bytesSaved);
+}
+
+bool ResponseCache::GetFreshness(const ResponseTracker& tracker, std::time_t& expires) {
+    auto now = time(nullptr);
+    auto value = std::string{};
+
+    auto age = long{};
+    if (tracker.GetHeaderValue("Age", value)) {
+        age = strtol(value.c_str(), nullptr, 10);
+    }
+
+    // Explicit lifetime from the server takes precedence
+    if (tracker.GetHeaderValue("Cache-Control", value)) {
+        if (strcasestr(value.c_str(), "no-cache")) {
+            expires = now;
+            return true;
+        }
+
+        auto maxAge = long{};
+        if (getDirective(value, "s-maxage", maxAge) || getDirective(value, "max-age", maxAge)) {
+            expires = now + maxAge - age;
+            return true;
+        }
+    }
+
+    auto date = now;
+    if (tracker.GetHeaderValue("Date", value)) {
+        parseHttpDate(value, date);
+    }
+
+    auto expiresTime = std::time_t{};
+    if (tracker.GetHeaderValue("Expires", value)) {
+        // Invalid dates (i.e. "0") mean the response has already expired
+        if (!parseHttpDate(value, expiresTime)) {
+            expires = now;
+            return true;
+        }
+        expires = now + (expiresTime - date);
+        return true;
+    }
+
+    // Heuristic freshness - 10% of the time since the resource was last changed
+    static constexpr auto maxHeuristic = std::time_t{24 * 3600};
+    auto lastModified = std::time_t{};
+    if (tracker.GetHeaderValue("Last-Modified", value) && parseHttpDate(value, lastModified) && (lastModified < date)) {
+        auto lifetime = (date - lastModified) / 10;
+        expires = now + ((lifetime < maxHeuristic) ? lifetime : maxHeuristic);
+        return true;
+    }
+
+    expires = now;
+    return false;
+}
+
+void ResponseCache::Evict() {
+    while ((m_size > m_maxSize) && !m_entries.empty()) {
+        auto& entry = m_entries.back();
+        Log(LogSeverity::Debug, "Evicting %s from response cache", entry.key.c_str());
+        m_size -= (entry.response.size() + entry.key.size());
+        if (DiskCache::Instance().IsEnabled()) {
+            DiskCache::Instance().StoreResponse(entry);
+        }
+        m_index.erase(entry.key);
+        m_entries.pop_back();
+    }
+}
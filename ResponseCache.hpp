@@ -0,0 +1,141 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "ResponseTracker.hpp"
+
+/**
+ * @brief The CachedResponse struct holds a complete response (headers + body),
+ * exactly as it was received from the server, along with the data required
+ * to determine its freshness and to revalidate it.
+ */
+typedef struct {
+    std::string key;
+    std::string response;
+    std::string etag;
+    std::string lastModified;
+    std::time_t expires;
+} CachedResponse;
+
+/**
+ * @brief The ResponseCache class implements a size-bounded LRU cache of responses
+ * to plain-HTTP GET requests, honouring the Cache-Control/Expires headers sent by
+ * the server.  Stale entries with a validator are revalidated with a conditional
+ * request rather than fetched again.  The cache is only accessed from the event
+ * loop thread, and is therefore not locked.
+ */
+class ResponseCache {
+public:
+    enum class Result : std::uint8_t {
+        Bypass,     // The request can't be answered from, or stored in, the cache
+        Miss,       // Nothing cached, but the response may be stored
+        Hit,        // A fresh response is cached
+        Stale,      // A stale response is cached, and must be revalidated first
+    };
+
+    static ResponseCache& Instance();
+
+    void SetEnabled(bool enable);
+    bool IsEnabled();
+
+    // Set the limit on total memory used by cached responses
+    void SetMaxSize(std::size_t maxBytes);
+
+    // Set the largest response that will be held in the cache
+    void SetMaxObjectSize(std::size_t maxBytes);
+    std::size_t GetMaxObjectSize();
+
+    // Get the cache key for a request, returns false if the request is not cacheable
+    static bool GetKeyForRequest(const std::string& request, std::string& key);
+
+    // Find the entry for a given key.  On Hit or Stale, entry points to the cached data.
+    Result Lookup(const std::string& key, const CachedResponse*& entry);
+
+    // Find the entry for a given key without affecting statistics, or nullptr if not present
+    const CachedResponse* Find(const std::string& key);
+
+    // Build the conditional request used to revalidate a stale entry
+    static std::string MakeConditionalRequest(const std::string& request, const std::string& etag, const std::string& lastModified);
+
+    // Store a complete response in the cache, if the server allows it.
+    void Store(const std::string& key, const ResponseTracker& tracker, std::string& response);
+
+    // Returns true if the server allows a complete response to be stored, and retrieves
+    // the validators and expiry time for it
+    static bool IsStorable(const ResponseTracker& tracker, std::string& etag, std::string& lastModified, std::time_t& expires);
+
+    // Get the time at which a response becomes stale, returns false if the server gave no indication
+    static bool GetFreshness(const ResponseTracker& tracker, std::time_t& expires);
+
+    // Remove an entry (i.e. when a newer response is held on disk)
+    void Remove(const std::string& key);
+
+    // Refresh the lifetime and validators (ETag, Last-Modified) of an entry after the
+    // server confirmed it's unchanged (304).
+    void Refresh(const std::string& key, const ResponseTracker& tracker);
+
+    // Account for a response served from the cache
+    void AddServedBytes(std::uint64_t bytes, std::uint64_t bytesFetched);
+
+    // Periodically log hit-ratio and bytes-saved statistics
+    void ReportStats();
+
+private:
+    ResponseCache();
+
+    void Evict();
+
+    static constexpr auto m_reportInterval = 300 * 1000; // ms
+
+    bool m_enabled;
+    std::size_t m_maxSize;
+    std::size_t m_maxObjectSize;
+    std::size_t m_size;
+
+    std::uint64_t m_hits;
+    std::uint64_t m_misses;
+    std::uint64_t m_revalidations;
+    std::uint64_t m_bytesServed;
+    std::uint64_t m_bytesSaved;
+    std::uint64_t m_lastReport;
+
+    // Most recently used entries are kept at the front of the list
+    std::list<CachedResponse> m_entries;
+    std::unordered_map<std::string, std::list<CachedResponse>::iterator> m_index;
+};
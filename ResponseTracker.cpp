@@ -0,0 +1,254 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ResponseTracker.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <string>
+
+ResponseTracker::ResponseTracker()
+    : m_state{State::Header}
+    , m_status{0}
+    , m_keepAlive{false}
+    , m_remaining{0}
+{}
+
+void ResponseTracker::Reset() {
+    m_state = State::Header;
+    m_status = 0;
+    m_keepAlive = false;
+    m_remaining = 0;
+    m_header.clear();
+    m_line.clear();
+}
+
+void ResponseTracker::Consume(const std::uint8_t* data, std::size_t size) {
+    while (size) {
+        switch (m_state) {
+        case State::Header: {
+            auto oldSize = m_header.size();
+            m_header.append(reinterpret_cast<const char*>(data), size);
+
+            // Only search the newly-appended bytes (plus enough overlap to catch a
+            // terminator split across two reads)
+            auto searchFrom = (oldSize > 3) ? (oldSize - 3) : 0;
+            auto headerEnd = m_header.find("\r\n\r\n", searchFrom);
+            if (headerEnd == std::string::npos) {
+                if (m_header.size() > m_maxHeaderSize) {
+                    m_state = State::Invalid;
+                }
+                return;
+            }
+
+            headerEnd += 4;
+            auto consumed = headerEnd - oldSize;
+            m_header.resize(headerEnd);
+            data += consumed;
+            size -= consumed;
+            ParseHeader();
+        } break;
+        case State::Body: {
+            auto numBytes = std::min<std::uint64_t>(m_remaining, size);
+            m_remaining -= numBytes;
+            data += numBytes;
+            size -= numBytes;
+            if (!m_remaining) {
+                m_state = State::Done;
+            }
+        } break;
+        case State::ChunkSize:
+        case State::ChunkData:
+        case State::ChunkTrailer: {
+            auto consumed = ConsumeChunked(data, size);
+            data += consumed;
+            size -= consumed;
+        } break;
+        case State::Done: {
+            // The server sent more than the framing allowed for - we can't make
+            // sense of the connection state any more.
+            m_state = State::Invalid;
+        } return;
+        case State::Invalid: {
+        } return;
+        }
+    }
+}
+
+bool ResponseTracker::IsComplete() const {
+    return (m_state == State::Done);
+}
+
+bool ResponseTracker::HasFailed() const {
+    return (m_state == State::Invalid);
+}
+
+bool ResponseTracker::IsReusable() const {
+    return IsComplete() && m_keepAlive;
+}
+
+int ResponseTracker::GetStatus() const {
+    return m_status;
+}
+
+const std::string& ResponseTracker::GetHeader() const {
+    return m_header;
+}
+
+bool ResponseTracker::GetHeaderValue(const char* name, std::string& value) const {
+    auto nameLen = strlen(name);
+
+    // Skip the status line
+    auto lineStart = m_header.find("\r\n");
+    while (lineStart != std::string::npos) {
+        lineStart += 2;
+        auto lineEnd = m_header.find("\r\n", lineStart);
+        if (lineEnd == std::string::npos) {
+            return false;
+        }
+
+        const auto* line = m_header.c_str() + lineStart;
+        if (((lineEnd - lineStart) > nameLen) &&
+            (line[nameLen] == ':') &&
+            (0 == strncasecmp(line, name, nameLen))) {
+            auto valueStart = lineStart + nameLen + 1;
+            while ((valueStart < lineEnd) && (m_header[valueStart] == ' ' || m_header[valueStart] == '\t')) {
+                valueStart++;
+            }
+            value.assign(m_header, valueStart, lineEnd - valueStart);
+            return true;
+        }
+        lineStart = lineEnd;
+    }
+    return false;
+}
+
+void ResponseTracker::ParseHeader() {
+    auto minorVersion = int{};
+    if (2 != sscanf(m_header.c_str(), "HTTP/1.%d %d", &minorVersion, &m_status)) {
+        m_state = State::Invalid;
+        return;
+    }
+
+    // Interim responses (i.e. 100 Continue) are followed by the real response
+    if ((m_status >= 100) && (m_status < 200) && (m_status != 101)) {
+        m_header.clear();
+        m_status = 0;
+        return;
+    }
+
+    // Protocol switches hand the connection over to something we don't understand
+    if (m_status == 101) {
+        m_state = State::Invalid;
+        return;
+    }
+
+    // HTTP/1.1 connections are persistent unless stated otherwise, HTTP/1.0 is the reverse.
+    m_keepAlive = (minorVersion >= 1);
+    auto value = std::string{};
+    if (GetHeaderValue("Connection", value)) {
+        if (strcasestr(value.c_str(), "close")) {
+            m_keepAlive = false;
+        } else if (strcasestr(value.c_str(), "keep-alive")) {
+            m_keepAlive = true;
+        }
+    }
+
+    if ((m_status == 204) || (m_status == 304)) {
+        m_state = State::Done;
+    } else if (GetHeaderValue("Transfer-Encoding", value) && strcasestr(value.c_str(), "chunked")) {
+        m_state = State::ChunkSize;
+    } else if (GetHeaderValue("Content-Length", value)) {
+        m_remaining = strtoull(value.c_str(), nullptr, 10);
+        m_state = m_remaining ? State::Body : State::Done;
+    } else {
+        // Body is delimited by the server closing the connection.
+        m_keepAlive = false;
+        m_state = State::Invalid;
+    }
+}
+
+std::size_t ResponseTracker::ConsumeChunked(const std::uint8_t* data, std::size_t size) {
+    static constexpr auto maxLineSize = 1024;
+
+    if (m_state == State::ChunkData) {
+        auto numBytes = std::min<std::uint64_t>(m_remaining, size);
+        m_remaining -= numBytes;
+        if (!m_remaining) {
+            m_state = State::ChunkSize;
+        }
+        return numBytes;
+    }
+
+    // Chunk-size and trailer lines are handled a line at a time
+    auto consumed = std::size_t{};
+    while (consumed < size) {
+        auto c = static_cast<char>(data[consumed++]);
+        if (c != '\n') {
+            if (c != '\r') {
+                m_line.push_back(c);
+            }
+            if (m_line.size() > maxLineSize) {
+                m_state = State::Invalid;
+                return size;
+            }
+            continue;
+        }
+
+        if (m_state == State::ChunkSize) {
+            if (m_line.empty()) {
+                // CRLF following the previous chunk's data
+                continue;
+            }
+            auto chunkSize = strtoull(m_line.c_str(), nullptr, 16);
+            m_line.clear();
+            if (!chunkSize) {
+                m_state = State::ChunkTrailer;
+            } else {
+                m_remaining = chunkSize;
+                m_state = State::ChunkData;
+                return consumed;
+            }
+        } else {
+            auto lastLine = m_line.empty();
+            m_line.clear();
+            if (lastLine) {
+                m_state = State::Done;
+                return consumed;
+            }
+        }
+    }
+    return consumed;
+}
@@ -0,0 +1,95 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief The ResponseTracker class follows the framing of a single HTTP/1.x
+ * response as it is relayed from a server, so that the proxy knows when the
+ * response has been fully delivered, and whether or not the server is willing
+ * to keep the connection open for another request.
+ */
+class ResponseTracker {
+public:
+    ResponseTracker();
+
+    // Forget everything seen so far, and wait for a new response
+    void Reset();
+
+    // Feed bytes received from the server into the tracker
+    void Consume(const std::uint8_t* data, std::size_t size);
+
+    // Returns true once the headers and the entire body have been seen
+    bool IsComplete() const;
+
+    // Returns true if the response can't be followed (unknown length, malformed, etc.)
+    bool HasFailed() const;
+
+    // Returns true if the response was complete, and the server did not ask
+    // for the connection to be closed
+    bool IsReusable() const;
+
+    // Returns the HTTP status code of the response (0 if not yet known)
+    int GetStatus() const;
+
+    // Returns the raw header block of the response (including the status line)
+    const std::string& GetHeader() const;
+
+    // Get the value of a header in the response, returns false if not present
+    bool GetHeaderValue(const char* name, std::string& value) const;
+
+private:
+    enum class State : std::uint8_t {
+        Header,
+        Body,
+        ChunkSize,
+        ChunkData,
+        ChunkTrailer,
+        Done,
+        Invalid
+    };
+
+    static constexpr auto m_maxHeaderSize = 16384;
+
+    void ParseHeader();
+    std::size_t ConsumeChunked(const std::uint8_t* data, std::size_t size);
+
+    State m_state;
+    int m_status;
+    bool m_keepAlive;
+    std::uint64_t m_remaining;
+    std::string m_header;
+    std::string m_line;
+};
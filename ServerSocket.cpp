@@ -48,6 +48,7 @@
 #include <string.h>
 
 #include "Log.hpp"
+#include "SocketIo.hpp"
 
 ServerSocket::ServerSocket()
     : m_isActive{false}
@@ -56,7 +57,7 @@ ServerSocket::ServerSocket()
 
 ServerSocket::~ServerSocket() {
     if (m_isActive) {
-        ::close(m_socketFd);
+        SocketIo::Instance().Close(m_socketFd);
     }
 }
 
@@ -72,14 +73,15 @@ SocketType ServerSocket::Identity() const {
 }
 
 bool ServerSocket::Initialize(std::uint16_t port) {
-    auto sfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto& io = SocketIo::Instance();
+    auto sfd = io.Socket(AF_INET, SOCK_STREAM, 0);
     if (sfd < 0) {
         Log(LogSeverity::Debug, "error on socket");
         return -1;
     }
 
     int enable = 1;
-    auto rc = ::setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+    auto rc = io.SetSockOpt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
     if (rc < 0) {
         Log(LogSeverity::Debug, "error on setsockopt");
         return false;
@@ -90,13 +92,13 @@ bool ServerSocket::Initialize(std::uint16_t port) {
     sockaddr.sin_port = htons(port);
     sockaddr.sin_addr.s_addr = INADDR_ANY;
 
-    rc = ::bind(sfd, reinterpret_cast<struct sockaddr*>(&sockaddr), sizeof(sockaddr));
+    rc = io.Bind(sfd, reinterpret_cast<struct sockaddr*>(&sockaddr), sizeof(sockaddr));
     if (rc < 0) {
         Log(LogSeverity::Debug, "error on bind");
         return false;
     }
 
-    rc = ::listen(sfd, 16);
+    rc = io.Listen(sfd, 16);
     if (rc < 0) {
         Log(LogSeverity::Debug, "error on listen");
         return false;
@@ -114,7 +116,8 @@ int ServerSocket::Accept(std::string& clientIp) {
 
     auto cliaddr = sockaddr_storage{};
     auto clilen = socklen_t{sizeof(cliaddr)};
-    auto clifd = ::accept(m_socketFd, reinterpret_cast<struct sockaddr*>(&cliaddr), &clilen);
+    auto& io = SocketIo::Instance();
+    auto clifd = io.Accept(m_socketFd, reinterpret_cast<struct sockaddr*>(&cliaddr), &clilen);
     if (clifd < 0) {
         Log(LogSeverity::Debug, "error on accept");
         return -1;
@@ -137,8 +140,8 @@ int ServerSocket::Accept(std::string& clientIp) {
     struct timeval timeout = {};
     timeout.tv_sec = 10;
     timeout.tv_usec = 0;
-    ::setsockopt(clifd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-    ::setsockopt(clifd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+    io.SetSockOpt(clifd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    io.SetSockOpt(clifd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
 
     return clifd;
 }
@@ -32,18 +32,54 @@
 #include "Session.hpp"
 
 #include <cstdint>
+#include <cstring>
 #include <string>
-#include <list>
 #include <mutex>
+#include <new>
 
+#include "AllocHook.hpp"
+#include "DiskCache.hpp"
+#include "FlightRecorder.hpp"
+#include "Log.hpp"
 #include "UserAuth.hpp"
 #include "Timestamp.hpp"
 
 Session::Session(const int clientFd, const int sessionId)
-    : m_clientFd{clientFd}
-    , m_sessionId{sessionId}
 {
+    m_request.reserve(m_requestReserve);
+    Reset(clientFd, sessionId);
+}
+
+void Session::Reset(const int clientFd, const int sessionId) {
+    m_clientFd = clientFd;
+    m_sessionId = sessionId;
+    m_proxyFd = -1;
+    m_transparent = false;
+    m_clientRxBytes = 0;
+    m_clientTxBytes = 0;
+    m_port = 0;
     m_timestamp = Timestamp();
+    m_upstreamReusable = false;
+    m_responseTracker.Reset();
+    m_cacheState = CacheState::None;
+    m_cacheOnDisk = false;
+    m_cacheBytes = 0;
+    m_allocCount = AllocCount();
+    for (auto& phaseTime : m_phaseTimes) {
+        phaseTime = 0;
+    }
+    m_phaseTimes[static_cast<int>(Phase::Accepted)] = TimestampUs();
+    m_resolveCached = false;
+    m_numTriedAddresses = 0;
+
+    // Strings keep their capacity, so a reused session doesn't allocate again.  The
+    // cache buffer may have held a whole response, so isn't worth holding on to.
+    m_hostUrl.clear();
+    m_request.clear();
+    m_clientIp.clear();
+    m_userName.clear();
+    m_cacheKey.clear();
+    std::string{}.swap(m_cacheBuffer);
 }
 
 int Session::GetSessionId() {
@@ -54,19 +90,23 @@ int Session::GetClientFd() {
     return m_clientFd;
 }
 
-void Session::SetRequest(std::string& request) {
-    m_request = request;
+void Session::SetRequest(const std::string& request) {
+    m_request.assign(request);
 }
 
-std::string Session::GetRequest() {
+void Session::SetRequest(const char* request, std::size_t length) {
+    m_request.assign(request, length);
+}
+
+const std::string& Session::GetRequest() {
     return m_request;
 }
 
-void Session::SetHost(std::string& host) {
-    m_hostUrl = host;
+void Session::SetHost(const char* host, std::size_t length) {
+    m_hostUrl.assign(host, length);
 }
 
-std::string Session::GetHost() {
+const std::string& Session::GetHost() {
     return m_hostUrl;
 }
 
@@ -87,7 +127,7 @@ bool Session::GetTransparent() {
 }
 
 void Session::SetClientAddress(const std::string& ipAddress) {
-    m_clientIp = ipAddress;
+    m_clientIp.assign(ipAddress);
 }
 
 const std::string& Session::GetClientAddress() {
@@ -95,7 +135,11 @@ const std::string& Session::GetClientAddress() {
 }
 
 void Session::SetUserName(const std::string& userName) {
-    m_userName = userName;
+    m_userName.assign(userName);
+}
+
+void Session::SetUserName(const char* userName, std::size_t length) {
+    m_userName.assign(userName, length);
 }
 
 const std::string& Session::GetUserName() {
@@ -122,60 +166,276 @@ std::uint64_t Session::GetTimestamp() {
     return m_timestamp;
 }
 
+void Session::SetUpstreamReusable(const bool reusable) {
+    m_upstreamReusable = reusable;
+}
+
+bool Session::IsUpstreamReusable() {
+    return m_upstreamReusable;
+}
+
+ResponseTracker& Session::GetResponseTracker() {
+    return m_responseTracker;
+}
+
+void Session::SetCacheState(const CacheState state) {
+    m_cacheState = state;
+}
+
+CacheState Session::GetCacheState() {
+    return m_cacheState;
+}
+
+void Session::SetCacheKey(const std::string& key) {
+    m_cacheKey.assign(key);
+}
+
+const std::string& Session::GetCacheKey() {
+    return m_cacheKey;
+}
+
+std::string& Session::GetCacheBuffer() {
+    return m_cacheBuffer;
+}
+
+void Session::SetCacheOnDisk(const bool onDisk) {
+    m_cacheOnDisk = onDisk;
+}
+
+bool Session::IsCacheOnDisk() {
+    return m_cacheOnDisk;
+}
+
+void Session::AddCacheBytes(size_t bytes) {
+    m_cacheBytes += bytes;
+}
+
+std::uint64_t Session::GetCacheBytes() {
+    return m_cacheBytes;
+}
+
+std::uint64_t Session::GetAllocCount() {
+    return m_allocCount;
+}
+
+void Session::MarkPhase(Phase phase) {
+    m_phaseTimes[static_cast<int>(phase)] = TimestampUs();
+}
+
+std::uint64_t Session::GetPhaseTime(Phase phase) {
+    return m_phaseTimes[static_cast<int>(phase)];
+}
+
+void Session::SetResolveCached(bool cached) {
+    m_resolveCached = cached;
+}
+
+bool Session::IsResolveCached() {
+    return m_resolveCached;
+}
+
+void Session::AddTriedAddress(int ipVersion, const void* address) {
+    if (m_numTriedAddresses == m_maxTriedAddresses) {
+        return;
+    }
+    auto& tried = m_triedAddresses[m_numTriedAddresses++];
+    tried.ipVersion = static_cast<std::uint8_t>(ipVersion);
+    memcpy(tried.address, address, (ipVersion == 4) ? 4 : sizeof(tried.address));
+}
+
+std::size_t Session::GetNumTriedAddresses() {
+    return m_numTriedAddresses;
+}
+
+const UpstreamAddress& Session::GetTriedAddress(std::size_t index) {
+    return m_triedAddresses[index];
+}
+
+SessionRef::SessionRef(SessionSlot* slot)
+    : m_slot{slot}
+{}
+
+SessionRef::SessionRef(SessionRef&& other)
+    : m_slot{other.m_slot}
+{
+    other.m_slot = nullptr;
+}
+
+SessionRef& SessionRef::operator=(SessionRef&& other) {
+    if (this != &other) {
+        if (m_slot) {
+            SessionManager::Instance().Release(m_slot);
+        }
+        m_slot = other.m_slot;
+        other.m_slot = nullptr;
+    }
+    return *this;
+}
+
+SessionRef::~SessionRef() {
+    if (m_slot) {
+        SessionManager::Instance().Release(m_slot);
+    }
+}
+
+Session* SessionRef::get() const {
+    return m_slot ? reinterpret_cast<Session*>(&m_slot->storage) : nullptr;
+}
+
+Session* SessionRef::operator->() const {
+    return get();
+}
+
+SessionRef::operator bool() const {
+    return (m_slot != nullptr);
+}
+
 SessionManager& SessionManager::Instance() {
     static SessionManager* instance = new SessionManager;
     return *instance;
 }
 
+SessionManager::SessionManager()
+    : m_slots{new SessionSlot[m_maxSessions]}
+    , m_counters{"sessions", m_maxSessions}
+{
+    m_freeSlots.reserve(m_maxSessions);
+    for (auto i = m_maxSessions - 1; i >= 0; i--) {
+        m_slots[i].liveId = -1;
+        m_slots[i].refs = 0;
+        m_slots[i].generation = 0;
+        m_slots[i].constructed = false;
+        m_freeSlots.push_back(i);
+    }
+
+    // The lowest slots are handed out first
+    for (auto i = 0; i < m_preparedSessions; i++) {
+        new (&m_slots[i].storage) Session{-1, -1};
+        m_slots[i].constructed = true;
+    }
+}
+
 Session* SessionManager::CreateSession(const int clientFd) {
+    auto index = int{};
     {
         auto lg = LockGuard{m_lock};
+        if (m_freeSlots.empty()) {
+            return nullptr;
+        }
+        index = m_freeSlots.back();
+        m_freeSlots.pop_back();
+    }
 
-        m_sessionList.emplace_back(Session{clientFd, m_sessionId++});
+    auto& slot = m_slots[index];
+    slot.generation = (slot.generation + 1) & m_generationMask;
+    auto sessionId = static_cast<int>((slot.generation << m_indexBits) | index);
+
+    // Sessions are constructed once per slot, then reset for each reuse
+    auto* session = reinterpret_cast<Session*>(&slot.storage);
+    if (slot.constructed) {
+        session->Reset(clientFd, sessionId);
+    } else {
+        new (&slot.storage) Session{clientFd, sessionId};
+        slot.constructed = true;
     }
-    return GetSessionForClient(clientFd);
+    m_counters.Acquired(false);
+    slot.refs.store(1, std::memory_order_relaxed);
+    slot.liveId.store(sessionId, std::memory_order_release);
+    return session;
 }
 
-Session* SessionManager::GetSessionForClient(const int clientFd) {
-    auto lg = LockGuard{m_lock};
+Session* SessionManager::GetSession(const int sessionId) {
+    auto* slot = GetSlot(sessionId);
+    if (!slot || (slot->liveId.load(std::memory_order_acquire) != sessionId)) {
+        return nullptr;
+    }
+    return reinterpret_cast<Session*>(&slot->storage);
+}
+
+SessionRef SessionManager::AcquireSession(const int sessionId) {
+    auto* slot = GetSlot(sessionId);
+    if (!slot) {
+        return SessionRef{};
+    }
 
-    for (auto it = m_sessionList.begin(); it != m_sessionList.end(); it++) {
-        if (it->GetClientFd() == clientFd) {
-            return &(*it);
+    // Only take a reference while someone else holds one - a slot with no references
+    // is free, and may be reclaimed at any moment.
+    auto refs = slot->refs.load(std::memory_order_acquire);
+    do {
+        if (refs == 0) {
+            return SessionRef{};
         }
+    } while (!slot->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acq_rel));
+
+    // The slot may have been reused by a new session, or the session ended
+    if (slot->liveId.load(std::memory_order_acquire) != sessionId) {
+        Release(slot);
+        return SessionRef{};
     }
-    return nullptr;
+    return SessionRef{slot};
 }
 
-Session* SessionManager::GetSession(const int sessionId) {
-    auto lg = LockGuard{m_lock};
+void SessionManager::EndSession(const int sessionId, CloseReason reason) {
+    auto* slot = GetSlot(sessionId);
+    if (!slot) {
+        return;
+    }
+
+    // Only the first caller gets to end the session
+    auto expected = sessionId;
+    if (!slot->liveId.compare_exchange_strong(expected, -1, std::memory_order_acq_rel)) {
+        return;
+    }
 
-    for (auto it = m_sessionList.begin(); it != m_sessionList.end(); it++) {
-        if (it->GetSessionId() == sessionId) {
-            return &(*it);
+    auto* session = reinterpret_cast<Session*>(&slot->storage);
+    if (session->GetHost() != "") {
+        // Only track user/session statistics if authorization + auditing are BOTH enabled
+        if (AuthManager::Instance().IsEnabled() &&
+            AuthManager::Instance().IsAuditEnabled(session->GetUserName())) {
+            auto counters = SiteCounters{};
+            counters.rxBytes = session->GetRxBytes();
+            counters.txBytes = session->GetTxBytes();
+            counters.totalTime = Timestamp() - session->GetTimestamp();
+            counters.connections = 1;
+            GlobalStats::Instance().Record(session->GetUserName(), session->GetHost(), counters);
         }
     }
-    return nullptr;
+    // Allocations are counted process-wide, so this is only exact while sessions don't overlap
+    if (AllocHookEnabled()) {
+        Log(LogSeverity::Debug, "session %d: %llu allocations", sessionId,
+            static_cast<unsigned long long>(AllocCount() - session->GetAllocCount()));
+    }
+
+    FlightRecorder::Instance().Record(session, reason);
+
+    // Discard a response that was still being captured for the disk cache
+    if (session->IsCacheOnDisk()) {
+        DiskCache::Instance().AbortStore(sessionId);
+        session->SetCacheOnDisk(false);
+    }
+
+    // Drop the table's reference - the slot is reclaimed once no thread has it pinned
+    Release(slot);
 }
 
-void SessionManager::EndSession(const int sessionId) {
-    auto lg = LockGuard{m_lock};
+std::size_t SessionManager::GetActiveSessions() const {
+    return m_counters.GetInUse();
+}
 
-    for (auto it = m_sessionList.begin(); it != m_sessionList.end(); it++) {
-        if (it->GetSessionId() == sessionId) {
-            if (it->GetHost() != "") {
-                // Only track user/session statistics if authorization + auditing are BOTH enabled
-                if (AuthManager::Instance().IsEnabled() &&
-                    AuthManager::Instance().IsAuditEnabled(it->GetUserName())) {
-                    auto& stats = GlobalStats::Instance().GetStats(it->GetUserName(), it->GetHost());
-                    stats.AddConnectionTime(Timestamp() - it->GetTimestamp());
-                    stats.AddRxBytes(it->GetRxBytes());
-                    stats.AddTxBytes(it->GetTxBytes());
-                    stats.IncrementConnections();
-                }
-            }
-            m_sessionList.erase(it);
-            return;
-        }
+SessionSlot* SessionManager::GetSlot(const int sessionId) {
+    if (sessionId < 0) {
+        return nullptr;
     }
+    return &m_slots[sessionId & (m_maxSessions - 1)];
+}
+
+void SessionManager::Release(SessionSlot* slot) {
+    if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    m_counters.Released();
+
+    auto lg = LockGuard{m_lock};
+    m_freeSlots.push_back(static_cast<int>(slot - m_slots));
 }
@@ -31,29 +31,84 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <string>
-#include <list>
 #include <mutex>
+#include <type_traits>
+#include <vector>
 
+#include "ObjectPool.hpp"
+#include "ResponseTracker.hpp"
 #include "UserAuth.hpp"
 #include "Timestamp.hpp"
 
+// State of a session with respect to the response cache
+enum class CacheState : std::uint8_t {
+    None,           // Response is relayed without being cached
+    Filling,        // Response is captured so it can be stored in the cache
+    Revalidating,   // Waiting to see if the server confirms a stale cached response
+};
+
+// Points in a session's lifecycle, timestamped for the latency histograms
+enum class Phase : std::uint8_t {
+    Accepted,       // Client connection accepted
+    Parsed,         // Request read and host detected
+    Authorized,     // Authentication/policy decided
+    Resolved,       // Host name resolved
+    Connected,      // Upstream connection handed to the event loop
+    FirstByte,      // First byte received from upstream
+    NumPhases
+};
+
+// Why a session ended, for the flight recorder
+enum class CloseReason : std::uint8_t {
+    ClientClosed,   // Client hung up, or the connection to it failed
+    ServerClosed,   // Server hung up, or the connection to it failed
+    BadRequest,     // No host could be found in the request
+    AuthRequired,   // Client was challenged for credentials
+    AuthFailed,     // Credentials were rejected
+    TimeDenied,     // User isn't allowed access at this time
+    Blocked,        // Host is on a blacklist
+    Overloaded,     // Thread pool was too busy to take the session
+    ResolveFailed,  // Host name couldn't be resolved
+    ConnectFailed,  // None of the host's addresses accepted a connection
+    CacheServed,    // Response was served from the cache
+    Pruned,         // Closed to make room for newer connections
+};
+
+// An upstream address, in network byte order
+typedef struct {
+    std::uint8_t ipVersion;
+    std::uint8_t address[16];
+} UpstreamAddress;
+
 /**
  * @brief The Session class provides information about a unique instance of
  * a proxy connection.
  */
 class Session {
 public:
+    static constexpr auto m_maxTriedAddresses = 4;
+
+    // Room for a typical request with its headers, so a reused session doesn't
+    // have to grow its copy each time a longer one comes through
+    static constexpr auto m_requestReserve = std::size_t{2048};
+
     Session(const int clientFd, const int sessionId);
+
+    // Reinitialize the session for a new connection, keeping allocated buffers
+    void Reset(const int clientFd, const int sessionId);
+
     int GetSessionId();
     int GetClientFd();
 
-    void SetRequest(std::string& request);
-    std::string GetRequest();
-    void SetHost(std::string& host);
+    void SetRequest(const std::string& request);
+    void SetRequest(const char* request, std::size_t length);
+    const std::string& GetRequest();
 
-    std::string GetHost();
+    void SetHost(const char* host, std::size_t length);
+    const std::string& GetHost();
 
     void SetPort(std::uint16_t port);
 
@@ -67,6 +122,7 @@ public:
 
     const std::string& GetClientAddress();
     void SetUserName(const std::string& userName);
+    void SetUserName(const char* userName, std::size_t length);
 
     const std::string& GetUserName();
 
@@ -80,7 +136,54 @@ public:
 
     std::uint64_t GetTimestamp();
 
+    // Mark whether the upstream connection can be returned to the UpstreamPool once
+    // the response has been relayed to the client
+    void SetUpstreamReusable(const bool reusable);
+
+    bool IsUpstreamReusable();
+
+    // Tracks the framing of the server's response for reusable upstream connections
+    ResponseTracker& GetResponseTracker();
+
+    void SetCacheState(const CacheState state);
+
+    CacheState GetCacheState();
+
+    void SetCacheKey(const std::string& key);
+
+    const std::string& GetCacheKey();
+
+    // Holds the server's response while it's being captured for the response cache
+    std::string& GetCacheBuffer();
+
+    // Responses too large for memory are captured to the disk cache instead
+    void SetCacheOnDisk(const bool onDisk);
+
+    bool IsCacheOnDisk();
+
+    // Number of bytes of the response captured so far
+    void AddCacheBytes(size_t bytes);
+
+    std::uint64_t GetCacheBytes();
+
+    // Process allocation count when the session started (see AllocHook)
+    std::uint64_t GetAllocCount();
+
+    // Time (us) at which the session reached a phase, or 0 if it hasn't
+    void MarkPhase(Phase phase);
+    std::uint64_t GetPhaseTime(Phase phase);
+
+    // Whether the host was resolved from the DNS cache
+    void SetResolveCached(bool cached);
+    bool IsResolveCached();
+
+    // Upstream addresses tried, in order - only the first few are kept
+    void AddTriedAddress(int ipVersion, const void* address);
+    std::size_t GetNumTriedAddresses();
+    const UpstreamAddress& GetTriedAddress(std::size_t index);
+
 private:
+
     int m_sessionId;
     int m_clientFd;
     int m_proxyFd;
@@ -97,27 +200,108 @@ private:
 
     std::string m_userName;
     std::uint64_t m_timestamp;
+
+    bool m_upstreamReusable;
+    ResponseTracker m_responseTracker;
+
+    CacheState m_cacheState;
+    std::string m_cacheKey;
+    std::string m_cacheBuffer;
+    bool m_cacheOnDisk;
+    std::uint64_t m_cacheBytes;
+    std::uint64_t m_allocCount;
+
+    std::uint64_t m_phaseTimes[static_cast<int>(Phase::NumPhases)];
+    bool m_resolveCached;
+    UpstreamAddress m_triedAddresses[m_maxTriedAddresses];
+    std::uint8_t m_numTriedAddresses;
+};
+
+// Storage for one session in the SessionManager's table
+typedef struct {
+    // Id of the session held in the slot, or -1 while the slot is free or ending
+    std::atomic<int> liveId;
+
+    // References to the session - one for the table while the session is live, plus
+    // one for each SessionRef.  The slot is reclaimed when this drops to zero.
+    std::atomic<int> refs;
+
+    std::uint32_t generation;
+    bool constructed;
+    typename std::aligned_storage<sizeof(Session), alignof(Session)>::type storage;
+} SessionSlot;
+
+/**
+ * @brief The SessionRef class pins a session for use outside the event loop
+ * thread.  The session remains valid while the reference is held, even if it
+ * is ended in the meantime.
+ */
+class SessionRef {
+public:
+    SessionRef() = default;
+    SessionRef(SessionRef&& other);
+    SessionRef& operator=(SessionRef&& other);
+    SessionRef(const SessionRef&) = delete;
+    SessionRef& operator=(const SessionRef&) = delete;
+    ~SessionRef();
+
+    Session* get() const;
+    Session* operator->() const;
+    explicit operator bool() const;
+
+private:
+    friend class SessionManager;
+    explicit SessionRef(SessionSlot* slot);
+
+    SessionSlot* m_slot = nullptr;
 };
 
 /**
  * @brief The SessionManager class manages the lifecycle of active session
- * objects in the system.
+ * objects in the system.  Sessions are held in a fixed table of slots; the
+ * session ID combines the slot index with a per-slot generation, so lookups
+ * are O(1) and IDs of ended sessions are never mistaken for new ones.
  */
 class SessionManager {
 public:
     static SessionManager& Instance();
 
+    // Create a new session, returns nullptr if the table is full
     Session* CreateSession(const int clientFd);
 
-    Session* GetSessionForClient(const int clientFd);
-
+    // Get a live session from the event loop thread, or nullptr if it has ended
     Session* GetSession(const int sessionId);
 
-    void EndSession(const int sessionId);
+    // Get a pinned reference to a live session, for use from other threads
+    SessionRef AcquireSession(const int sessionId);
+
+    void EndSession(const int sessionId, CloseReason reason);
+
+    // Number of sessions holding a slot, including ended sessions still pinned
+    std::size_t GetActiveSessions() const;
 
 private:
+    friend class SessionRef;
+
+    SessionManager();
+
+    SessionSlot* GetSlot(const int sessionId);
+    void Release(SessionSlot* slot);
+
     using LockGuard = std::unique_lock<std::mutex>;
+
+    static constexpr auto m_indexBits = 12;
+    static constexpr auto m_maxSessions = 1 << m_indexBits;
+    static constexpr auto m_generationMask = (1u << (31 - m_indexBits)) - 1;
+
+    // Slots whose sessions are constructed up front - as many as the proxy holds
+    // connections - so that reaching a new peak doesn't allocate on the loop
+    static constexpr auto m_preparedSessions = 256;
+
+    SessionSlot* m_slots;
+    PoolCounters m_counters;
+
+    // Free slot indices, most recently freed at the back
     std::mutex m_lock;
-    int m_sessionId = 0;
-    std::list<Session> m_sessionList;
+    std::vector<int> m_freeSlots;
 };
@@ -0,0 +1,114 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "SocketIo.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+
+ISocketIo* installed = nullptr;
+
+} // anonymous namespace
+
+ISocketIo& SocketIo::Instance() {
+    static SocketIo* instance = new SocketIo{};
+    return installed ? *installed : *instance;
+}
+
+void SocketIo::Install(ISocketIo& backend) {
+    installed = &backend;
+}
+
+int SocketIo::Socket(int domain, int type, int protocol) {
+    return ::socket(domain, type, protocol);
+}
+
+int SocketIo::Bind(int fd, const struct sockaddr* address, socklen_t addressSize) {
+    return ::bind(fd, address, addressSize);
+}
+
+int SocketIo::Listen(int fd, int backlog) {
+    return ::listen(fd, backlog);
+}
+
+int SocketIo::Accept(int fd, struct sockaddr* address, socklen_t* addressSize) {
+    return ::accept(fd, address, addressSize);
+}
+
+int SocketIo::Connect(int fd, const struct sockaddr* address, socklen_t addressSize) {
+    return ::connect(fd, address, addressSize);
+}
+
+int SocketIo::SetSockOpt(int fd, int level, int name, const void* value, socklen_t size) {
+    return ::setsockopt(fd, level, name, value, size);
+}
+
+int SocketIo::GetSockOpt(int fd, int level, int name, void* value, socklen_t* size) {
+    return ::getsockopt(fd, level, name, value, size);
+}
+
+ssize_t SocketIo::Read(int fd, void* buf, std::size_t size) {
+    return ::read(fd, buf, size);
+}
+
+ssize_t SocketIo::Write(int fd, const void* buf, std::size_t size) {
+    return ::write(fd, buf, size);
+}
+
+ssize_t SocketIo::Recv(int fd, void* buf, std::size_t size, int flags) {
+    return ::recv(fd, buf, size, flags);
+}
+
+ssize_t SocketIo::SendTo(int fd, const void* buf, std::size_t size, int flags, const struct sockaddr* address, socklen_t addressSize) {
+    return ::sendto(fd, buf, size, flags, address, addressSize);
+}
+
+int SocketIo::Close(int fd) {
+    return ::close(fd);
+}
+
+int SocketIo::EventFd(unsigned int initial, int flags) {
+    return ::eventfd(initial, flags);
+}
+
+int SocketIo::EpollCreate(int flags) {
+    return ::epoll_create1(flags);
+}
+
+int SocketIo::EpollCtl(int epollFd, int op, int fd, struct epoll_event* event) {
+    return ::epoll_ctl(epollFd, op, fd, event);
+}
+
+int SocketIo::EpollWait(int epollFd, struct epoll_event* events, int maxEvents, int timeout) {
+    return ::epoll_wait(epollFd, events, maxEvents, timeout);
+}
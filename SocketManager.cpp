@@ -31,6 +31,7 @@
 
 #include "SocketManager.hpp"
 
+#include <algorithm>
 #include <fcntl.h>
 #include <linux/socket.h>
 #include <netinet/in.h>
@@ -39,27 +40,45 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 
+#include "AdminSocket.hpp"
 #include "AsyncMessenger.hpp"
 #include "ClientSocket.hpp"
 #include "CommandSocket.hpp"
+#include "DiskCache.hpp"
+#include "FastOpen.hpp"
 #include "ServerSocket.hpp"
 #include "HostInfoManager.hpp"
+#include "LoopMonitor.hpp"
+#include "Metrics.hpp"
+#include "ObjectPool.hpp"
+#include "PhaseStats.hpp"
+#include "ResponseCache.hpp"
 #include "Session.hpp"
+#include "SocketIo.hpp"
+#include "ThreadPool.hpp"
+#include "Timestamp.hpp"
+#include "UpstreamPool.hpp"
 #include "UserAuth.hpp"
 #include "Log.hpp"
 
 SocketManager::SocketManager(std::unique_ptr<ProxyConnector> connector)
     : m_isActive{false}
     , m_epollFd{-1}
+    , m_adminConnections{0}
+    , m_lastMaintenance{0}
     , m_connector{std::move(connector)}
-{}
+{
+    // Nodes for as many sockets as connections are allowed, so reaching a new peak
+    // doesn't allocate on the loop either
+    m_spareSockets.resize(m_maxConcurrentConnections);
+}
 
 bool SocketManager::Initialize() {
     if (m_isActive) {
         return false;
     }
 
-    auto epollFd = epoll_create1(0);
+    auto epollFd = SocketIo::Instance().EpollCreate(0);
     if (-1 == epollFd) {
         return false;
     }
@@ -75,46 +94,105 @@ bool SocketManager::AddSocket(std::unique_ptr<IGenericSocket> genericSocket) {
     event.events = EPOLLIN;
     event.data.fd = genericSocket->GetFd();
 
-    if (-1 == epoll_ctl(m_epollFd, EPOLL_CTL_ADD, event.data.fd, &event)) {
+    if (-1 == SocketIo::Instance().EpollCtl(m_epollFd, EPOLL_CTL_ADD, event.data.fd, &event)) {
         return false;
     }
 
-    m_sockets.emplace_back(std::move(genericSocket));
+    // Reuse a list node from a removed socket, so a new connection doesn't allocate one
+    if (m_spareSockets.empty()) {
+        m_sockets.emplace_back(std::move(genericSocket));
+    } else {
+        m_spareSockets.front() = std::move(genericSocket);
+        m_sockets.splice(m_sockets.end(), m_spareSockets, m_spareSockets.begin());
+    }
     return true;
 }
 
+void SocketManager::RemoveSocket(SocketList::iterator it) {
+    it->reset();
+    m_spareSockets.splice(m_spareSockets.end(), m_sockets, it);
+}
+
 bool SocketManager::RemoveSocketFd(int fd) {
-    if (-1 == epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr)) {
+    if (-1 == SocketIo::Instance().EpollCtl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr)) {
         return false;
     }
     return true;
 }
 
 void SocketManager::PruneExcessConnections() {
-    while (m_sockets.size() > 200) {
+    // Only client sockets count - listeners and admin connections aren't sessions,
+    // and admin connections are limited on their own
+    auto isClient = [](const std::unique_ptr<IGenericSocket>& socket) {
+        return socket->Identity() == SocketType::Client;
+    };
+    auto clients = std::count_if(m_sockets.begin(), m_sockets.end(), isClient);
+    while (clients > m_maxClientSockets) {
         Log(LogSeverity::Debug, "Too many active connections -- cleaning up oldest");
 
-        for (auto& socket : m_sockets) {
-            if (socket->Identity() == SocketType::Client) {
-                auto* client = static_cast<ClientSocket*>(socket.get());
-                auto sessionId = client->GetSessionId();
-
-                RemoveSocketFd(socket->GetFd());
-                m_sockets.remove(socket);
-                auto proxyFd = client->GetProxyFd();
-                for (auto& peer : m_sockets) {
-                    if (peer->GetFd() == proxyFd) {
-                        RemoveSocketFd(peer->GetFd());
-                        m_sockets.remove(peer);
-                        Log(LogSeverity::Debug, "Session: %d Destroyed sockets .", client->GetSessionId());
-                        break;
-                    }
-                }
+        auto it = std::find_if(m_sockets.begin(), m_sockets.end(), isClient);
+        if (it == m_sockets.end()) {
+            break;
+        }
+
+        auto* client = static_cast<ClientSocket*>(it->get());
+        auto sessionId = client->GetSessionId();
+        auto proxyFd = client->GetProxyFd();
 
-                SessionManager::Instance().EndSession(sessionId);
+        RemoveSocketFd(client->GetFd());
+        RemoveSocket(it);
+        clients--;
+        for (auto peer = m_sockets.begin(); peer != m_sockets.end(); peer++) {
+            if ((*peer)->GetFd() == proxyFd) {
+                RemoveSocketFd(proxyFd);
+                RemoveSocket(peer);
+                clients--;
+                Log(LogSeverity::Debug, "Session: %d Destroyed sockets .", sessionId);
                 break;
             }
         }
+
+        SessionManager::Instance().EndSession(sessionId, CloseReason::Pruned);
+        Metrics::Instance().Increment(Counter::PrunedSessions);
+    }
+}
+
+void SocketManager::RunMaintenance() {
+    auto start = TimestampUs();
+    PruneExcessConnections();
+    PruneAdminConnections();
+    UpstreamPool::Instance().Prune();
+    ResponseCache::Instance().ReportStats();
+    DiskCache::Instance().Sync();
+    FastOpen::Instance().ReportStats();
+    ThreadPool::Instance().ReportStats();
+    PoolCounters::ReportAll();
+    PhaseStats::Instance().ReportStats();
+    m_lastMaintenance = Timestamp();
+    LoopMonitor::Instance().RecordHandler(LoopHandler::Maintenance, -1, start);
+}
+
+void SocketManager::PruneAdminConnections() {
+    auto now = Timestamp();
+    auto it = m_sockets.begin();
+    while (it != m_sockets.end()) {
+        auto* socket = (it++)->get();
+        if ((socket->Identity() == SocketType::AdminConnection) &&
+            ((now - static_cast<AdminConnection*>(socket)->GetOpenedAt()) >= m_adminTimeout)) {
+            Log(LogSeverity::Debug, "Closing idle admin connection");
+            CloseAdminConnection(socket);
+        }
+    }
+}
+
+void SocketManager::CloseAdminConnection(IGenericSocket* connection) {
+    RemoveSocketFd(connection->GetFd());
+    auto it = std::find_if(m_sockets.begin(), m_sockets.end(), [connection](const std::unique_ptr<IGenericSocket>& peer) {
+        return peer.get() == connection;
+    });
+    if (it != m_sockets.end()) {
+        RemoveSocket(it);
+        m_adminConnections--;
     }
 }
 
@@ -128,11 +206,13 @@ bool SocketManager::HandleServerSocketRead(IGenericSocket* socket)
         Log(LogSeverity::Debug, "Error accepting client");
         return false;
     }
+    Metrics::Instance().Increment(Counter::Accepts);
 
     // Enable TCP keepalives and idle timeout detection on client-to-proxy communications
 
+    auto& io = SocketIo::Instance();
     auto enable = 1;
-    auto rc         = setsockopt(clientFd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    auto rc         = io.SetSockOpt(clientFd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
     if (rc != 0) {
         printf("Error enabling socket keepalives on client\n");
     }
@@ -141,33 +221,217 @@ bool SocketManager::HandleServerSocketRead(IGenericSocket* socket)
 
     // Check for dead idle connections on 10s of inactivity
     auto idleTime = 10;
-    rc           = setsockopt(clientFd, SOL_TCP, TCP_KEEPIDLE, &idleTime, sizeof(idleTime));
+    rc           = io.SetSockOpt(clientFd, SOL_TCP, TCP_KEEPIDLE, &idleTime, sizeof(idleTime));
     if (rc != 0) {
         printf("Error setting initial idle-time value\n");
     }
 
     // Set a maximum number of idle-socket heartbeat attemtps before assuming an idle socket it dead
     auto keepCount = 5;
-    rc            = setsockopt(clientFd, SOL_TCP, TCP_KEEPCNT, &keepCount, sizeof(keepCount));
+    rc            = io.SetSockOpt(clientFd, SOL_TCP, TCP_KEEPCNT, &keepCount, sizeof(keepCount));
     if (rc != 0) {
         printf("Error setting idle retry count\n");
     }
 
     // On performing the socket-idle check, send heartbeat attempts on a specified interval
     auto keepInterval = 5;
-    rc               = setsockopt(clientFd, SOL_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(keepInterval));
+    rc               = io.SetSockOpt(clientFd, SOL_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(keepInterval));
     if (rc != 0) {
         printf("Error setting idle retry interval\n");
     }
 
     // Check to see if clientIp has an active user session...
     auto* session = SessionManager::Instance().CreateSession(clientFd);
+    if (!session) {
+        Log(LogSeverity::Warn, "Session table full, refusing client");
+        Metrics::Instance().Increment(Counter::SessionsRefused);
+        static const char* unavailableMessage =
+                "HTTP/1.1 503 Service Unavailable\r\n"
+                "Retry-After: 1\r\n"
+                "Content-Length: 0\r\n"
+                "Connection: close\r\n"
+                "\r\n";
+        auto length = strlen(unavailableMessage);
+        if (io.Write(clientFd, unavailableMessage, length) != static_cast<ssize_t>(length)) {
+            Log(LogSeverity::Debug, "Unable to send refusal to fd=%d", clientFd);
+        }
+        io.Close(clientFd);
+        return true;
+    }
     session->SetClientAddress(clientIp);
     Log(LogSeverity::Debug, "New Client fd=%d -- async proxy detection", clientFd);
     m_connector->BeginProxyDetect(session->GetSessionId());
     return true;
 }
 
+void SocketManager::CloseSession(int sessionId, int clientFd, int proxyFd, bool poolUpstream, CloseReason reason)
+{
+    RemoveSessionSockets(sessionId, clientFd, proxyFd, poolUpstream, false);
+    SessionManager::Instance().EndSession(sessionId, reason);
+}
+
+void SocketManager::RemoveSessionSockets(int sessionId, int clientFd, int proxyFd, bool poolUpstream, bool keepClient)
+{
+    auto* session = SessionManager::Instance().GetSession(sessionId);
+
+    for (auto peer = m_sockets.begin(); peer != m_sockets.end(); peer++) {
+        if ((*peer)->GetFd() == clientFd) {
+            RemoveSocketFd(clientFd);
+            if (keepClient) {
+                static_cast<ClientSocket*>(peer->get())->DetachFd();
+            }
+            RemoveSocket(peer);
+            Log(LogSeverity::Debug, "Session: %d Destroyed client socket .", sessionId);
+            break;
+        }
+    }
+
+    for (auto peer = m_sockets.begin(); peer != m_sockets.end(); peer++) {
+        if ((*peer)->GetFd() == proxyFd) {
+            RemoveSocketFd(proxyFd);
+            if (poolUpstream && session) {
+                auto upstreamFd = static_cast<ClientSocket*>(peer->get())->DetachFd();
+                UpstreamPool::Instance().Release(session->GetHost(), session->GetPort(), upstreamFd);
+            }
+            RemoveSocket(peer);
+            Log(LogSeverity::Debug, "Session: %d Destroyed proxy socket .", sessionId);
+            break;
+        }
+    }
+}
+
+void SocketManager::CancelCapture(Session* session)
+{
+    session->SetCacheState(CacheState::None);
+    std::string{}.swap(session->GetCacheBuffer());
+    if (session->IsCacheOnDisk()) {
+        DiskCache::Instance().AbortStore(session->GetSessionId());
+        session->SetCacheOnDisk(false);
+    }
+}
+
+void SocketManager::CaptureResponse(Session* session, const std::uint8_t* data, std::size_t size)
+{
+    auto& buffer = session->GetCacheBuffer();
+    auto& tracker = session->GetResponseTracker();
+    auto& diskCache = DiskCache::Instance();
+
+    // Stop collecting once it's clear the response won't be stored.
+    if (tracker.HasFailed() || (tracker.GetStatus() && (tracker.GetStatus() != 200))) {
+        CancelCapture(session);
+        return;
+    }
+
+    // Responses too large to hold in memory continue on disk, if there's a disk cache
+    auto captured = session->GetCacheBytes() + size;
+    if (!session->IsCacheOnDisk() && (captured > ResponseCache::Instance().GetMaxObjectSize())) {
+        if (!diskCache.IsEnabled() || (captured > diskCache.GetMaxObjectSize()) ||
+            !diskCache.BeginStore(session->GetSessionId(), buffer)) {
+            CancelCapture(session);
+            return;
+        }
+        session->SetCacheOnDisk(true);
+    }
+
+    if (session->IsCacheOnDisk()) {
+        if ((captured > diskCache.GetMaxObjectSize()) || !diskCache.AppendStore(session->GetSessionId(), data, size)) {
+            CancelCapture(session);
+            return;
+        }
+    } else {
+        buffer.append(reinterpret_cast<const char*>(data), size);
+    }
+    session->AddCacheBytes(size);
+
+    if (tracker.IsComplete()) {
+        if (session->IsCacheOnDisk()) {
+            diskCache.CommitStore(session->GetSessionId(), session->GetCacheKey(), tracker, captured);
+            session->SetCacheOnDisk(false);
+
+            // Don't let an older copy held in memory shadow the one on disk
+            ResponseCache::Instance().Remove(session->GetCacheKey());
+        } else {
+            ResponseCache::Instance().Store(session->GetCacheKey(), tracker, buffer);
+        }
+        CancelCapture(session);
+    }
+}
+
+bool SocketManager::HandleRevalidation(ClientSocket* server, Session* session, const std::uint8_t* data, std::size_t size)
+{
+    auto& tracker = session->GetResponseTracker();
+    auto& buffer = session->GetCacheBuffer();
+
+    tracker.Consume(data, size);
+    buffer.append(reinterpret_cast<const char*>(data), size);
+
+    // Hold on to the response until we know whether the server sent a 304
+    if (!tracker.GetStatus() && !tracker.HasFailed()) {
+        return true;
+    }
+
+    auto error = false;
+    auto sessionId = session->GetSessionId();
+    if ((tracker.GetStatus() == 304) && tracker.IsComplete()) {
+        auto& key = session->GetCacheKey();
+        auto& cache = ResponseCache::Instance();
+        auto& diskCache = DiskCache::Instance();
+        cache.Refresh(key, tracker);
+        diskCache.Refresh(key, tracker);
+
+        auto poolUpstream = session->IsUpstreamReusable() && tracker.IsReusable();
+        const auto* entry = cache.Find(key);
+        const auto* diskEntry = entry ? nullptr : diskCache.Find(key);
+        auto fileFd = diskEntry ? diskCache.OpenEntry(*diskEntry) : -1;
+        if (entry && (entry->response.size() > ProxyConnector::inlineSendLimit)) {
+            // Too large to write from the loop without risking a stall - copy it to a pool thread
+            Log(LogSeverity::Debug, "Session %d - revalidated %s", sessionId, key.c_str());
+            std::string{}.swap(buffer);
+            session->SetCacheState(CacheState::None);
+            RemoveSessionSockets(sessionId, server->GetProxyFd(), server->GetFd(), poolUpstream, true);
+            m_connector->SendCachedResponse(sessionId, entry->response);
+            return true;
+        } else if (entry) {
+            Log(LogSeverity::Debug, "Session %d - revalidated %s", sessionId, key.c_str());
+            server->Write(entry->response.data(), entry->response.size(), &error);
+            cache.AddServedBytes(entry->response.size(), buffer.size());
+            session->AddTxBytes(entry->response.size());
+        } else if (fileFd != -1) {
+            // The client connection is handed over to a pool thread, which sends the
+            // response from disk and reports back when it's done.
+            Log(LogSeverity::Debug, "Session %d - revalidated %s on disk", sessionId, key.c_str());
+            std::string{}.swap(buffer);
+            session->SetCacheState(CacheState::None);
+            RemoveSessionSockets(sessionId, server->GetProxyFd(), server->GetFd(), poolUpstream, true);
+            m_connector->SendCachedResponse(sessionId, fileFd, diskEntry->size);
+            return true;
+        } else {
+            // Entry was evicted while we waited - the 304 is meaningless to the client.
+            static const char* unavailableMessage =
+                    "HTTP/1.1 503 Service Unavailable\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: close\r\n"
+                    "\r\n";
+            server->Write(unavailableMessage, strlen(unavailableMessage), &error);
+        }
+
+        std::string{}.swap(buffer);
+        session->SetCacheState(CacheState::None);
+        CloseSession(sessionId, server->GetProxyFd(), server->GetFd(), poolUpstream, CloseReason::CacheServed);
+        return true;
+    }
+
+    // The server sent a new response - pass along what we've held back, and cache it
+    // in place of the stale entry.
+    auto pending = std::string{};
+    pending.swap(buffer);
+    server->Write(pending.data(), pending.size(), &error);
+    session->AddTxBytes(pending.size());
+    session->SetCacheState(CacheState::Filling);
+    CaptureResponse(session, reinterpret_cast<const std::uint8_t*>(pending.data()), pending.size());
+    return true;
+}
+
 bool SocketManager::HandleClientSocketRead(IGenericSocket* socket)
 {
     auto* client = static_cast<ClientSocket*>(socket);
@@ -177,84 +441,161 @@ bool SocketManager::HandleClientSocketRead(IGenericSocket* socket)
     auto numRead = client->Read(buf, sizeof(buf), &error);
     auto sessionId = client->GetSessionId();
     if (error) {
-        auto proxyFd = client->GetProxyFd();
-        auto clientFd = client->GetFd();
-
-        for (auto& peer : m_sockets) {
-            if (peer->GetFd() == clientFd) {
-                RemoveSocketFd(peer->GetFd());
-                m_sockets.remove(peer);
-                Log(LogSeverity::Debug, "Session: %d Destroyed client socket .", sessionId);
-                break;
-            }
-        }
+        auto* session = SessionManager::Instance().GetSession(sessionId);
 
-        for (auto& peer : m_sockets) {
-            if (peer->GetFd() == proxyFd) {
-                RemoveSocketFd(peer->GetFd());
-                m_sockets.remove(peer);
-                Log(LogSeverity::Debug, "Session: %d Destroyed proxy socket .", sessionId);
-                break;
-            }
+        if (client->IsClientToProxy()) {
+            // If the client hung up after a complete response was relayed over a persistent
+            // server connection, the server connection goes back to the pool instead of
+            // being closed.
+            auto poolUpstream = session && session->IsUpstreamReusable() &&
+                                session->GetResponseTracker().IsReusable();
+            CloseSession(sessionId, client->GetFd(), client->GetProxyFd(), poolUpstream, CloseReason::ClientClosed);
+        } else {
+            CloseSession(sessionId, client->GetProxyFd(), client->GetFd(), false, CloseReason::ServerClosed);
         }
-        SessionManager::Instance().EndSession(sessionId);
     } else {
+        auto* session = SessionManager::Instance().GetSession(sessionId);
+        if (!client->IsClientToProxy() && !session->GetPhaseTime(Phase::FirstByte)) {
+            PhaseStats::Instance().Mark(session, Phase::FirstByte, Phase::Connected, Stage::FirstByte);
+        }
+        if (!client->IsClientToProxy() && (session->GetCacheState() == CacheState::Revalidating)) {
+            return HandleRevalidation(client, session, buf, numRead);
+        }
+
         auto numWritten = client->Write(buf, numRead, &error);
 
-        auto* session = SessionManager::Instance().GetSession(sessionId);
         if (client->IsClientToProxy()) {
             session->AddRxBytes(numWritten);
+            Metrics::Instance().Increment(Counter::BytesFromClients, numWritten);
+
+            // Anything further from the client is a request body or another request on
+            // the same connection - we can no longer tell where the response ends.
+            if (numRead) {
+                session->SetUpstreamReusable(false);
+                if (session->GetCacheState() != CacheState::None) {
+                    CancelCapture(session);
+                }
+            }
         } else {
             session->AddTxBytes(numRead);
+            Metrics::Instance().Increment(Counter::BytesFromServers, numRead);
+            if (session->IsUpstreamReusable() || (session->GetCacheState() != CacheState::None)) {
+                session->GetResponseTracker().Consume(buf, numRead);
+            }
+            if (session->GetCacheState() == CacheState::Filling) {
+                CaptureResponse(session, buf, numRead);
+            }
         }
     }
     return true;
 }
 
+void SocketManager::HandleAdminSocketRead(IGenericSocket* socket)
+{
+    auto* admin = static_cast<AdminSocket*>(socket);
+    auto fd = admin->Accept();
+    if (fd < 0) {
+        return;
+    }
+
+    // Each admin request is short - a client holding more connections than this open
+    // is turned away, rather than using up sockets meant for sessions
+    if (m_adminConnections >= m_maxAdminConnections) {
+        Log(LogSeverity::Debug, "Too many admin connections -- refusing");
+        SocketIo::Instance().Close(fd);
+        return;
+    }
+    if (!AddSocket(std::make_unique<AdminConnection>(fd))) {
+        SocketIo::Instance().Close(fd);
+        return;
+    }
+    m_adminConnections++;
+}
+
+void SocketManager::HandleAdminConnection(IGenericSocket* socket)
+{
+    auto* connection = static_cast<AdminConnection*>(socket);
+    if (!connection->HasResponse()) {
+        if (!connection->ReadRequest()) {
+            CloseAdminConnection(connection);
+            return;
+        }
+        if (!connection->HasResponse()) {
+            return;
+        }
+    }
+
+    // Keep writing as the socket drains, rather than blocking the event loop
+    if (!connection->WriteResponse()) {
+        auto event = epoll_event{};
+        event.events = EPOLLOUT;
+        event.data.fd = connection->GetFd();
+        SocketIo::Instance().EpollCtl(m_epollFd, EPOLL_CTL_MOD, event.data.fd, &event);
+        return;
+    }
+    CloseAdminConnection(connection);
+}
+
 bool SocketManager::HandleCommandSocketRead(IGenericSocket* socket)
 {
     Log(LogSeverity::Verbose, "Command Socket");
+
+    // Handle everything that's queued up in a single pass
+    auto& messenger = AsyncMessenger::Instance();
+    messenger.ClearSignal();
+
     auto msg = AsyncMessage_t{};
-    AsyncMessenger::Instance().ReadMessage(msg);
+    while (messenger.ReadMessage(msg)) {
+        HandleAsyncMessage(msg);
+    }
+    return true;
+}
 
+bool SocketManager::HandleAsyncMessage(const AsyncMessage_t& msg)
+{
     if (msg.msgId == HOST_DETECT_RESULT) {
         auto* session = SessionManager::Instance().GetSession(msg.data.hostDetectResult.sessionId);
         Log(LogSeverity::Verbose, "HOST DETECT RESULT");
+        if (!session) {
+            return true;
+        }
         if (msg.data.hostDetectResult.success == false) {
             Log(LogSeverity::Debug, "proxy detect aborted");
             const char* authMessage =
                     "HTTP/1.0 400 Client Error\n"
                     "Connection: close\r\n"
                     "\r\n";
-            auto nwritten = ::write(session->GetClientFd(), authMessage, strlen(authMessage));
-            ::close(session->GetClientFd());
-            SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId);
+            auto nwritten = SocketIo::Instance().Write(session->GetClientFd(), authMessage, strlen(authMessage));
+            SocketIo::Instance().Close(session->GetClientFd());
+            SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId, CloseReason::BadRequest);
         } else {
+            PhaseStats::Instance().Mark(session, Phase::Parsed, Phase::Accepted, Stage::Detect);
+
             // Only try and do authentication if configuration requires it.
             if (AuthManager::Instance().IsEnabled()) {
-                auto dupString = strdup(session->GetRequest().c_str());
-                const auto* authString = strstr(dupString, "Proxy-Authorization: Basic ");
+                const auto* authString = strstr(session->GetRequest().c_str(), "Proxy-Authorization: Basic ");
                 if (authString != nullptr) {
                     char rawCreds[1024] = {};
                     auto canConnect = false;
-                    auto rc = sscanf(authString, "Proxy-Authorization: Basic %1024s", rawCreds);
-                    free(dupString);
+                    auto reason = CloseReason::AuthFailed;
+                    auto rc = sscanf(authString, "Proxy-Authorization: Basic %1023s", rawCreds);
 
-                    auto userName = std::string{};
+                    const std::string* userName = nullptr;
                     if (rc == 1) {
-                        auto credString = std::string{rawCreds};
-
-                        canConnect = AuthManager::Instance().Authenticate(credString, userName);
+                        canConnect = AuthManager::Instance().Authenticate(rawCreds, userName);
+                        Metrics::Instance().Increment(canConnect ? Counter::AuthBasicOk : Counter::AuthBasicFailed);
 
                         if (canConnect) {
-                            session->SetUserName(userName);
+                            session->SetUserName(*userName);
                         }
                     }
 
                     if (canConnect) {
-                        canConnect = AuthManager::Instance().AccessAllowedAtTime(userName);
+                        canConnect = AuthManager::Instance().AccessAllowedAtTime(*userName);
                         if (!canConnect) {
                             Log(LogSeverity::Debug, "Rejecting connection due to time-based access controls");
+                            Metrics::Instance().Increment(Counter::AuthTimeDenied);
+                            reason = CloseReason::TimeDenied;
                         }
                     }
 
@@ -263,36 +604,37 @@ bool SocketManager::HandleCommandSocketRead(IGenericSocket* socket)
                                 "HTTP/1.0 403 Forbidden\n"
                                 "Connection: close\r\n"
                                 "\r\n";
-                        auto nwritten = ::write(session->GetClientFd(), authMessage, strlen(authMessage));
-                        ::close(session->GetClientFd());
-                        SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId);
+                        auto nwritten = SocketIo::Instance().Write(session->GetClientFd(), authMessage, strlen(authMessage));
+                        SocketIo::Instance().Close(session->GetClientFd());
+                        SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId, reason);
                         return true;
                     }
                 } else {
-                    free(dupString);
-
                     // Check IP Address - see if it's in whitelist.
                     auto& clientIp = session->GetClientAddress();
-                    auto username = std::string{};
+                    const std::string* username = nullptr;
                     Log(LogSeverity::Debug, "Attempt authentication via IP");
 
                     if (AuthManager::Instance().AuthenticateIp(clientIp, username)) {
-                        if (AuthManager::Instance().AccessAllowedAtTime(username)) {
-                            Log(LogSeverity::Debug, "Authenticated as %s via IP", username.c_str());
-                            session->SetUserName(username);
+                        Metrics::Instance().Increment(Counter::AuthIpOk);
+                        if (AuthManager::Instance().AccessAllowedAtTime(*username)) {
+                            Log(LogSeverity::Debug, "Authenticated as %s via IP", username->c_str());
+                            session->SetUserName(*username);
                         } else {
                             Log(LogSeverity::Debug, "Rejecting connection due to time-based access controls");
+                            Metrics::Instance().Increment(Counter::AuthTimeDenied);
                             const char* authMessage =
                                     "HTTP/1.0 403 Forbidden\n"
                                     "Connection: close\r\n"
                                     "\r\n";
-                            auto nwritten = ::write(session->GetClientFd(), authMessage, strlen(authMessage));
-                            ::close(session->GetClientFd());
-                            SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId);
+                            auto nwritten = SocketIo::Instance().Write(session->GetClientFd(), authMessage, strlen(authMessage));
+                            SocketIo::Instance().Close(session->GetClientFd());
+                            SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId, CloseReason::TimeDenied);
                             return true;
                         }
                     } else {
                         Log(LogSeverity::Debug, "Not authenticated - force retry", session->GetRequest().c_str());
+                        Metrics::Instance().Increment(Counter::AuthChallenged);
                         const char* authMessage =
                                 "HTTP/1.0 407 Proxy Authentication Required\r\n"
                                 "Server: nermal\r\n"
@@ -300,28 +642,57 @@ bool SocketManager::HandleCommandSocketRead(IGenericSocket* socket)
                                 "Proxy-Authenticate: Basic realm=\"Nermal\"\r\n"
                                 "Connection: close\r\n"
                                 "\r\n";
-                        auto nwritten = ::write(session->GetClientFd(), authMessage, strlen(authMessage));
-                        ::close(session->GetClientFd());
-                        SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId);
+                        auto nwritten = SocketIo::Instance().Write(session->GetClientFd(), authMessage, strlen(authMessage));
+                        SocketIo::Instance().Close(session->GetClientFd());
+                        SessionManager::Instance().EndSession(msg.data.hostDetectResult.sessionId, CloseReason::AuthRequired);
                         return true;
                     }
                 }
             }            
 
+            PhaseStats::Instance().Mark(session, Phase::Authorized, Phase::Parsed, Stage::Auth);
             m_connector->ConnectProxy(msg.data.hostDetectResult.sessionId);
         }
+    } else if (msg.msgId == CACHE_SEND_RESULT) {
+        Log(LogSeverity::Verbose, "CACHE SEND RESULT");
+        auto sessionId = msg.data.cacheSendResult.sessionId;
+        auto bytesSent = msg.data.cacheSendResult.bytesSent;
+        auto* session = SessionManager::Instance().GetSession(sessionId);
+        if (!session) {
+            return true;
+        }
+        if (msg.data.cacheSendResult.success == false) {
+            Log(LogSeverity::Debug, "Session %d - unable to send cached response", sessionId);
+        }
+        if (msg.data.cacheSendResult.fromDisk) {
+            DiskCache::Instance().AddServedBytes(bytesSent, 0);
+        } else {
+            ResponseCache::Instance().AddServedBytes(bytesSent, 0);
+        }
+        session->AddTxBytes(bytesSent);
+        SocketIo::Instance().Close(session->GetClientFd());
+        SessionManager::Instance().EndSession(sessionId, CloseReason::CacheServed);
     } else if (msg.msgId == HOST_CONNECT_RESULT) {
         Log(LogSeverity::Verbose, "HOST CONNECT RESULT");
-        auto* session = SessionManager::Instance().GetSession(msg.data.hostDetectResult.sessionId);
+        auto* session = SessionManager::Instance().GetSession(msg.data.hostConnectResult.sessionId);
+        if (!session) {
+            // Session ended while connecting - the server connection is of no use
+            if (msg.data.hostConnectResult.proxyFd != -1) {
+                SocketIo::Instance().Close(msg.data.hostConnectResult.proxyFd);
+            }
+            return true;
+        }
         if (msg.data.hostConnectResult.success == false) {
             Log(LogSeverity::Debug, "proxy connect aborted, closing %d", session->GetSessionId());
             const char* authMessage =
                     "HTTP/1.0 404 Not Found\n"
                     "Connection: close\r\n"
                     "\r\n";
-            auto nwritten = ::write(session->GetClientFd(), authMessage, strlen(authMessage));
-            ::close(session->GetClientFd());
-            SessionManager::Instance().EndSession(session->GetSessionId());
+            auto nwritten = SocketIo::Instance().Write(session->GetClientFd(), authMessage, strlen(authMessage));
+            SocketIo::Instance().Close(session->GetClientFd());
+            // Connection failures are reported the same way whether or not the host resolved
+            auto reason = session->GetPhaseTime(Phase::Resolved) ? CloseReason::ConnectFailed : CloseReason::ResolveFailed;
+            SessionManager::Instance().EndSession(session->GetSessionId(), reason);
         } else {
             // Create Client and proxy objects
             auto clientFd = session->GetClientFd();
@@ -329,6 +700,7 @@ bool SocketManager::HandleCommandSocketRead(IGenericSocket* socket)
             auto sessionId = msg.data.hostConnectResult.sessionId;
 
             Log(LogSeverity::Debug, "Session %d - New proxy fd: %d->%d  connected", sessionId, clientFd, proxyFd);
+            PhaseStats::Instance().Mark(session, Phase::Connected, Phase::Resolved, Stage::Connect);
 
             auto newClientSocket = std::make_unique<ClientSocket>(clientFd, proxyFd, sessionId, true);
             AddSocket(std::move(newClientSocket));
@@ -346,7 +718,7 @@ bool SocketManager::ProcessSockets() {
     }
 
     epoll_event events[m_eventsToProcess] = {};
-    auto rc = epoll_wait(m_epollFd, events, m_eventsToProcess, m_epollTimeout);
+    auto rc = SocketIo::Instance().EpollWait(m_epollFd, events, m_eventsToProcess, m_epollTimeout);
 
     if (rc == -1) {
         if ((errno == EAGAIN) || (errno == EINTR)) {
@@ -355,11 +727,13 @@ bool SocketManager::ProcessSockets() {
         return false;
     }
 
+    LoopIteration iteration;
+
+    // A busy loop may never time out, so housekeeping runs on elapsed time instead
+    if ((Timestamp() - m_lastMaintenance) >= m_maintenanceInterval) {
+        RunMaintenance();
+    }
     if (!rc) {
-        PruneExcessConnections();
-        if (GlobalStats::Instance().ReadyToLog()) {
-            GlobalStats::Instance().LogAndReset();
-        }
         return true;
     }
 
@@ -371,16 +745,23 @@ bool SocketManager::ProcessSockets() {
             }
 
             if (socket->GetFd() == events[i].data.fd) {
+                // The handler may remove the socket, so note what it's working on first
+                auto start = TimestampUs();
+                auto handler = LoopHandler::NumHandlers;
+                auto sessionId = -1;
                 switch (socket->Identity()) {
                     //-------------------------------------------------------------
                     case SocketType::Server: {
+                        handler = LoopHandler::Server;
                         auto rc = HandleServerSocketRead(socket.get());
                         if (!rc) {
                             return false;
                         }
                     } sDone = true; break;
                     //-------------------------------------------------------------
-                    case SocketType::Client: {                        
+                    case SocketType::Client: {
+                        handler = LoopHandler::Client;
+                        sessionId = static_cast<ClientSocket*>(socket.get())->GetSessionId();
                         auto rc = HandleClientSocketRead(socket.get());
                         if (!rc) {
                             return false;
@@ -388,15 +769,29 @@ bool SocketManager::ProcessSockets() {
                     } sDone = true; break;
                     //-------------------------------------------------------------
                     case SocketType::Command: {
+                        handler = LoopHandler::Command;
                         auto rc = HandleCommandSocketRead(socket.get());
                         if (!rc) {
                             return false;
                         }
                     } sDone = true; break;
+                    //-------------------------------------------------------------
+                    case SocketType::Admin: {
+                        handler = LoopHandler::Admin;
+                        HandleAdminSocketRead(socket.get());
+                    } sDone = true; break;
+                    //-------------------------------------------------------------
+                    case SocketType::AdminConnection: {
+                        handler = LoopHandler::AdminConnection;
+                        HandleAdminConnection(socket.get());
+                    } sDone = true; break;
                     default: {
                         Log(LogSeverity::Debug, "Unknown Socket");
                     } sDone = true; break;
                 }
+                if (handler != LoopHandler::NumHandlers) {
+                    LoopMonitor::Instance().RecordHandler(handler, sessionId, start);
+                }
             }
         }
     }
@@ -31,11 +31,16 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <list>
 #include <memory>
 
+#include "AsyncMessenger.hpp"
+#include "ClientSocket.hpp"
 #include "IGenericSocket.hpp"
 #include "ProxyConnector.hpp"
+#include "Session.hpp"
 
 /**
  * @brief The SocketManager class manages the lifecycle of all socket
@@ -54,18 +59,41 @@ public:
 
 private:
     static constexpr auto m_maxConcurrentConnections = 256;
+    static constexpr auto m_maxClientSockets = 200;
+    static constexpr auto m_maxAdminConnections = 8;
+    static constexpr auto m_adminTimeout = 10 * 1000; // ms
     static constexpr auto m_eventsToProcess = 10;
     static constexpr auto m_epollTimeout = 100; // ms
+    static constexpr auto m_maintenanceInterval = 100; // ms
 
+    using SocketList = std::list<std::unique_ptr<IGenericSocket>>;
+
+    void RemoveSocket(SocketList::iterator it);
+    void RunMaintenance();
     void PruneExcessConnections();
+    void PruneAdminConnections();
+    void CloseAdminConnection(IGenericSocket* connection);
+    void CloseSession(int sessionId, int clientFd, int proxyFd, bool poolUpstream, CloseReason reason);
+    void RemoveSessionSockets(int sessionId, int clientFd, int proxyFd, bool poolUpstream, bool keepClient);
+    void CancelCapture(Session* session);
+    void CaptureResponse(Session* session, const std::uint8_t* data, std::size_t size);
+    bool HandleRevalidation(ClientSocket* server, Session* session, const std::uint8_t* data, std::size_t size);
     bool HandleServerSocketRead(IGenericSocket* socket);
     bool HandleClientSocketRead(IGenericSocket* socket);
     bool HandleCommandSocketRead(IGenericSocket* socket);
+    void HandleAdminSocketRead(IGenericSocket* socket);
+    void HandleAdminConnection(IGenericSocket* socket);
+    bool HandleAsyncMessage(const AsyncMessage_t& msg);
+
+    SocketList m_sockets;
 
-    std::list<std::unique_ptr<IGenericSocket>> m_sockets;
+    // Nodes of removed sockets, kept for reuse by AddSocket
+    SocketList m_spareSockets;
 
     int m_epollFd;
     bool m_isActive;
+    int m_adminConnections;
+    std::uint64_t m_lastMaintenance;
     std::unique_ptr<ProxyConnector> m_connector;
 };
 
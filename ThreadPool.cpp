@@ -0,0 +1,296 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ThreadPool.hpp"
+
+#include <time.h>
+
+#include <chrono>
+#include <thread>
+
+#include "Log.hpp"
+#include "Timestamp.hpp"
+
+namespace {
+
+template <typename T>
+void updateMax(std::atomic<T>& maximum, T value) {
+    auto current = maximum.load(std::memory_order_relaxed);
+    while ((value > current) && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+} // anonymous namespace
+
+ThreadPool& ThreadPool::Instance() {
+    static ThreadPool* instance = new ThreadPool{};
+    return *instance;
+}
+
+ThreadPool::ThreadPool()
+    : m_size{20}
+    , m_maxSize{20}
+    , m_queueLimit{1024}
+    , m_manual{false}
+    , m_numWorkers{0}
+    , m_nextWorker{0}
+    , m_backlogSince{0}
+    , m_lastReport{Timestamp()}
+    , m_queued{0}
+    , m_sleeping{0}
+    , m_maxQueued{0}
+    , m_completed{0}
+    , m_rejected{0}
+    , m_stolen{0}
+    , m_totalWaitUs{0}
+    , m_maxWaitUs{0}
+    , m_totalRunUs{0}
+    , m_maxRunUs{0}
+{}
+
+void ThreadPool::SetSize(int workers) {
+    m_size = (workers > 0) ? workers : 1;
+    if (m_maxSize < m_size) {
+        m_maxSize = m_size;
+    }
+}
+
+void ThreadPool::SetMaxSize(int workers) {
+    m_maxSize = (workers > m_size) ? workers : m_size;
+}
+
+void ThreadPool::SetQueueLimit(std::size_t limit) {
+    m_queueLimit = limit;
+}
+
+void ThreadPool::SetManual() {
+    m_manual = true;
+}
+
+void ThreadPool::Start() {
+    if (m_workers) {
+        return;
+    }
+
+    // A manual pool has a single queue, drained by RunPending()
+    if (m_manual) {
+        m_size = 1;
+        m_maxSize = 1;
+    }
+
+    // Worker slots are allocated up-front, so stealing never races with growth
+    m_workers.reset(new Worker[m_maxSize]);
+    for (auto i = 0; i < m_maxSize; i++) {
+        m_workers[i].ring.resize(m_queueLimit ? m_queueLimit : 1);
+        m_workers[i].head = 0;
+        m_workers[i].count = 0;
+    }
+    if (m_manual) {
+        m_numWorkers = 1;
+        Log(LogSeverity::Debug, "Thread pool started in manual mode (queue limit %zu)", m_queueLimit);
+        return;
+    }
+    for (auto i = 0; i < m_size; i++) {
+        StartWorker();
+    }
+    Log(LogSeverity::Debug, "Thread pool started with %d workers (max %d, queue limit %zu)", m_size, m_maxSize, m_queueLimit);
+}
+
+bool ThreadPool::Dispatch(WorkPackage& package) {
+    if (!m_workers) {
+        Start();
+    }
+
+    auto queued = m_queued.load();
+    if (queued >= m_queueLimit) {
+        m_rejected++;
+        return false;
+    }
+
+    package.enqueued = TimestampUs();
+    auto index = m_nextWorker++ % static_cast<unsigned>(m_numWorkers.load());
+    {
+        auto& worker = m_workers[index];
+        auto lg = LockGuard{worker.lock};
+        if (worker.count == worker.ring.size()) {
+            m_rejected++;
+            return false;
+        }
+        worker.ring[(worker.head + worker.count) % worker.ring.size()] = package;
+        // Counted before the package can be taken, so the taker's decrement can't come first
+        queued = ++m_queued;
+        worker.count++;
+    }
+    updateMax(m_maxQueued, queued);
+
+    if (m_sleeping.load() > 0) {
+        auto lg = LockGuard{m_sleepLock};
+        m_wakeup.notify_one();
+    }
+
+    CheckGrowth();
+    return true;
+}
+
+std::size_t ThreadPool::RunPending() {
+    if (!m_workers) {
+        return 0;
+    }
+
+    auto numRun = std::size_t{};
+    auto package = WorkPackage{};
+    while (TakeWork(0, package)) {
+        RunPackage(package);
+        numRun++;
+    }
+    return numRun;
+}
+
+void ThreadPool::GetStats(ThreadPoolStats& stats) {
+    stats.workers = m_numWorkers.load();
+    stats.queued = m_queued.load();
+    stats.maxQueued = m_maxQueued.load();
+    stats.completed = m_completed.load();
+    stats.rejected = m_rejected.load();
+    stats.stolen = m_stolen.load();
+    stats.totalWaitUs = m_totalWaitUs.load();
+    stats.maxWaitUs = m_maxWaitUs.load();
+    stats.totalRunUs = m_totalRunUs.load();
+    stats.maxRunUs = m_maxRunUs.load();
+}
+
+void ThreadPool::ReportStats() {
+    if ((Timestamp() - m_lastReport) < m_reportInterval) {
+        return;
+    }
+    m_lastReport = Timestamp();
+
+    auto stats = ThreadPoolStats{};
+    GetStats(stats);
+    auto completed = stats.completed ? stats.completed : 1;
+    Log(LogSeverity::Info, "Thread pool: %d workers, %zu queued (max %zu), %llu tasks, %llu rejected, %llu stolen, wait avg %lluus max %lluus, run avg %lluus max %lluus",
+        stats.workers, stats.queued, stats.maxQueued, stats.completed, stats.rejected, stats.stolen,
+        stats.totalWaitUs / completed, stats.maxWaitUs, stats.totalRunUs / completed, stats.maxRunUs);
+
+    // Maxima are per reporting interval
+    m_maxQueued = 0;
+    m_maxWaitUs = 0;
+    m_maxRunUs = 0;
+}
+
+void ThreadPool::StartWorker() {
+    auto index = m_numWorkers.load();
+    auto* newThread = new std::thread(&ThreadPool::WorkerMain, this, index);
+    newThread->detach();
+    m_numWorkers++;
+}
+
+void ThreadPool::WorkerMain(int index) {
+    while (1) {
+        auto package = WorkPackage{};
+        if (!TakeWork(index, package)) {
+            auto lg = LockGuard{m_sleepLock};
+            m_sleeping++;
+            if (m_queued.load() == 0) {
+                m_wakeup.wait_for(lg, std::chrono::milliseconds(100));
+            }
+            m_sleeping--;
+            continue;
+        }
+        RunPackage(package);
+    }
+}
+
+void ThreadPool::RunPackage(WorkPackage& package) {
+    auto start = TimestampUs();
+    auto wait = start - package.enqueued;
+    if (package.handler) {
+        package.handler(package.context);
+    }
+    auto run = TimestampUs() - start;
+
+    m_completed++;
+    m_totalWaitUs += wait;
+    m_totalRunUs += run;
+    updateMax(m_maxWaitUs, wait);
+    updateMax(m_maxRunUs, run);
+}
+
+bool ThreadPool::TakeWork(int index, WorkPackage& package) {
+    // Own queue first, oldest work first
+    {
+        auto& worker = m_workers[index];
+        auto lg = LockGuard{worker.lock};
+        if (worker.count) {
+            package = worker.ring[worker.head];
+            worker.head = (worker.head + 1) % worker.ring.size();
+            worker.count--;
+            m_queued--;
+            return true;
+        }
+    }
+
+    // Steal the newest work from the other workers
+    auto numWorkers = m_numWorkers.load();
+    for (auto i = 1; i < numWorkers; i++) {
+        auto& victim = m_workers[(index + i) % numWorkers];
+        auto lg = LockGuard{victim.lock};
+        if (victim.count) {
+            victim.count--;
+            package = victim.ring[(victim.head + victim.count) % victim.ring.size()];
+            m_queued--;
+            m_stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::CheckGrowth() {
+    auto numWorkers = m_numWorkers.load();
+    if (numWorkers >= m_maxSize) {
+        return;
+    }
+
+    if (m_queued.load() < static_cast<std::size_t>(numWorkers * m_growthDepth)) {
+        m_backlogSince = 0;
+        return;
+    }
+
+    auto now = TimestampUs();
+    if (!m_backlogSince) {
+        m_backlogSince = now;
+    } else if ((now - m_backlogSince) >= m_growthDelay) {
+        Log(LogSeverity::Info, "Thread pool backlog of %zu, adding worker %d", m_queued.load(), numWorkers + 1);
+        StartWorker();
+        m_backlogSince = 0;
+    }
+}
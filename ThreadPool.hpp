@@ -0,0 +1,149 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using ThreadFunc = void (*)(void* context);
+
+typedef struct {
+    ThreadFunc handler;
+    void* context;
+    std::uint64_t enqueued; // us, set on dispatch
+} WorkPackage;
+
+// Snapshot of the thread pool's statistics since the last report
+typedef struct {
+    int workers;
+    std::size_t queued;
+    std::size_t maxQueued;
+    std::uint64_t completed;
+    std::uint64_t rejected;
+    std::uint64_t stolen;
+    std::uint64_t totalWaitUs;
+    std::uint64_t maxWaitUs;
+    std::uint64_t totalRunUs;
+    std::uint64_t maxRunUs;
+} ThreadPoolStats;
+
+/**
+ * @brief The ThreadPool class runs blocking work (proxy detection, DNS lookups,
+ * connects) on behalf of the event loop.  Each worker has its own queue, and
+ * idle workers steal from the back of other workers' queues.  Admission is
+ * bounded; Dispatch fails once too much work is queued, so callers can shed
+ * load.  Optionally, workers are added while the queue stays deep.
+ */
+class ThreadPool {
+public:
+    static ThreadPool& Instance();
+
+    // Settings, which must be applied before Start()
+    void SetSize(int workers);
+    void SetMaxSize(int workers);
+    void SetQueueLimit(std::size_t limit);
+
+    // Start no workers - work only runs when RunPending() is called, on the caller's
+    // thread.  Simulations use this to run the whole proxy on one thread.
+    void SetManual();
+
+    void Start();
+
+    // Queue a package for a worker.  Returns false if the pool is overloaded, in
+    // which case the package was not queued.
+    bool Dispatch(WorkPackage& package);
+
+    // Run everything queued, including work queued meanwhile, on this thread.  Returns
+    // the number of packages run.  Only useful in manual mode.
+    std::size_t RunPending();
+
+    void GetStats(ThreadPoolStats& stats);
+
+    // Periodically log queue depth, wait and run time statistics
+    void ReportStats();
+
+private:
+    ThreadPool();
+
+    // Each worker's queue is a fixed ring, sized to the queue limit so it never
+    // needs to allocate.  The owner takes from the head, thieves from the tail.
+    typedef struct {
+        std::mutex lock;
+        std::vector<WorkPackage> ring;
+        std::size_t head;
+        std::size_t count;
+    } Worker;
+
+    void StartWorker();
+    void WorkerMain(int index);
+    bool TakeWork(int index, WorkPackage& package);
+    void RunPackage(WorkPackage& package);
+    void CheckGrowth();
+
+    using LockGuard = std::unique_lock<std::mutex>;
+
+    static constexpr auto m_growthDelay = 500 * 1000;       // us of sustained backlog before adding a worker
+    static constexpr auto m_growthDepth = 2;                // queued packages per worker considered a backlog
+    static constexpr auto m_reportInterval = 300 * 1000;    // ms
+
+    int m_size;
+    int m_maxSize;
+    std::size_t m_queueLimit;
+    bool m_manual;
+
+    std::unique_ptr<Worker[]> m_workers;
+    std::atomic<int> m_numWorkers;
+    std::atomic<unsigned> m_nextWorker;
+    std::uint64_t m_backlogSince;
+    std::uint64_t m_lastReport;
+
+    // Workers with nothing to do wait on m_wakeup; dispatch only takes the lock when
+    // someone is asleep.
+    std::atomic<std::size_t> m_queued;
+    std::atomic<int> m_sleeping;
+    std::mutex m_sleepLock;
+    std::condition_variable m_wakeup;
+
+    std::atomic<std::size_t> m_maxQueued;
+    std::atomic<std::uint64_t> m_completed;
+    std::atomic<std::uint64_t> m_rejected;
+    std::atomic<std::uint64_t> m_stolen;
+    std::atomic<std::uint64_t> m_totalWaitUs;
+    std::atomic<std::uint64_t> m_maxWaitUs;
+    std::atomic<std::uint64_t> m_totalRunUs;
+    std::atomic<std::uint64_t> m_maxRunUs;
+};
@@ -33,12 +33,38 @@
 
 #include <time.h>
 
+namespace {
+
+ClockSource clockSource = nullptr;
+
+} // anonymous namespace
+
 std::uint64_t Timestamp()
 {
+    if (clockSource) {
+        return clockSource() / 1000;
+    }
+
     auto ts = timespec{};
     clock_gettime(CLOCK_MONOTONIC, &ts);
 
     auto rc = std::uint64_t{};
-    rc = (ts.tv_sec * 1000) + (ts.tv_nsec / 10000000);
+    rc = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
     return rc;
 }
+
+std::uint64_t TimestampUs()
+{
+    if (clockSource) {
+        return clockSource();
+    }
+
+    auto ts = timespec{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<std::uint64_t>(ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+void SetClockSource(ClockSource source)
+{
+    clockSource = source;
+}
@@ -35,3 +35,13 @@
 
 // Return current monotonic time as a 64bit msec count
 std::uint64_t Timestamp();
+
+// Return current monotonic time as a 64bit usec count
+std::uint64_t TimestampUs();
+
+// Source of time in usec, replacing the monotonic clock for both of the above
+using ClockSource = std::uint64_t (*)();
+
+// Run on the given clock instead of the monotonic clock - simulations use this to
+// run the proxy on virtual time.  nullptr restores the monotonic clock.
+void SetClockSource(ClockSource source);
@@ -0,0 +1,173 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "UpstreamPool.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "SocketIo.hpp"
+#include "Timestamp.hpp"
+
+UpstreamPool& UpstreamPool::Instance() {
+    static UpstreamPool* instance = new UpstreamPool;
+    return *instance;
+}
+
+void UpstreamPool::SetEnabled(bool enable) {
+    m_enabled = enable;
+}
+
+bool UpstreamPool::IsEnabled() {
+    return m_enabled;
+}
+
+void UpstreamPool::SetMaxSize(std::size_t maxSize) {
+    m_maxSize = maxSize;
+}
+
+void UpstreamPool::SetIdleTimeout(int seconds) {
+    m_idleTimeout = std::uint64_t(seconds) * 1000;
+}
+
+bool UpstreamPool::IsPoolableRequest(const std::string& request) {
+    // Only idempotent requests are sent over a reused connection - a server may
+    // close an idle connection just as we write to it.
+    if (0 != strncmp(request.c_str(), "GET ", 4)) {
+        return false;
+    }
+
+    auto lineEnd = request.find("\r\n");
+    if ((lineEnd == std::string::npos) || (request.rfind(" HTTP/1.1", lineEnd) == std::string::npos)) {
+        return false;
+    }
+
+    if (strcasestr(request.c_str(), "Connection: close") || strcasestr(request.c_str(), "\r\nUpgrade:")) {
+        return false;
+    }
+    return true;
+}
+
+int UpstreamPool::Acquire(const std::string& host, std::uint16_t port) {
+    auto lg = LockGuard{m_lock};
+    auto now = Timestamp();
+
+    auto it = m_idle.end();
+    while (it != m_idle.begin()) {
+        it--;
+        if ((it->port != port) || (it->host != host)) {
+            continue;
+        }
+
+        auto fd = it->fd;
+        auto expired = (now - it->timestamp) > m_idleTimeout;
+        it = m_idle.erase(it);
+
+        if (expired || !IsAlive(fd)) {
+            Log(LogSeverity::Debug, "Discarding stale upstream connection fd=%d for %s:%d", fd, host.c_str(), port);
+            SocketIo::Instance().Close(fd);
+            continue;
+        }
+
+        m_hits++;
+        Log(LogSeverity::Debug, "Reusing upstream connection fd=%d for %s:%d (%llu hits, %llu misses)",
+            fd, host.c_str(), port, m_hits, m_misses);
+        return fd;
+    }
+
+    m_misses++;
+    return -1;
+}
+
+bool UpstreamPool::Release(const std::string& host, std::uint16_t port, int fd) {
+    if (!m_enabled || !IsAlive(fd)) {
+        SocketIo::Instance().Close(fd);
+        return false;
+    }
+
+    auto lg = LockGuard{m_lock};
+
+    // Enforce the per-host limit by dropping the oldest connection for the host
+    auto hostCount = 0;
+    for (auto& conn : m_idle) {
+        if ((conn.port == port) && (conn.host == host)) {
+            hostCount++;
+        }
+    }
+    if (hostCount >= m_maxPerHost) {
+        for (auto it = m_idle.begin(); it != m_idle.end(); it++) {
+            if ((it->port == port) && (it->host == host)) {
+                SocketIo::Instance().Close(it->fd);
+                m_idle.erase(it);
+                break;
+            }
+        }
+    }
+
+    m_idle.push_back(IdleConnection{host, port, fd, Timestamp()});
+    Log(LogSeverity::Debug, "Pooled upstream connection fd=%d for %s:%d", fd, host.c_str(), port);
+
+    while (m_idle.size() > m_maxSize) {
+        SocketIo::Instance().Close(m_idle.front().fd);
+        m_idle.pop_front();
+    }
+    return true;
+}
+
+void UpstreamPool::Prune() {
+    auto lg = LockGuard{m_lock};
+    auto now = Timestamp();
+
+    auto it = m_idle.begin();
+    while (it != m_idle.end()) {
+        if (((now - it->timestamp) > m_idleTimeout) || !IsAlive(it->fd)) {
+            Log(LogSeverity::Debug, "Closing idle upstream connection fd=%d for %s:%d", it->fd, it->host.c_str(), it->port);
+            SocketIo::Instance().Close(it->fd);
+            it = m_idle.erase(it);
+            Metrics::Instance().Increment(Counter::PrunedUpstreams);
+        } else {
+            it++;
+        }
+    }
+}
+
+bool UpstreamPool::IsAlive(int fd) {
+    // An idle connection should have nothing to read - EOF or stray data both mean
+    // the connection can't be used for a new request.
+    char c;
+    auto rc = SocketIo::Instance().Recv(fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+    return (rc == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
@@ -0,0 +1,99 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief The UpstreamPool class holds idle, persistent connections to servers
+ * that were used for plain-HTTP (transparent) requests, so that a subsequent
+ * request to the same host/port can skip the DNS lookup and TCP handshake.
+ * Connections are only held for a limited time, and the pool is bounded both
+ * in total and per-host.
+ */
+class UpstreamPool {
+public:
+    static UpstreamPool& Instance();
+
+    void SetEnabled(bool enable);
+    bool IsEnabled();
+
+    // Set the maximum number of idle connections held across all hosts
+    void SetMaxSize(std::size_t maxSize);
+
+    // Set the time after which an idle connection is closed
+    void SetIdleTimeout(int seconds);
+
+    // Returns true if the request is one that can be sent over a pooled connection,
+    // and whose connection can be returned to the pool afterwards.
+    static bool IsPoolableRequest(const std::string& request);
+
+    // Take an idle connection for the given host/port out of the pool.  Returns -1
+    // if no live connection is available.
+    int Acquire(const std::string& host, std::uint16_t port);
+
+    // Return a connection to the pool.  Returns false if the connection was not
+    // accepted, in which case it has been closed.
+    bool Release(const std::string& host, std::uint16_t port, int fd);
+
+    // Close connections which have been idle for longer than the idle timeout
+    void Prune();
+
+private:
+    using LockGuard = std::unique_lock<std::mutex>;
+
+    typedef struct {
+        std::string host;
+        std::uint16_t port;
+        int fd;
+        std::uint64_t timestamp;
+    } IdleConnection;
+
+    static constexpr auto m_maxPerHost = 4;
+
+    static bool IsAlive(int fd);
+
+    bool m_enabled = false;
+    std::size_t m_maxSize = 32;
+    std::uint64_t m_idleTimeout = 30 * 1000; // ms
+
+    std::uint64_t m_hits = 0;
+    std::uint64_t m_misses = 0;
+
+    // Most recently released connections are at the back of the list.
+    std::list<IdleConnection> m_idle;
+    std::mutex m_lock;
+};
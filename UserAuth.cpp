@@ -37,20 +37,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <string>
 #include <string.h>
 #include <list>
+#include <thread>
 #include <vector>
 
+#include "AuditWriter.hpp"
 #include "Log.hpp"
 #include "Timestamp.hpp"
 
-
-namespace {
-int s_logNumber = 0;
-
-} // anonymous namespace
-
 User::User(const std::string& name, const std::string& password)
     : m_name{std::move(name)}
     , m_password{std::move(password)}
@@ -85,7 +82,7 @@ bool User::HasIpList() const {
     return false;
 }
 
-std::vector<std::string> User::GetIpList() const {
+const std::vector<std::string>& User::GetIpList() const {
     return m_ipList;
 }
 
@@ -135,15 +132,14 @@ void AuthManager::AddUserIp(const std::string& username, const std::string& ipAd
     }
 }
 
-bool AuthManager::AuthenticateIp(const std::string& ipAddress, std::string& username) {
+bool AuthManager::AuthenticateIp(const std::string& ipAddress, const std::string*& username) {
     Log(LogSeverity::Verbose, "%s: enter", __func__);
     for (auto& user: m_users) {
         if (user.HasIpList()) {
-            auto ipList = user.GetIpList();
-            for (auto& ip : ipList) {
+            for (auto& ip : user.GetIpList()) {
                 if (ip == ipAddress) {
                     Log(LogSeverity::Debug, "%s: Match -- auth by IP Ok", __func__, ip.c_str());
-                    username = user.GetName();
+                    username = &user.GetName();
                     return true;
                 }
             }
@@ -154,31 +150,28 @@ bool AuthManager::AuthenticateIp(const std::string& ipAddress, std::string& user
     return false;
 }
 
-bool AuthManager::Authenticate(const std::string& base64Creds, std::string& username) {
-    auto size = int{};
-    auto* credString = Base64Decode(base64Creds, size);
-    if (credString) {
-        char user[128] = {};
-        char pass[128] = {};
-
-        auto delimPtr = strchr((char*)credString, ':');
-        if (delimPtr) {
-            *delimPtr = ' ';
-        }
-
-        auto parsed = sscanf((const char*)credString, "%s %s", user, pass);
-        auto userString = std::string(user);
-        auto passString = std::string(pass);
+bool AuthManager::Authenticate(const char* base64Creds, const std::string*& username) {
+    // Credentials are decoded and split in place, on the stack
+    std::uint8_t credString[768];
+    auto size = std::size_t{};
+    if (!Base64Decode(base64Creds, credString, sizeof(credString) - 1, size)) {
+        return false;
+    }
+    credString[size] = '\0';
 
-        auto rc = Authenticate_i(userString, passString);
-        delete credString;
+    auto* user = reinterpret_cast<char*>(credString);
+    auto* pass = strchr(user, ':');
+    if (!pass) {
+        return false;
+    }
+    *pass++ = '\0';
 
-        if (rc) {
-            username = userString;
-        }
-        return true;
+    const auto* match = Authenticate_i(user, pass);
+    if (!match) {
+        return false;
     }
-    return false;
+    username = &match->GetName();
+    return true;
 }
 
 bool AuthManager::AccessAllowedAtTime(const std::string &username) {
@@ -227,26 +220,23 @@ bool AuthManager::SetWeeklyAccess(const std::string &userName, const std::string
     return false;
 }
 
-bool AuthManager::Authenticate_i(const std::string& userName, const std::string& password) {
-    Log(LogSeverity::Debug, "%s:  %s:%s", __func__, userName.c_str(), password.c_str());
+const User* AuthManager::Authenticate_i(const char* userName, const char* password) {
+    Log(LogSeverity::Debug, "%s:  %s:%s", __func__, userName, password);
     for (auto& user : m_users) {
         Log(LogSeverity::Debug, "%s:  %s:%s", __func__, user.GetName().c_str(), user.GetPassword().c_str());
         if ((user.GetName() == userName) && (user.GetPassword() == password)) {
             Log(LogSeverity::Debug, "Credentials validated");
-            return true;
+            return &user;
         }
     }
     Log(LogSeverity::Warn, "Credential Error");
-    return false;
+    return nullptr;
 }
 
-std::uint8_t* AuthManager::Base64Decode(const std::string& source, int& size) {
-
-    size = ((source.size() * 3) + 3) / 4;
-    auto* rc = new uint8_t[size + 3];
-    memset(rc, 0, size + 3);
+bool AuthManager::Base64Decode(const char* source, std::uint8_t* dest, std::size_t destSize, std::size_t& size) {
 
-    auto* dst = rc;
+    auto* dst = dest;
+    auto* end = dest + destSize;
     auto idx = 0;
     auto tmp = std::uint32_t{};
 
@@ -271,14 +261,17 @@ std::uint8_t* AuthManager::Base64Decode(const std::string& source, int& size) {
                 c = 63;
             } else {
                 Log(LogSeverity::Debug, "Invalid Base64 Character");
-                delete rc;
-                return nullptr;
+                return false;
             }
 
             tmp |= (c & 0x3F);
         }
 
         if ((idx % 4) == 0) {
+            if (end - dst < 3) {
+                Log(LogSeverity::Debug, "Base64 String too long");
+                return false;
+            }
             *dst++ = std::uint8_t(tmp >> 16);
             *dst++ = std::uint8_t(tmp >> 8);
             *dst++ = std::uint8_t(tmp & 0xFF);
@@ -289,12 +282,11 @@ std::uint8_t* AuthManager::Base64Decode(const std::string& source, int& size) {
     }
 
     if ((idx % 4) != 0) {
-        Log(LogSeverity::Debug, "Invalid Base64 String, rc = %s, id=%d", rc, idx);
-        delete rc;
-        return nullptr;
+        Log(LogSeverity::Debug, "Invalid Base64 String, id=%d", idx);
+        return false;
     }
-    size = (dst - rc);
-    return rc;
+    size = (dst - dest);
+    return true;
 }
 
 SiteStats::SiteStats(const std::string& hostName)
@@ -309,20 +301,11 @@ const std::string& SiteStats::GetHostName() {
     return m_hostName;
 }
 
-void SiteStats::AddRxBytes(std::uint64_t rxBytes) {
-    m_rxBytes += rxBytes;
-}
-
-void SiteStats::AddTxBytes(std::uint64_t txBytes) {
-    m_txBytes += txBytes;
-}
-
-void SiteStats::IncrementConnections() {
-    m_connections++;
-}
-
-void SiteStats::AddConnectionTime(std::uint64_t timeMs) {
-    m_totalTime += timeMs;
+void SiteStats::Add(const SiteCounters& counters) {
+    m_rxBytes += counters.rxBytes;
+    m_txBytes += counters.txBytes;
+    m_totalTime += counters.totalTime;
+    m_connections += counters.connections;
 }
 
 std::uint64_t SiteStats::GetRxBytes() const {
@@ -337,23 +320,34 @@ std::uint64_t SiteStats::GetTotalTime() const {
     return m_totalTime;
 }
 
+int SiteStats::GetConnections() const {
+    return m_connections;
+}
+
 void SiteStats::Print() const {
     Log(LogSeverity::Debug, "Host: %s\nRxBytes: %llu\nTxBytes: %llu\nTotalTimeMs: %llu\nConnections: %d",
         m_hostName.c_str(), m_txBytes, m_rxBytes, m_totalTime, m_connections);
 }
 
-UserStats::UserStats(const std::string& userName) :
+UserStats::UserStats(const std::string& userName, std::size_t topHosts) :
     m_userName{userName}
-{}
+{
+    if (topHosts) {
+        m_sketch = std::make_unique<HostSketch>(topHosts);
+    }
+}
 
-SiteStats& UserStats::GetStats(const std::string& host) {
-    for (auto& stat : m_stats) {
-        if (stat.GetHostName() == host) {
-            return stat;
-        }
+void UserStats::Add(const std::string& host, const SiteCounters& counters) {
+    if (m_sketch) {
+        m_sketch->Add(host, counters.rxBytes, counters.txBytes, counters.totalTime, counters.connections);
+        return;
+    }
+
+    auto it = m_stats.find(host);
+    if (it == m_stats.end()) {
+        it = m_stats.emplace(host, SiteStats{host}).first;
     }
-    m_stats.emplace_back(SiteStats{host});
-    return m_stats.back();
+    it->second.Add(counters);
 }
 
 void SiteStats::LogToFile(int fd) const {
@@ -373,21 +367,28 @@ void SiteStats::LogToFile(int fd) const {
 const std::string& UserStats::GetUserName() {
     return m_userName;
 }
-void UserStats::LogToFile()
+void UserStats::LogToFile(int logNumber)
 {
     // Don't log stats for users who haven't connected in this period
-    if (m_stats.size() == 0) {
+    if (GetStatCount() == 0) {
         return;
     }
 
     char fileName[256];
-    snprintf(fileName, sizeof(fileName), "%s_%d.csv", m_userName.c_str(), s_logNumber);
+    snprintf(fileName, sizeof(fileName), "%s_%d.csv", m_userName.c_str(), logNumber);
     Log(LogSeverity::Debug, "Opening file %s for logging", fileName);
     auto fd = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWUSR);
     if (fd < 0) {
         Log(LogSeverity::Warn, "Error opening log file for write %d(%s)", errno, strerror(errno));
         return;
     }
+    if (m_sketch) {
+        m_sketch->LogToFile(fd);
+        ::fsync(fd);
+        ::close(fd);
+        return;
+    }
+
     constexpr auto* headerString = "host,rxBytes,txBytes,totalTime,connections\n";
 
     auto rc = ::write(fd, headerString, strlen(headerString));
@@ -398,19 +399,103 @@ void UserStats::LogToFile()
     }
 
     for (auto& stat : m_stats) {
-        stat.LogToFile(fd);
+        stat.second.LogToFile(fd);
     }
 
+    ::fsync(fd);
     ::close(fd);
 }
 
+void UserStats::ForEachHost(const std::function<void(const std::string&, const SiteCounters&)>& visitor) {
+    if (m_sketch) {
+        m_sketch->ForEachHost([&visitor](const std::string& host, std::uint64_t rxBytes, std::uint64_t txBytes,
+                                         std::uint64_t totalTime, std::uint64_t connections) {
+            auto counters = SiteCounters{rxBytes, txBytes, totalTime, static_cast<int>(connections)};
+            visitor(host, counters);
+        });
+        return;
+    }
+
+    for (auto& stat : m_stats) {
+        auto counters = SiteCounters{stat.second.GetRxBytes(), stat.second.GetTxBytes(),
+                                     stat.second.GetTotalTime(), stat.second.GetConnections()};
+        visitor(stat.first, counters);
+    }
+}
+
 int UserStats::GetStatCount() {
+    if (m_sketch) {
+        return m_sketch->GetHostCount();
+    }
     return m_stats.size();
 }
 
+StatShard::StatShard()
+    : m_active{0}
+{
+    m_hostCount[0] = 0;
+    m_hostCount[1] = 0;
+    m_writing[0] = 0;
+    m_writing[1] = 0;
+}
+
+std::size_t StatShard::Record(const std::string& username, const std::string& host, const SiteCounters& counters) {
+    // Announce the write, then make sure a fold didn't retire the buffer in the meantime
+    auto active = m_active.load();
+    m_writing[active].store(1);
+    while (m_active.load() != active) {
+        m_writing[active].store(0);
+        active = m_active.load();
+        m_writing[active].store(1);
+    }
+
+    auto inserted = m_counters[active][username].emplace(host, SiteCounters{});
+    auto& site = inserted.first->second;
+    site.rxBytes += counters.rxBytes;
+    site.txBytes += counters.txBytes;
+    site.totalTime += counters.totalTime;
+    site.connections += counters.connections;
+    if (inserted.second) {
+        m_hostCount[active]++;
+    }
+    auto hostCount = m_hostCount[active];
+
+    m_writing[active].store(0, std::memory_order_release);
+    return hostCount;
+}
+
+void StatShard::Drain(std::unordered_map<std::string, UserStats>& userStats, std::size_t topHosts) {
+    auto retired = m_active.load();
+    m_active.store(1 - retired);
+
+    // Pairs with Record, Dekker style: Record stores m_writing then loads m_active,
+    // and this stores m_active then loads m_writing.  With both sides seq_cst, at
+    // least one of them sees the other's store - either Record sees the buffer was
+    // retired and moves on, or this sees the write in progress and waits for it.
+    // An acquire load here could be ordered before the store above, and miss both.
+    while (m_writing[retired].load()) {
+        std::this_thread::yield();
+    }
+
+    for (auto& user : m_counters[retired]) {
+        auto it = userStats.find(user.first);
+        if (it == userStats.end()) {
+            it = userStats.emplace(user.first, UserStats{user.first, topHosts}).first;
+        }
+        for (auto& host : user.second) {
+            it->second.Add(host.first, host.second);
+        }
+    }
+    m_counters[retired].clear();
+    m_hostCount[retired] = 0;
+}
+
 GlobalStats::GlobalStats()
+    : m_topHosts{0}
+    , m_logNumber{0}
 {
     m_lastLogTime = Timestamp();
+    m_periodStart = time(nullptr);
 }
 
 GlobalStats& GlobalStats::Instance() {
@@ -418,37 +503,87 @@ GlobalStats& GlobalStats::Instance() {
     return *instance;
 }
 
-SiteStats& GlobalStats::GetStats(const std::string& username, const std::string& host) {
-    for (auto& stat : m_userStats) {
-        if (stat.GetUserName() == username) {
-            return stat.GetStats(host);
+StatShard& GlobalStats::LocalShard() {
+    thread_local StatShard* shard = nullptr;
+    if (!shard) {
+        shard = new StatShard;
+        auto lg = LockGuard{m_lock};
+        m_shards.push_back(shard);
+    }
+    return *shard;
+}
+
+void GlobalStats::Record(const std::string& username, const std::string& host, const SiteCounters& counters) {
+    auto& shard = LocalShard();
+    auto hostCount = shard.Record(username, host, counters);
+
+    // The approximate totals are bounded, so the shard feeding them must be too.  A
+    // burst of distinct hosts is merged right away, unless a fold is doing it already.
+    if (m_topHosts && (hostCount > m_shardHostLimit)) {
+        auto lg = LockGuard{m_lock, std::try_to_lock};
+        if (lg.owns_lock()) {
+            shard.Drain(m_userStats, m_topHosts);
         }
     }
-    m_userStats.emplace_back(UserStats{username});
-    auto& stat = m_userStats.back();
-    return stat.GetStats(host);
+}
+
+void GlobalStats::Start() {
+    auto* foldThread = new std::thread(&GlobalStats::FoldMain, this);
+    foldThread->detach();
+}
+
+void GlobalStats::Fold() {
+    auto lg = LockGuard{m_lock};
+    Fold_i();
+}
+
+void GlobalStats::Fold_i() {
+    for (auto* shard : m_shards) {
+        shard->Drain(m_userStats, m_topHosts);
+    }
+}
+
+void GlobalStats::SetApproximate(std::size_t topHosts) {
+    auto lg = LockGuard{m_lock};
+    m_topHosts = topHosts;
 }
 
 void GlobalStats::DumpUserStats(const std::string& username) {
-    for (auto& stat : m_userStats) {
-        if (stat.GetUserName() == username) {
-            stat.LogToFile();
-            return;
-        }
+    auto lg = LockGuard{m_lock};
+    Fold_i();
+    auto it = m_userStats.find(username);
+    if (it != m_userStats.end()) {
+        it->second.LogToFile(m_logNumber);
     }
 }
 
 void GlobalStats::LogAndReset() {
-    m_lastLogTime = Timestamp();
-
-    for (auto& stat : m_userStats) {
-        stat.LogToFile();
+    auto snapshot = AuditSnapshot{};
+    {
+        auto lg = LockGuard{m_lock};
+        Fold_i();
+        m_lastLogTime = Timestamp();
+
+        snapshot.logNumber = m_logNumber;
+        snapshot.periodStart = m_periodStart;
+        snapshot.periodEnd = time(nullptr);
+        m_periodStart = snapshot.periodEnd;
+        snapshot.userStats.swap(m_userStats);
+        m_logNumber++;
+        if (m_logNumber > m_logPersistence) {
+            m_logNumber = 0;
+        }
     }
+    AuditWriter::Instance().Submit(snapshot);
+}
 
-    m_userStats.clear();
-    s_logNumber++;
-    if (s_logNumber > m_logPersistence) {
-        s_logNumber = 0;
+void GlobalStats::FoldMain() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(m_foldFrequency));
+        Fold();
+        if (ReadyToLog()) {
+            LogAndReset();
+        }
     }
 }
 
@@ -31,12 +31,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <string>
 #include <string.h>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <ctime>
 
+#include "HostSketch.hpp"
 #include "Log.hpp"
 #include "TimeMap.hpp"
 
@@ -55,7 +61,7 @@ public:
     const std::string& GetPassword() const;
     bool GetAudit() const;
     bool HasIpList() const;
-    std::vector<std::string> GetIpList() const;
+    const std::vector<std::string>& GetIpList() const;
     WeeklyAccess& GetWeeklyAccess();
 
 private:
@@ -81,20 +87,31 @@ public:
     void SetAudit(const std::string& username, bool audit);
     void AddUser(const std::string& username, const std::string& password);
     void AddUserIp(const std::string& username, const std::string& ip);
-    bool AuthenticateIp(const std::string& ipAddress, std::string& username);
-    bool Authenticate(const std::string& base64Creds, std::string& username);
+    // On success, username points to the name of the authenticated user
+    bool AuthenticateIp(const std::string& ipAddress, const std::string*& username);
+    bool Authenticate(const char* base64Creds, const std::string*& username);
     bool AccessAllowedAtTime(const std::string& username);
     bool SetWeeklyAccess(const std::string& user, const std::string& day, const std::string& initString);
 
+    // Decode into dest, which must have room for a terminating null
+    static bool Base64Decode(const char* source, std::uint8_t* dest, std::size_t destSize, std::size_t& size);
+
 private:
 
-    bool Authenticate_i(const std::string& userName, const std::string& password);
-    static std::uint8_t* Base64Decode(const std::string& source, int& size);
+    const User* Authenticate_i(const char* userName, const char* password);
 
     std::list<User> m_users;
     bool m_enabled = false;
 };
 
+// Counters for one user/host pair, accumulated between folds
+typedef struct {
+    std::uint64_t rxBytes;
+    std::uint64_t txBytes;
+    std::uint64_t totalTime;
+    int connections;
+} SiteCounters;
+
 /**
  * @brief The SiteStats class tracks access statistics for a
  * given host.
@@ -105,13 +122,11 @@ public:
 
     const std::string& GetHostName();
 
-    void AddRxBytes(std::uint64_t rxBytes);
-    void AddTxBytes(std::uint64_t txBytes);
-    void IncrementConnections();
-    void AddConnectionTime(std::uint64_t timeMs);
+    void Add(const SiteCounters& counters);
     std::uint64_t GetRxBytes() const;
     std::uint64_t GetTxBytes() const;
     std::uint64_t GetTotalTime() const;
+    int GetConnections() const;
     void Print() const;
     void LogToFile(int fd) const;
 
@@ -125,20 +140,53 @@ private:
 
 /**
  * @brief The UserStats class tracks site access statistics for
- * a host, used for implementing user-level auditing.
+ * a host, used for implementing user-level auditing.  With topHosts
+ * set, only an approximate summary of the busiest hosts is kept, in
+ * fixed memory.
  */
 class UserStats {
 public:
-    UserStats(const std::string& userName);
+    UserStats(const std::string& userName, std::size_t topHosts = 0);
 
-    SiteStats& GetStats(const std::string& host);
+    void Add(const std::string& host, const SiteCounters& counters);
     const std::string& GetUserName();
-    void LogToFile();
+    // Write the stats to <user>_<logNumber>.csv, and sync them to disk
+    void LogToFile(int logNumber);
     int GetStatCount();
 
+    // Visit each host's stats (estimates, in approximate mode)
+    void ForEachHost(const std::function<void(const std::string&, const SiteCounters&)>& visitor);
+
 private:
     std::string m_userName;
-    std::list<SiteStats> m_stats;
+    std::unordered_map<std::string, SiteStats> m_stats;
+    std::unique_ptr<HostSketch> m_sketch;
+};
+
+/**
+ * @brief The StatShard class holds the audit counters recorded by one thread.
+ * The owning thread updates the active buffer without locking; a fold flips
+ * the shard to its other buffer, waits out any update in progress, and merges
+ * the retired buffer into the global totals.
+ */
+class StatShard {
+public:
+    StatShard();
+
+    // Returns the number of hosts now held in the active buffer
+    std::size_t Record(const std::string& username, const std::string& host, const SiteCounters& counters);
+
+    // Retire the active buffer and merge its counters into userStats
+    void Drain(std::unordered_map<std::string, UserStats>& userStats, std::size_t topHosts);
+
+private:
+    using HostCounters = std::unordered_map<std::string, SiteCounters>;
+    using UserCounters = std::unordered_map<std::string, HostCounters>;
+
+    UserCounters m_counters[2];
+    std::size_t m_hostCount[2];
+    std::atomic<int> m_active;
+    std::atomic<int> m_writing[2];
 };
 
 /**
@@ -149,17 +197,48 @@ public:
     GlobalStats();
     static GlobalStats& Instance();
 
-    SiteStats& GetStats(const std::string& username, const std::string& host);
+    // Record a finished connection - constant work, touching only the calling thread's shard
+    void Record(const std::string& username, const std::string& host, const SiteCounters& counters);
+
+    // Start the thread that merges the shards every m_foldFrequency seconds, and
+    // logs each period's stats as it ends - whether or not the event loop is idle
+    void Start();
+
+    // Merge the per-thread shards into the totals
+    void Fold();
+
+    // Keep an approximate summary of each user's topHosts busiest hosts, instead of
+    // exact stats for every host; 0 to keep exact stats
+    void SetApproximate(std::size_t topHosts);
+
     void DumpUserStats(const std::string& username);
+
+    // Hand the period's stats to the AuditWriter and start a new period
     void LogAndReset();
 
     bool ReadyToLog();
 
 private:
+    using LockGuard = std::unique_lock<std::mutex>;
+
+    StatShard& LocalShard();
+    void Fold_i();
+    void FoldMain();
+
     static constexpr auto m_logFrequency = 3600 * 24; // seconds
     static constexpr auto m_logPersistence = 30;
+    static constexpr auto m_foldFrequency = 10; // seconds
+
+    // In approximate mode, a shard holding more hosts than this is merged early
+    static constexpr std::size_t m_shardHostLimit = 4096;
+
+    // Shards are registered once per thread and never removed
+    std::mutex m_lock;
+    std::vector<StatShard*> m_shards;
 
-    std::list<UserStats> m_userStats;
-    int m_logIndex;
+    std::unordered_map<std::string, UserStats> m_userStats;
+    std::size_t m_topHosts;
+    int m_logNumber;
     std::uint64_t m_lastLogTime;
+    std::uint64_t m_periodStart; // Unix time (s)
 };
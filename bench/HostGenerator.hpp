@@ -0,0 +1,76 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The HostGenerator class produces host names shaped like those on
+ * ad/tracker lists, from a fixed seed so that benchmark inputs repeat exactly.
+ */
+class HostGenerator {
+public:
+    HostGenerator(std::uint32_t seed)
+        : m_rng{seed}
+    {}
+
+    // Replace host with the next name in the sequence
+    void Next(std::string& host) {
+        static const char* tlds[] = { "com", "net", "org", "io", "co.uk", "de" };
+        host.clear();
+        auto labels = 1 + (m_rng() % 3);
+        for (auto label = 0u; label < labels; label++) {
+            auto length = 3 + (m_rng() % 10);
+            for (auto c = 0u; c < length; c++) {
+                host += static_cast<char>('a' + (m_rng() % 26));
+            }
+            host += '.';
+        }
+        host += tlds[m_rng() % (sizeof(tlds) / sizeof(tlds[0]))];
+    }
+
+    static std::vector<std::string> Generate(std::size_t count, std::uint32_t seed) {
+        auto generator = HostGenerator{seed};
+        auto hosts = std::vector<std::string>(count);
+        for (auto& host : hosts) {
+            generator.Next(host);
+        }
+        return hosts;
+    }
+
+private:
+    std::mt19937 m_rng;
+};
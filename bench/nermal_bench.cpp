@@ -0,0 +1,329 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// nermal_bench - microbenchmarks for the proxy's core data structures and parsers.
+//
+// Usage: nermal_bench [-r runs] [filter]
+//
+// Each benchmark is run several times (5 by default) and the median reported,
+// as nanoseconds and heap allocations (operator new) per operation.  Inputs are
+// generated from a fixed seed, so runs are comparable between builds.  Only
+// benchmarks whose name contains the filter are run.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../AllocHook.hpp"
+#include "../BlackList.hpp"
+#include "../ConfigFile.hpp"
+#include "../HostInfoManager.hpp"
+#include "../Log.hpp"
+#include "../ProxyConnector.hpp"
+#include "../TimeMap.hpp"
+#include "../Timestamp.hpp"
+#include "../UserAuth.hpp"
+#include "HostGenerator.hpp"
+
+namespace {
+
+auto g_runs = 5;
+const char* g_filter = nullptr;
+
+// Results are folded in here so the work being measured can't be optimized away
+volatile std::uint64_t g_sink;
+
+// Base64 encoding, for building credentials to decode
+std::string base64Encode(const std::string& source) {
+    static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    auto encoded = std::string{};
+    auto i = std::size_t{0};
+    for (; (i + 2) < source.size(); i += 3) {
+        auto bits = (std::uint8_t(source[i]) << 16) | (std::uint8_t(source[i + 1]) << 8) | std::uint8_t(source[i + 2]);
+        encoded += alphabet[(bits >> 18) & 0x3f];
+        encoded += alphabet[(bits >> 12) & 0x3f];
+        encoded += alphabet[(bits >> 6) & 0x3f];
+        encoded += alphabet[bits & 0x3f];
+    }
+    if (i < source.size()) {
+        auto bits = std::uint8_t(source[i]) << 16;
+        if ((i + 1) < source.size()) {
+            bits |= std::uint8_t(source[i + 1]) << 8;
+        }
+        encoded += alphabet[(bits >> 18) & 0x3f];
+        encoded += alphabet[(bits >> 12) & 0x3f];
+        encoded += ((i + 1) < source.size()) ? alphabet[(bits >> 6) & 0x3f] : '=';
+        encoded += '=';
+    }
+    return encoded;
+}
+
+// Write lines to a temporary file, returning its path
+std::string writeTempFile(const std::vector<std::string>& lines) {
+    char path[] = "/tmp/nermal_bench.XXXXXX";
+    auto fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    auto* file = fdopen(fd, "w");
+    for (auto& line : lines) {
+        fprintf(file, "%s\n", line.c_str());
+    }
+    fclose(file);
+    return path;
+}
+
+// Run fn(thread, iteration) for the given iterations on each thread, and report the
+// median time and allocations per operation over the runs.
+template<typename Fn>
+void bench(const char* name, int threads, std::size_t iterations, Fn fn) {
+    if (g_filter && !strstr(name, g_filter)) {
+        return;
+    }
+
+    auto nsPerOp = std::vector<double>{};
+    auto allocsPerOp = std::vector<double>{};
+    for (auto run = -1; run < g_runs; run++) {
+        auto allocs = AllocCount();
+        auto start = std::chrono::steady_clock::now();
+        if (threads == 1) {
+            for (auto i = std::size_t{0}; i < iterations; i++) {
+                fn(0, i);
+            }
+        } else {
+            auto workers = std::vector<std::thread>{};
+            for (auto thread = 0; thread < threads; thread++) {
+                workers.emplace_back([&fn, thread, iterations]() {
+                    for (auto i = std::size_t{0}; i < iterations; i++) {
+                        fn(thread, i);
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        // The first run only warms the caches
+        if (run >= 0) {
+            auto ops = static_cast<double>(iterations) * threads;
+            nsPerOp.push_back(elapsed / ops);
+            allocsPerOp.push_back((AllocCount() - allocs) / ops);
+        }
+    }
+    std::sort(nsPerOp.begin(), nsPerOp.end());
+    std::sort(allocsPerOp.begin(), allocsPerOp.end());
+    printf("%-44s %7d %12.1f %11.2f\n", name, threads, nsPerOp[nsPerOp.size() / 2],
+           allocsPerOp[allocsPerOp.size() / 2]);
+}
+
+void benchBlacklist() {
+    // Hosts are looked up as they come in requests - most aren't on the list
+    auto listed = HostGenerator::Generate(100000, 1);
+    auto path = writeTempFile(listed);
+    auto lookups = HostGenerator::Generate(4096, 2);
+    for (auto i = std::size_t{0}; i < lookups.size(); i += 8) {
+        lookups[i] = listed[(i * 7919) % listed.size()];
+    }
+
+    auto list = std::unique_ptr<Blacklist>(new Blacklist("ads"));
+    list->LoadFromFile(path);
+    bench("blacklist/IsHostAllowed/100k", 1, 1000000, [&](int, std::size_t i) {
+        g_sink += list->IsHostAllowed(lookups[i % lookups.size()]);
+    });
+
+    bench("blacklist/LoadFromFile/100k", 1, 3, [&](int, std::size_t) {
+        auto loaded = Blacklist("load");
+        g_sink += loaded.LoadFromFile(path);
+    });
+
+    // Requests are checked against each list a user is subject to, in turn
+    static const char* names[] = { "ads", "malware", "tracking", "adult" };
+    for (auto n = 0u; n < (sizeof(names) / sizeof(names[0])); n++) {
+        auto added = std::unique_ptr<Blacklist>(new Blacklist(names[n]));
+        added->LoadFromFile(path);
+        BlacklistList::Instance().AddList(std::move(added));
+    }
+    bench("blacklist/IsAllowedInList/4x100k", 1, 250000, [&](int, std::size_t i) {
+        auto& host = lookups[i % lookups.size()];
+        for (auto* name : names) {
+            g_sink += BlacklistList::Instance().IsAllowedInList(name, host);
+        }
+    });
+    unlink(path.c_str());
+}
+
+void benchAuth() {
+    for (auto i = 0; i < 50; i++) {
+        AuthManager::Instance().AddUser("user" + std::to_string(i), "password" + std::to_string(i));
+    }
+    AuthManager::Instance().SetEnabled(true);
+
+    auto lastUser = base64Encode("user49:password49");
+    auto badPassword = base64Encode("user49:wrong");
+    bench("auth/Base64Decode", 1, 1000000, [&](int, std::size_t) {
+        std::uint8_t decoded[256];
+        auto size = std::size_t{};
+        g_sink += AuthManager::Base64Decode(lastUser.c_str(), decoded, sizeof(decoded), size);
+    });
+    bench("auth/Authenticate/50-users", 1, 1000000, [&](int, std::size_t) {
+        const std::string* username = nullptr;
+        g_sink += AuthManager::Instance().Authenticate(lastUser.c_str(), username);
+    });
+    bench("auth/Authenticate/50-users-rejected", 1, 1000000, [&](int, std::size_t) {
+        const std::string* username = nullptr;
+        g_sink += AuthManager::Instance().Authenticate(badPassword.c_str(), username);
+    });
+}
+
+void benchHostInfoCache() {
+    auto cache = HostInfoCache{};
+    auto hosts = HostGenerator::Generate(1000, 3);
+    for (auto i = std::size_t{0}; i < hosts.size(); i++) {
+        auto info = HostInfo{};
+        info.url = hosts[i];
+        info.address = "10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+        info.ipVersion = 4;
+        info.Timestamp = Timestamp();
+        cache.AddResult(info);
+    }
+
+    // Each pool thread looks hosts up into its own reused vector
+    auto maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    for (auto threads = 1u; threads <= maxThreads; threads *= 2) {
+        auto results = std::vector<std::vector<HostInfo>>(threads);
+        bench("hostinfo/GetCachedResults/1k", threads, 20000, [&](int thread, std::size_t i) {
+            cache.GetCachedResults(hosts[((i * 31) + thread) % hosts.size()], results[thread]);
+            g_sink += results[thread].size();
+        });
+    }
+}
+
+void benchConfig() {
+    auto lines = std::vector<std::string>{};
+    lines.push_back("[Global]");
+    lines.push_back("# Generated for nermal_bench");
+    lines.push_back("port:10080");
+    lines.push_back("auth:enabled");
+    lines.push_back("audit:enabled");
+    lines.push_back("log_verbosity:info");
+    for (auto i = 0; i < 200; i++) {
+        lines.push_back("[user" + std::to_string(i) + "]");
+        lines.push_back("password:password" + std::to_string(i));
+        lines.push_back("ip:10.0.0." + std::to_string(i));
+        lines.push_back("audit:enabled");
+        lines.push_back("time_based_policy:enabled");
+        lines.push_back("sunday:xxxxxxxxxxxxxxxxoooooooooooooooooooooooooooooooo");
+        lines.push_back("monday:xxxxxxxxxxxxxxxxoooooooooooooooooooooooooooooooo");
+    }
+    auto path = writeTempFile(lines);
+    bench("config/LoadData/200-users", 1, 50, [&](int, std::size_t) {
+        auto config = ConfigFile{path};
+        config.LoadData();
+        g_sink += config.GetSection("user199").GetAttribute("password").GetCount();
+    });
+    unlink(path.c_str());
+}
+
+void benchTimeMap() {
+    auto map = TimeMap{};
+    map.InitFromString("xxxxxxxxxxxxxxxxooooooooooooooooooooooooooooooxx");
+    bench("timemap/PermittedAtTime", 1, 10000000, [&](int, std::size_t i) {
+        g_sink += map.PermittedAtTime((i / 60) % 24, i % 60);
+    });
+}
+
+void benchRequestHead() {
+    static const char* connect =
+            "CONNECT www.example.com:443 HTTP/1.1\r\n"
+            "Host: www.example.com:443\r\n"
+            "Proxy-Connection: keep-alive\r\n"
+            "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)\r\n"
+            "\r\n";
+    static const char* get =
+            "GET http://www.example.com/images/logo.png?v=3 HTTP/1.1\r\n"
+            "Host: www.example.com\r\n"
+            "Proxy-Connection: keep-alive\r\n"
+            "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)\r\n"
+            "Accept: image/avif,image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+            "Accept-Encoding: gzip, deflate\r\n"
+            "\r\n";
+    bench("request/ParseRequestHead/connect", 1, 1000000, [&](int, std::size_t) {
+        auto head = RequestHead{};
+        g_sink += ProxyConnector::ParseRequestHead(connect, head) + head.port;
+    });
+    bench("request/ParseRequestHead/get", 1, 1000000, [&](int, std::size_t) {
+        auto head = RequestHead{};
+        g_sink += ProxyConnector::ParseRequestHead(get, head) + head.port;
+    });
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    auto opt = int{};
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            g_runs = std::max(1, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r runs] [filter]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        g_filter = argv[optind];
+    }
+
+    LogSetVerbosity(LogSeverity::Error);
+    if (!AllocHookEnabled()) {
+        fprintf(stderr, "Allocation counting isn't built in - allocs/op will read 0\n");
+    }
+
+    printf("%-44s %7s %12s %11s\n", "benchmark", "threads", "ns/op", "allocs/op");
+    benchBlacklist();
+    benchAuth();
+    benchHostInfoCache();
+    benchConfig();
+    benchTimeMap();
+    benchRequestHead();
+    return 0;
+}
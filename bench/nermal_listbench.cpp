@@ -0,0 +1,325 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// nermal_listbench - startup time and memory of loading blacklists.
+//
+// Usage: nermal_listbench [-s sizes] [-t total] [-d dir] [-k]
+//
+//   -s  list sizes to load one at a time, to show scaling, e.g. 100k,1M,5M,20M
+//       (the default), or "none"
+//   -t  domains in total across 19 lists named as in default.conf, loaded
+//       together as the proxy does at startup (default 2M), or 0 to skip
+//   -d  directory for the generated lists (default /tmp)
+//   -k  keep the generated lists
+//
+// Each list is generated from a fixed seed and loaded through
+// Blacklist::LoadFromFile.  Reports load time, the peak and steady increase in
+// RSS, and lookup latency (mean over a batch, p99 of individually timed lookups,
+// one in eight a hit), per list and in total.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <malloc.h>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../BlackList.hpp"
+#include "../Log.hpp"
+#include "HostGenerator.hpp"
+
+namespace {
+
+// The lists in default.conf, and their rough share of the domains
+typedef struct {
+    const char* name;
+    unsigned weight;
+} ListShare;
+
+const ListShare defaultLists[] = {
+    { "ads", 120 }, { "crypto", 5 }, { "drugs", 8 }, { "fakenews", 6 }, { "fraud", 40 }, { "gambling", 60 },
+    { "malware", 150 }, { "phishing", 120 }, { "piracy", 20 }, { "porn", 250 }, { "proxy", 30 },
+    { "ransomware", 5 }, { "redirect", 20 }, { "scam", 60 }, { "spam", 30 }, { "torrent", 10 },
+    { "tracking", 50 }, { "facebook", 3 }, { "youtube", 3 },
+};
+
+typedef struct {
+    double loadMs;
+    long peakKb;        // Increase in peak RSS while loading
+    long steadyKb;      // Increase in RSS once loaded
+    double meanNs;
+    double p99Ns;
+} ListResult;
+
+volatile std::uint64_t g_sink;
+
+// Read a field (in kB) from /proc/self/status
+long statusKb(const char* field) {
+    auto* file = fopen("/proc/self/status", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[256];
+    auto value = 0L;
+    auto length = strlen(field);
+    while (fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, field, length)) {
+            value = strtol(line + length, nullptr, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+// Restart peak RSS tracking from the current RSS
+void resetPeakRss() {
+    auto fd = ::open("/proc/self/clear_refs", O_WRONLY);
+    if (fd != -1) {
+        auto rc = ::write(fd, "5", 1);
+        (void)rc;
+        ::close(fd);
+    }
+}
+
+std::size_t parseCount(const char* text) {
+    char* end = nullptr;
+    auto value = strtod(text, &end);
+    if (*end == 'k' || *end == 'K') {
+        value *= 1000;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1000 * 1000;
+    }
+    return static_cast<std::size_t>(value);
+}
+
+// Write a list of generated hosts, streaming so that huge lists don't need the memory
+std::string writeList(const std::string& dir, const char* name, std::size_t count, std::uint32_t seed) {
+    auto path = dir + "/nermal_listbench." + name + ".list";
+    auto* file = fopen(path.c_str(), "w");
+    if (!file) {
+        perror(path.c_str());
+        exit(1);
+    }
+    auto generator = HostGenerator{seed};
+    auto host = std::string{};
+    for (auto i = std::size_t{0}; i < count; i++) {
+        generator.Next(host);
+        fprintf(file, "%s\n", host.c_str());
+    }
+    fclose(file);
+    return path;
+}
+
+// Hosts to look up - one in eight from the list (by regenerating its sequence)
+std::vector<std::string> makeLookups(std::size_t listSize, std::uint32_t seed) {
+    constexpr auto lookupCount = std::size_t{65536};
+    auto lookups = HostGenerator::Generate(lookupCount, seed ^ 0x5a5a5a5a);
+    auto generator = HostGenerator{seed};
+    auto stride = std::max<std::size_t>(1, listSize / (lookupCount / 8));
+    auto host = std::string{};
+    for (auto i = std::size_t{0}, listed = std::size_t{0}; (i < lookupCount) && (listed < listSize); i += 8) {
+        for (auto skip = std::size_t{0}; (skip < stride) && (listed < listSize); skip++, listed++) {
+            generator.Next(host);
+        }
+        lookups[i] = host;
+    }
+    return lookups;
+}
+
+template<typename Lookup>
+void measureLookups(const std::vector<std::string>& lookups, Lookup lookup, ListResult& result) {
+    constexpr auto batch = std::size_t{1000000};
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = std::size_t{0}; i < batch; i++) {
+        g_sink += lookup(lookups[i % lookups.size()]);
+    }
+    result.meanNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / batch;
+
+    auto samples = std::vector<double>(lookups.size());
+    for (auto i = std::size_t{0}; i < lookups.size(); i++) {
+        auto sampleStart = std::chrono::steady_clock::now();
+        g_sink += lookup(lookups[i]);
+        samples[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - sampleStart).count();
+    }
+    std::sort(samples.begin(), samples.end());
+    result.p99Ns = samples[(samples.size() * 99) / 100];
+}
+
+// Load a list, measuring the time and memory it takes
+std::unique_ptr<Blacklist> loadList(const char* name, const std::string& path, ListResult& result) {
+    malloc_trim(0);
+    auto rssBefore = statusKb("VmRSS:");
+    resetPeakRss();
+
+    auto list = std::unique_ptr<Blacklist>(new Blacklist(name));
+    auto start = std::chrono::steady_clock::now();
+    list->LoadFromFile(path);
+    result.loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    result.peakKb = statusKb("VmHWM:") - rssBefore;
+    result.steadyKb = statusKb("VmRSS:") - rssBefore;
+    return list;
+}
+
+void printHeader(const char* first) {
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", first, "domains", "load ms", "peak MB", "steady MB", "mean ns", "p99 ns");
+}
+
+void printResult(const char* name, std::size_t domains, const ListResult& result) {
+    printf("%-12s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, domains, result.loadMs,
+           result.peakKb / 1024.0, result.steadyKb / 1024.0, result.meanNs, result.p99Ns);
+}
+
+void runScaling(const std::vector<std::size_t>& sizes, const std::string& dir, bool keep) {
+    printf("Lists loaded one at a time:\n");
+    printHeader("list");
+    for (auto size : sizes) {
+        char name[32];
+        snprintf(name, sizeof(name), "scale%zu", size);
+        auto seed = static_cast<std::uint32_t>(size);
+        auto path = writeList(dir, name, size, seed);
+
+        auto result = ListResult{};
+        auto list = loadList(name, path, result);
+        auto lookups = makeLookups(size, seed);
+        measureLookups(lookups, [&list](const std::string& host) { return list->IsHostAllowed(host); }, result);
+        printResult(name, size, result);
+
+        if (!keep) {
+            unlink(path.c_str());
+        }
+    }
+    printf("\n");
+}
+
+void runDefaultLists(std::size_t total, const std::string& dir, bool keep) {
+    auto weights = 0u;
+    for (auto& share : defaultLists) {
+        weights += share.weight;
+    }
+
+    printf("Lists from default.conf, %zu domains in total, loaded together:\n", total);
+    printHeader("list");
+    auto paths = std::vector<std::string>{};
+    auto totals = ListResult{};
+    malloc_trim(0);
+    auto rssBefore = statusKb("VmRSS:");
+    auto peakKb = 0L;  // Highest RSS seen while loading
+    auto allLookups = std::vector<std::string>{};
+    auto seed = std::uint32_t{1};
+    for (auto& share : defaultLists) {
+        auto size = std::max<std::size_t>(1, (total * share.weight) / weights);
+        auto path = writeList(dir, share.name, size, seed);
+        paths.push_back(path);
+
+        auto result = ListResult{};
+        auto list = loadList(share.name, path, result);
+        peakKb = std::max(peakKb, statusKb("VmHWM:"));
+        auto lookups = makeLookups(size, seed);
+        auto* raw = list.get();
+        measureLookups(lookups, [raw](const std::string& host) { return raw->IsHostAllowed(host); }, result);
+        BlacklistList::Instance().AddList(std::move(list));
+        printResult(share.name, size, result);
+
+        totals.loadMs += result.loadMs;
+        allLookups.insert(allLookups.end(), lookups.begin(), lookups.begin() + (lookups.size() / 16));
+        seed++;
+    }
+
+    // A request is checked against every list in turn
+    totals.steadyKb = statusKb("VmRSS:") - rssBefore;
+    totals.peakKb = std::max(peakKb - rssBefore, totals.steadyKb);
+    measureLookups(allLookups, [](const std::string& host) {
+        auto allowed = true;
+        for (auto& share : defaultLists) {
+            allowed &= BlacklistList::Instance().IsAllowedInList(share.name, host);
+        }
+        return allowed;
+    }, totals);
+    printResult("total", total, totals);
+
+    if (!keep) {
+        for (auto& path : paths) {
+            unlink(path.c_str());
+        }
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    auto sizes = std::vector<std::size_t>{ 100000, 1000000, 5000000, 20000000 };
+    auto total = std::size_t{2000000};
+    auto dir = std::string{"/tmp"};
+    auto keep = false;
+
+    auto opt = int{};
+    while ((opt = getopt(argc, argv, "s:t:d:k")) != -1) {
+        switch (opt) {
+        case 's':
+            sizes.clear();
+            if (strcmp(optarg, "none")) {
+                for (auto* size = strtok(optarg, ","); size; size = strtok(nullptr, ",")) {
+                    sizes.push_back(parseCount(size));
+                }
+            }
+            break;
+        case 't':
+            total = parseCount(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'k':
+            keep = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s sizes|none] [-t total] [-d dir] [-k]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    LogSetVerbosity(LogSeverity::Error);
+    if (!sizes.empty()) {
+        runScaling(sizes, dir, keep);
+    }
+    if (total) {
+        runDefaultLists(total, dir, keep);
+    }
+    return 0;
+}
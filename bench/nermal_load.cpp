@@ -0,0 +1,823 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// nermal_load - end-to-end load test of the proxy on one machine.
+//
+// Usage: nermal_load [-c sessions] [-d seconds] [-w seconds] [-s bytes] [-t ms]
+//                    [-m percent] [-o seconds] [-p port]
+//                    [-f faults] [-n clients] [-l ms]
+//
+//   -c  concurrent client sessions (default 1000)
+//   -d  measured duration (default 10)
+//   -w  warm-up before measuring (default 1)
+//   -s  object size fetched by each session (default 16384)
+//   -t  think time between a client's sessions (default 0)
+//   -m  percentage of sessions that are CONNECT tunnels, the rest GETs (default 50)
+//   -o  session timeout (default 30)
+//   -p  first of five loopback ports used: proxy, HTTP origin, tunnel origin,
+//       stalled origin, blackholed origin (default 28080)
+//   -f  faults injected alongside the normal sessions, comma separated, or "all":
+//         slow-read  clients fetching large objects and reading 10KB/s
+//         stalled    origins which accept connections but never answer
+//         syn-drop   origins whose SYNs are dropped, so connects hang
+//         slow-dns   hosts which take -l ms to resolve
+//   -n  clients injecting each fault (default 50)
+//   -l  resolve time for slow-dns hosts (default 5000)
+//
+// The proxy runs in a child process, configured as it is by default (no auth,
+// no blacklists, no caches), with a stand-in resolver that places every host
+// on this machine.  This process runs the stand-in origins - HTTP for GETs and
+// raw TCP behind CONNECTs - and drives the client sessions from one epoll loop.
+// Reports requests/s, Mbit/s, the proxy's CPU per Gbit relayed and latency
+// percentiles, so releases can be compared without a network.  With faults
+// injected, these figures cover only the normal sessions, showing how well
+// healthy traffic is shielded from the faulty.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../CommandSocket.hpp"
+#include "../FlightRecorder.hpp"
+#include "../IHostResolver.hpp"
+#include "../LatencyHistogram.hpp"
+#include "../Log.hpp"
+#include "../ProxyConnector.hpp"
+#include "../ServerSocket.hpp"
+#include "../SocketManager.hpp"
+#include "../ThreadPool.hpp"
+#include "../Timestamp.hpp"
+
+namespace {
+
+// Adverse conditions that sessions can be subjected to
+enum class Fault : std::uint8_t {
+    None,
+    SlowRead,
+    Stalled,
+    SynDrop,
+    SlowDns,
+    NumFaults
+};
+
+const char* faultNames[] = { "none", "slow-read", "stalled", "syn-drop", "slow-dns" };
+static_assert(sizeof(faultNames) / sizeof(faultNames[0]) == static_cast<int>(Fault::NumFaults), "Missing fault name");
+
+typedef struct {
+    int sessions;
+    int duration;       // s
+    int warmup;         // s
+    std::size_t objectSize;
+    int thinkTime;      // ms
+    int connectPercent;
+    int timeout;        // s
+    std::uint16_t proxyPort;
+    std::uint16_t httpPort;
+    std::uint16_t tunnelPort;
+    std::uint16_t stalledPort;
+    std::uint16_t blackholePort;
+    bool faults[static_cast<int>(Fault::NumFaults)];
+    int faultClients;
+    int dnsDelay;       // ms
+} LoadOptions;
+
+const char* originHost = "origin.test";
+const char* slowDnsHost = "slowdns.test";
+
+// Slow readers fetch objects large enough to still be reading at the timeout
+constexpr auto slowReadSize = std::size_t{64} * 1024 * 1024;
+constexpr auto slowReadChunk = std::size_t{1024};     // per 100ms
+
+/**
+ * @brief The StaticResolver class stands in for DNS, placing every host on
+ * this machine.  The slow-dns host takes a while to resolve.
+ */
+class StaticResolver : public IHostResolver {
+public:
+    StaticResolver(int slowDelay)
+        : m_slowDelay{slowDelay}
+    {}
+
+    bool GetAddressesForHost(const std::string& host, const std::uint16_t /*port*/, std::vector<HostInfo>& results, bool& cached) override {
+        if (host == slowDnsHost) {
+            usleep(m_slowDelay * 1000);
+        }
+        results.resize(1);
+        results[0].url = host;
+        results[0].address = "127.0.0.1";
+        results[0].ipVersion = 4;
+        results[0].Timestamp = Timestamp();
+        cached = true;
+        return true;
+    }
+
+    void ClearCacheForHost(const std::string& /*host*/) override {}
+
+private:
+    int m_slowDelay;    // ms
+};
+
+// Run the proxy in this (child) process until it's killed
+[[noreturn]] void runProxy(const LoadOptions& options) {
+    LogSetVerbosity(LogSeverity::Error);
+    signal(SIGPIPE, SIG_IGN);
+    FlightRecorder::Instance().SetCapacity(1024);
+    ThreadPool::Instance().Start();
+
+    static auto resolver = StaticResolver{options.dnsDelay};
+    auto socketManager = std::make_unique<SocketManager>(std::make_unique<ProxyConnector>(resolver));
+    auto server = std::make_unique<ServerSocket>();
+    if (!socketManager->Initialize() || !server->Initialize(options.proxyPort)) {
+        fprintf(stderr, "Unable to start the proxy on port %d\n", options.proxyPort);
+        _exit(1);
+    }
+    socketManager->AddSocket(std::move(server));
+    socketManager->AddSocket(std::make_unique<CommandSocket>());
+
+    while (socketManager->ProcessSockets()) {
+    }
+    _exit(1);
+}
+
+int listenOn(std::uint16_t port, int backlog) {
+    auto fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    auto enable = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    auto address = sockaddr_in{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) || (::listen(fd, backlog) < 0)) {
+        fprintf(stderr, "Unable to listen on port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+// How a stand-in origin treats its connections
+enum class OriginMode { Http, Tunnel, Stalled };
+
+/**
+ * @brief The Origin class is a stand-in server.  An HTTP origin answers
+ * "GET .../<size>" with that many bytes; a tunnel origin reads "<size>\n" and
+ * sends that many bytes back.  Either closes the connection when done.  A
+ * stalled origin accepts connections and does nothing more.
+ */
+class Origin {
+public:
+    Origin(std::uint16_t port, OriginMode mode)
+        : m_listenFd{listenOn(port, 4096)}
+        , m_mode{mode}
+        , m_running{true}
+    {}
+
+    void Start() {
+        m_thread = std::thread([this]() { Run(); });
+    }
+
+    void Stop() {
+        m_running = false;
+        m_thread.join();
+    }
+
+private:
+    typedef struct {
+        std::string request;
+        std::string header;
+        std::size_t remaining;  // Body bytes still to send
+        bool responding;
+    } Connection;
+
+    void Run() {
+        auto epollFd = epoll_create1(EPOLL_CLOEXEC);
+        auto event = epoll_event{};
+        event.events = EPOLLIN;
+        event.data.fd = m_listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, m_listenFd, &event);
+
+        epoll_event events[256];
+        while (m_running) {
+            auto count = epoll_wait(epollFd, events, 256, 100);
+            for (auto i = 0; i < count; i++) {
+                auto fd = events[i].data.fd;
+                if (fd == m_listenFd) {
+                    Accept(epollFd);
+                } else if (!Service(fd)) {
+                    ::close(fd);
+                    m_connections[fd].reset();
+                }
+            }
+        }
+        ::close(epollFd);
+    }
+
+    void Accept(int epollFd) {
+        auto fd = int{};
+        while ((fd = ::accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            if (static_cast<std::size_t>(fd) >= m_connections.size()) {
+                m_connections.resize(fd + 1);
+            }
+            m_connections[fd].reset(new Connection{});
+            auto event = epoll_event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+    // Returns false once the connection is finished with
+    bool Service(int fd) {
+        auto& connection = *m_connections[fd];
+        if (m_mode == OriginMode::Stalled) {
+            return true;
+        }
+        if (!connection.responding) {
+            char buf[4096];
+            auto rc = ::read(fd, buf, sizeof(buf));
+            if (rc <= 0) {
+                return (rc == -1) && (errno == EAGAIN);
+            }
+            connection.request.append(buf, rc);
+            if (!ParseRequest(connection)) {
+                return true;
+            }
+            connection.responding = true;
+        }
+
+        while (!connection.header.empty()) {
+            auto rc = ::write(fd, connection.header.data(), connection.header.size());
+            if (rc <= 0) {
+                return (rc == -1) && (errno == EAGAIN);
+            }
+            connection.header.erase(0, rc);
+        }
+        static char body[65536];
+        while (connection.remaining) {
+            auto rc = ::write(fd, body, std::min(sizeof(body), connection.remaining));
+            if (rc <= 0) {
+                return (rc == -1) && (errno == EAGAIN);
+            }
+            connection.remaining -= rc;
+        }
+        return false;
+    }
+
+    // Returns true once the whole request has arrived
+    bool ParseRequest(Connection& connection) {
+        if (m_mode == OriginMode::Tunnel) {
+            if (connection.request.find('\n') == std::string::npos) {
+                return false;
+            }
+            connection.remaining = strtoul(connection.request.c_str(), nullptr, 10);
+            return true;
+        }
+
+        if (connection.request.find("\r\n\r\n") == std::string::npos) {
+            return false;
+        }
+        auto pathEnd = connection.request.find(" HTTP/");
+        auto sizeStart = connection.request.rfind('/', pathEnd);
+        connection.remaining = strtoul(connection.request.c_str() + sizeStart + 1, nullptr, 10);
+        connection.header = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                            std::to_string(connection.remaining) + "\r\nConnection: close\r\n\r\n";
+        return true;
+    }
+
+    int m_listenFd;
+    OriginMode m_mode;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+    std::vector<std::unique_ptr<Connection>> m_connections;
+};
+
+/**
+ * @brief The LoadDriver class runs client sessions through the proxy from a
+ * single epoll loop, each client starting a new session when the last ends.
+ * Clients injecting a fault run alongside the normal ones, and are counted
+ * separately.
+ */
+class LoadDriver {
+public:
+    typedef struct {
+        std::uint64_t completed;
+        std::uint64_t errors;
+        std::uint64_t timeouts;
+        std::uint64_t bytes;
+    } SessionStats;
+
+    LoadDriver(const LoadOptions& options);
+
+    void Run(std::uint64_t warmupUs, std::uint64_t durationUs);
+
+    const SessionStats& GetStats(Fault fault) const { return m_stats[static_cast<int>(fault)]; }
+    const LatencyHistogram& GetLatency(bool tunnel) const { return tunnel ? m_tunnelLatency : m_getLatency; }
+
+private:
+    enum class State { Idle, Sending, AwaitingTunnel, Receiving };
+    enum class Outcome { Completed, Failed, TimedOut };
+
+    typedef struct {
+        int fd;
+        Fault fault;
+        State state;
+        bool tunnel;
+        std::uint64_t start;    // us
+        std::uint64_t wake;     // us, when thinking
+        std::string out;
+        std::size_t sent;
+        std::string reply;      // Proxy's answer to a CONNECT
+        std::size_t received;
+        std::size_t expected;
+    } Client;
+
+    void StartSession(std::size_t index);
+    void EndSession(std::size_t index, Outcome outcome);
+    void Service(std::size_t index);
+    void ReadSlowly(std::size_t index);
+    bool Flush(Client& client);
+
+    LoadOptions m_options;
+    int m_epollFd;
+    std::vector<Client> m_clients;
+    std::deque<std::size_t> m_thinking;
+    std::uint64_t m_sessionCount;
+
+    bool m_measuring;
+    SessionStats m_stats[static_cast<int>(Fault::NumFaults)];
+    LatencyHistogram m_getLatency;
+    LatencyHistogram m_tunnelLatency;
+};
+
+LoadDriver::LoadDriver(const LoadOptions& options)
+    : m_options(options)
+    , m_epollFd{epoll_create1(EPOLL_CLOEXEC)}
+    , m_sessionCount{0}
+    , m_measuring{false}
+{
+    for (auto& stats : m_stats) {
+        stats = SessionStats{};
+    }
+
+    auto client = Client{};
+    client.fd = -1;
+    client.state = State::Idle;
+    m_clients.resize(options.sessions, client);
+    for (auto i = static_cast<int>(Fault::None) + 1; i < static_cast<int>(Fault::NumFaults); i++) {
+        if (options.faults[i]) {
+            client.fault = static_cast<Fault>(i);
+            m_clients.resize(m_clients.size() + options.faultClients, client);
+        }
+    }
+}
+
+void LoadDriver::Run(std::uint64_t warmupUs, std::uint64_t durationUs) {
+    auto start = TimestampUs();
+    for (auto i = std::size_t{0}; i < m_clients.size(); i++) {
+        StartSession(i);
+    }
+
+    epoll_event events[512];
+    auto lastSweep = start;
+    while (true) {
+        auto now = TimestampUs();
+        if (!m_measuring && (now - start) >= warmupUs) {
+            m_measuring = true;
+        }
+        if ((now - start) >= (warmupUs + durationUs)) {
+            break;
+        }
+
+        auto count = epoll_wait(m_epollFd, events, 512, 10);
+        for (auto i = 0; i < count; i++) {
+            Service(events[i].data.u64);
+        }
+
+        // Clients that have finished thinking start their next session
+        now = TimestampUs();
+        while (!m_thinking.empty() && (m_clients[m_thinking.front()].wake <= now)) {
+            auto index = m_thinking.front();
+            m_thinking.pop_front();
+            StartSession(index);
+        }
+
+        if ((now - lastSweep) > 100 * 1000) {
+            lastSweep = now;
+            auto timeout = std::uint64_t(m_options.timeout) * 1000 * 1000;
+            for (auto i = std::size_t{0}; i < m_clients.size(); i++) {
+                auto& client = m_clients[i];
+                if (client.state == State::Idle) {
+                    continue;
+                }
+                if ((client.start < now) && ((now - client.start) > timeout)) {
+                    EndSession(i, Outcome::TimedOut);
+                } else if ((client.fault == Fault::SlowRead) && (client.state == State::Receiving)) {
+                    ReadSlowly(i);
+                }
+            }
+        }
+    }
+
+    for (auto& client : m_clients) {
+        if (client.fd != -1) {
+            ::close(client.fd);
+        }
+    }
+}
+
+void LoadDriver::StartSession(std::size_t index) {
+    auto& client = m_clients[index];
+    client.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    auto address = sockaddr_in{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(m_options.proxyPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((::connect(client.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) && (errno != EINPROGRESS)) {
+        m_stats[static_cast<int>(client.fault)].errors += m_measuring;
+        ::close(client.fd);
+        client.fd = -1;
+        client.state = State::Idle;
+        client.wake = TimestampUs() + 10 * 1000;
+        m_thinking.push_back(index);
+        return;
+    }
+
+    client.start = TimestampUs();
+    client.sent = 0;
+    client.received = 0;
+    client.expected = m_options.objectSize;
+    client.reply.clear();
+
+    // Normal sessions alternate between the kinds in the requested proportion.  Faulty
+    // sessions are all GETs, to the host or origin that misbehaves.
+    auto host = originHost;
+    auto port = m_options.httpPort;
+    client.tunnel = false;
+    switch (client.fault) {
+    case Fault::None:
+        client.tunnel = ((m_sessionCount++ * 37) % 100) < static_cast<std::uint64_t>(m_options.connectPercent);
+        break;
+    case Fault::SlowRead:
+        client.expected = slowReadSize;
+        break;
+    case Fault::Stalled:
+        port = m_options.stalledPort;
+        break;
+    case Fault::SynDrop:
+        port = m_options.blackholePort;
+        break;
+    case Fault::SlowDns:
+        host = slowDnsHost;
+        break;
+    default:
+        break;
+    }
+
+    char request[256];
+    if (client.tunnel) {
+        snprintf(request, sizeof(request), "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
+                 host, m_options.tunnelPort, host, m_options.tunnelPort);
+    } else {
+        snprintf(request, sizeof(request), "GET http://%s:%d/objects/%zu HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
+                 host, port, client.expected, host, port);
+    }
+    client.out = request;
+    client.state = State::Sending;
+
+    auto event = epoll_event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.u64 = index;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, client.fd, &event);
+}
+
+void LoadDriver::EndSession(std::size_t index, Outcome outcome) {
+    auto& client = m_clients[index];
+    ::close(client.fd);
+    client.fd = -1;
+    client.state = State::Idle;
+
+    if (m_measuring) {
+        auto& stats = m_stats[static_cast<int>(client.fault)];
+        if (outcome == Outcome::Completed) {
+            stats.completed++;
+            stats.bytes += client.received;
+            if (client.fault == Fault::None) {
+                (client.tunnel ? m_tunnelLatency : m_getLatency).Record(TimestampUs() - client.start);
+            }
+        } else if (outcome == Outcome::TimedOut) {
+            stats.timeouts++;
+        } else {
+            stats.errors++;
+        }
+    }
+
+    if (m_options.thinkTime) {
+        client.wake = TimestampUs() + std::uint64_t(m_options.thinkTime) * 1000;
+        m_thinking.push_back(index);
+    } else {
+        StartSession(index);
+    }
+}
+
+bool LoadDriver::Flush(Client& client) {
+    while (client.sent < client.out.size()) {
+        auto rc = ::write(client.fd, client.out.data() + client.sent, client.out.size() - client.sent);
+        if (rc <= 0) {
+            return (rc == -1) && (errno == EAGAIN);
+        }
+        client.sent += rc;
+    }
+    return true;
+}
+
+void LoadDriver::Service(std::size_t index) {
+    auto& client = m_clients[index];
+    if (client.state == State::Idle) {
+        return;
+    }
+
+    if (client.state == State::Sending) {
+        if (!Flush(client)) {
+            EndSession(index, Outcome::Failed);
+            return;
+        }
+        if (client.sent < client.out.size()) {
+            return;
+        }
+        client.state = client.tunnel && client.reply.empty() ? State::AwaitingTunnel : State::Receiving;
+    }
+
+    // Slow readers leave the response in the socket, to be read on the sweep
+    if ((client.fault == Fault::SlowRead) && (client.state == State::Receiving)) {
+        return;
+    }
+
+    static char buf[65536];
+    while (true) {
+        auto rc = ::read(client.fd, buf, sizeof(buf));
+        if (rc == -1) {
+            if (errno != EAGAIN) {
+                EndSession(index, Outcome::Failed);
+            }
+            return;
+        }
+        if (rc == 0) {
+            // Servers close once the object is sent; the proxy passes that on
+            EndSession(index, (client.received >= client.expected) ? Outcome::Completed : Outcome::Failed);
+            return;
+        }
+
+        if (client.state == State::AwaitingTunnel) {
+            client.reply.append(buf, rc);
+            if (client.reply.find("\r\n\r\n") == std::string::npos) {
+                continue;
+            }
+            if (client.reply.compare(0, 12, "HTTP/1.0 200") && client.reply.compare(0, 12, "HTTP/1.1 200")) {
+                EndSession(index, Outcome::Failed);
+                return;
+            }
+            // Tunnel is up - ask the origin for the object
+            client.out = std::to_string(client.expected) + "\n";
+            client.sent = 0;
+            client.state = State::Sending;
+            if (!Flush(client)) {
+                EndSession(index, Outcome::Failed);
+                return;
+            }
+            client.state = State::Receiving;
+            if (client.sent < client.out.size()) {
+                client.state = State::Sending;
+                return;
+            }
+            continue;
+        }
+        client.received += rc;
+    }
+}
+
+void LoadDriver::ReadSlowly(std::size_t index) {
+    auto& client = m_clients[index];
+    char buf[slowReadChunk];
+    auto rc = ::read(client.fd, buf, sizeof(buf));
+    if (rc == 0) {
+        EndSession(index, (client.received >= client.expected) ? Outcome::Completed : Outcome::Failed);
+    } else if (rc > 0) {
+        client.received += rc;
+    } else if (errno != EAGAIN) {
+        EndSession(index, Outcome::Failed);
+    }
+}
+
+double processCpuTime(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    auto* file = fopen(path, "r");
+    if (!file) {
+        return 0.0;
+    }
+    auto utime = 0UL;
+    auto stime = 0UL;
+    auto fields = fscanf(file, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(file);
+    return (fields == 2) ? double(utime + stime) / sysconf(_SC_CLK_TCK) : 0.0;
+}
+
+void printLatency(const char* name, const LatencyHistogram& histogram) {
+    auto summary = HistogramSummary{};
+    histogram.Summarize(summary);
+    if (!summary.count) {
+        return;
+    }
+    printf("%-10s %8llu sessions  p50 %8.2fms  p90 %8.2fms  p99 %8.2fms  max %8.2fms\n", name,
+           static_cast<unsigned long long>(summary.count), summary.p50 / 1000.0, summary.p90 / 1000.0, summary.p99 / 1000.0, summary.max / 1000.0);
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-c sessions] [-d seconds] [-w seconds] [-s bytes] [-t ms] [-m percent] [-o seconds] [-p port]\n"
+                    "       [-f slow-read,stalled,syn-drop,slow-dns|all] [-n clients] [-l ms]\n", program);
+}
+
+bool parseFaults(char* list, LoadOptions& options) {
+    for (auto* name = strtok(list, ","); name; name = strtok(nullptr, ",")) {
+        auto found = false;
+        for (auto i = static_cast<int>(Fault::None) + 1; i < static_cast<int>(Fault::NumFaults); i++) {
+            if (!strcmp(name, faultNames[i]) || !strcmp(name, "all")) {
+                options.faults[i] = true;
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown fault: %s\n", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    auto options = LoadOptions{};
+    options.sessions = 1000;
+    options.duration = 10;
+    options.warmup = 1;
+    options.objectSize = 16384;
+    options.thinkTime = 0;
+    options.connectPercent = 50;
+    options.timeout = 30;
+    options.proxyPort = 28080;
+    options.faultClients = 50;
+    options.dnsDelay = 5000;
+
+    auto opt = int{};
+    while ((opt = getopt(argc, argv, "c:d:w:s:t:m:o:p:f:n:l:")) != -1) {
+        switch (opt) {
+        case 'c': options.sessions = std::max(1, atoi(optarg)); break;
+        case 'd': options.duration = std::max(1, atoi(optarg)); break;
+        case 'w': options.warmup = std::max(0, atoi(optarg)); break;
+        case 's': options.objectSize = strtoul(optarg, nullptr, 10); break;
+        case 't': options.thinkTime = std::max(0, atoi(optarg)); break;
+        case 'm': options.connectPercent = std::min(100, std::max(0, atoi(optarg))); break;
+        case 'o': options.timeout = std::max(1, atoi(optarg)); break;
+        case 'p': options.proxyPort = std::uint16_t(atoi(optarg)); break;
+        case 'f':
+            if (!parseFaults(optarg, options)) {
+                return 1;
+            }
+            break;
+        case 'n': options.faultClients = std::max(1, atoi(optarg)); break;
+        case 'l': options.dnsDelay = std::max(0, atoi(optarg)); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    options.httpPort = options.proxyPort + 1;
+    options.tunnelPort = options.proxyPort + 2;
+    options.stalledPort = options.proxyPort + 3;
+    options.blackholePort = options.proxyPort + 4;
+
+    // Each session holds a client and server socket at the proxy, and the same again here
+    auto limit = rlimit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    signal(SIGPIPE, SIG_IGN);
+
+    // The proxy is forked before any threads are started here
+    auto proxyPid = fork();
+    if (proxyPid == 0) {
+        runProxy(options);
+    }
+    if (proxyPid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    auto httpOrigin = Origin{options.httpPort, OriginMode::Http};
+    auto tunnelOrigin = Origin{options.tunnelPort, OriginMode::Tunnel};
+    auto stalledOrigin = Origin{options.stalledPort, OriginMode::Stalled};
+    httpOrigin.Start();
+    tunnelOrigin.Start();
+    stalledOrigin.Start();
+
+    // Never accepting, the blackholed origin's queue soon fills, and further SYNs are dropped
+    auto blackholeFd = listenOn(options.blackholePort, 1);
+    usleep(200 * 1000);
+
+    printf("%d sessions, %zu byte objects, %d%% CONNECT, %dms think time, %ds (+%ds warm-up)\n",
+           options.sessions, options.objectSize, options.connectPercent, options.thinkTime,
+           options.duration, options.warmup);
+    for (auto i = static_cast<int>(Fault::None) + 1; i < static_cast<int>(Fault::NumFaults); i++) {
+        if (options.faults[i]) {
+            printf("injecting %s from %d clients\n", faultNames[i], options.faultClients);
+        }
+    }
+
+    auto driver = LoadDriver{options};
+    auto cpuStart = 0.0;
+    auto warmupUs = std::uint64_t(options.warmup) * 1000 * 1000;
+    auto durationUs = std::uint64_t(options.duration) * 1000 * 1000;
+    auto cpuThread = std::thread([&]() {
+        usleep(warmupUs);
+        cpuStart = processCpuTime(proxyPid);
+    });
+    driver.Run(warmupUs, durationUs);
+    cpuThread.join();
+    auto cpuUsed = processCpuTime(proxyPid) - cpuStart;
+
+    kill(proxyPid, SIGKILL);
+    waitpid(proxyPid, nullptr, 0);
+    httpOrigin.Stop();
+    tunnelOrigin.Stop();
+    stalledOrigin.Stop();
+    ::close(blackholeFd);
+
+    // Throughput and latency are for the normal sessions only
+    auto seconds = double(options.duration);
+    auto& healthy = driver.GetStats(Fault::None);
+    auto gbits = healthy.bytes * 8.0 / 1e9;
+    printf("completed  %8llu sessions  %10.1f req/s  %10.1f Mbit/s\n",
+           static_cast<unsigned long long>(healthy.completed), healthy.completed / seconds, gbits * 1000.0 / seconds);
+    printf("failed     %8llu errors    %8llu timeouts\n", static_cast<unsigned long long>(healthy.errors),
+           static_cast<unsigned long long>(healthy.timeouts));
+    printf("proxy cpu  %8.2f s      %10.2f cores  %10.2f cpu-s/Gbit\n", cpuUsed, cpuUsed / seconds,
+           gbits ? (cpuUsed / gbits) : 0.0);
+    printLatency("GET", driver.GetLatency(false));
+    printLatency("CONNECT", driver.GetLatency(true));
+    for (auto i = static_cast<int>(Fault::None) + 1; i < static_cast<int>(Fault::NumFaults); i++) {
+        if (options.faults[i]) {
+            auto& stats = driver.GetStats(static_cast<Fault>(i));
+            printf("%-10s %8llu completed %8llu errors    %8llu timeouts\n", faultNames[i],
+                   static_cast<unsigned long long>(stats.completed), static_cast<unsigned long long>(stats.errors),
+                   static_cast<unsigned long long>(stats.timeouts));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1321 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// nermal_sim - deterministic simulation of the proxy's event loop.
+//
+// Usage: nermal_sim [-n sessions] [-c sessions] [-s bytes] [-m percent] [-x percent]
+//                   [-l us] [-e us] [-b events] [-r seed] [-v]
+//
+//   -n  scripted sessions to run (default 10000)
+//   -c  sessions in progress at once (default 64)
+//   -s  largest object fetched or tunnelled; sizes are spread up to it (default 65536)
+//   -m  percentage of sessions that are CONNECT tunnels, the rest GETs (default 40)
+//   -x  percentage of sessions scripted to fail: malformed requests, unknown hosts,
+//       refused connections and clients hanging up early (default 10)
+//   -l  longest time an origin takes to answer, in virtual us (default 2000)
+//   -e  virtual time taken by each event the loop handles, in us (default 5)
+//   -b  most events delivered by each epoll_wait (default 10, as the proxy asks for)
+//   -r  seed for the script (default 1)
+//   -v  print the outcome of every session
+//
+// The proxy's own SocketManager, ProxyConnector and handlers run on this thread,
+// against a simulated network.  Sockets, epoll and the messenger's eventfd are
+// in-memory stand-ins installed through SocketIo; the thread pool runs in manual
+// mode, its work run between loop iterations; hosts resolve through a stand-in
+// resolver, and the clock is virtual.  Given the same options, every run makes the
+// same calls in the same order - the trace digest printed at the end confirms it.
+//
+// Reports the real time the loop takes per event, by the handler it went to, per
+// session and for the thread pool's work, along with allocations.  Every session
+// is checked against its script, and the proxy against leaked sockets or sessions,
+// and against any allocation once it has warmed up; any failure gives a non-zero
+// exit status.  The simulated network delivers writes
+// at once and in full, so flow control isn't modelled, nor are the disk cache and
+// TCP Fast Open, which make calls of their own.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <deque>
+#include <errno.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <queue>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../AllocHook.hpp"
+#include "../CommandSocket.hpp"
+#include "../DiskCache.hpp"
+#include "../FlightRecorder.hpp"
+#include "../IHostResolver.hpp"
+#include "../ISocketIo.hpp"
+#include "../Log.hpp"
+#include "../ProxyConnector.hpp"
+#include "../ServerSocket.hpp"
+#include "../Session.hpp"
+#include "../SocketIo.hpp"
+#include "../SocketManager.hpp"
+#include "../ThreadPool.hpp"
+#include "../Timestamp.hpp"
+
+namespace {
+
+constexpr auto fdBase = 1 << 20;                        // well clear of the process's real fds
+constexpr auto proxyPort = std::uint16_t{8080};
+constexpr auto httpPort = std::uint16_t{80};
+constexpr auto tunnelPort = std::uint16_t{443};
+constexpr auto refusedPort = std::uint16_t{444};        // nothing listens here
+constexpr auto startTime = std::uint64_t{1000000000};   // virtual us; the proxy takes 0 to mean "not yet"
+constexpr auto stuckTime = std::uint64_t{60000000};     // virtual us without a session ending
+constexpr auto tunnelReplySize = std::size_t{19};       // "HTTP/1.0 200 OK\r\n\r\n"
+
+std::uint64_t virtualNow = startTime;
+
+std::uint64_t virtualClock() {
+    return virtualNow;
+}
+
+// Real time, for measuring the proxy
+std::uint64_t realNs() {
+    auto ts = timespec{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<std::uint64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+// FNV-1a, over everything that happens during the run
+void addToDigest(std::uint64_t& digest, std::uint64_t value) {
+    for (auto i = 0; i < 8; i++) {
+        digest ^= (value >> (i * 8)) & 0xff;
+        digest *= 0x100000001b3ull;
+    }
+}
+
+// What the loop was doing, taken from the events epoll_wait returned
+enum class EventKind : std::uint8_t {
+    Accept,         // new clients
+    Relay,          // client or server data
+    Command,        // thread pool results
+    Maintenance,    // epoll_wait timed out
+    Mixed,          // more than one of the above
+    NumKinds
+};
+
+// Allocations made by the simulation itself - its peers, and its stand-ins for the
+// network and DNS - to be left out of the proxy's figures.  The stand-ins call into
+// the peers, so scopes nest; only the outermost one counts.
+std::uint64_t simAllocs = 0;
+int simAllocDepth = 0;
+
+class SimAllocScope {
+public:
+    SimAllocScope()
+        : m_start{AllocCount()}
+    {
+        simAllocDepth++;
+    }
+
+    ~SimAllocScope() {
+        if (--simAllocDepth == 0) {
+            simAllocs += AllocCount() - m_start;
+        }
+    }
+
+private:
+    std::uint64_t m_start;
+};
+
+std::uint64_t takeSimAllocs() {
+    auto allocs = simAllocs;
+    simAllocs = 0;
+    return allocs;
+}
+
+const char* eventKindNames[] = { "accept", "relay", "command", "maintenance", "mixed" };
+static_assert(sizeof(eventKindNames) / sizeof(eventKindNames[0]) == static_cast<int>(EventKind::NumKinds), "Missing event kind name");
+
+/**
+ * @brief The SimPeers class is implemented by whatever drives the simulated
+ * network's own endpoints - the clients, and the origins the proxy connects to.
+ */
+class SimPeers {
+public:
+    virtual ~SimPeers() = default;
+
+    // Data, or the end of the stream, is waiting on one of the simulation's endpoints
+    virtual void OnReadable(int fd) = 0;
+
+    // A timer set with SimNetwork::Schedule has expired
+    virtual void OnTimer(int index) = 0;
+};
+
+/**
+ * @brief The SimNetwork class stands in for the kernel's sockets, epoll and
+ * eventfds.  Streams come in pairs; one end belongs to the proxy, and the other
+ * to the simulation, which dials the proxy's listener as a client and is dialled
+ * as an origin.  Readiness is level triggered, with ready fds queued in the order
+ * they became ready, as epoll does.  Waiting with nothing ready moves the virtual
+ * clock on to the next timer, or the end of the timeout.
+ */
+class SimNetwork : public ISocketIo {
+public:
+    SimNetwork(unsigned eventCost, int maxBatch)
+        : m_peers{nullptr}
+        , m_eventCost{eventCost}
+        , m_maxBatch{maxBatch}
+        , m_timerSeq{0}
+        , m_lastKind{EventKind::Maintenance}
+        , m_lastCount{0}
+        , m_peerNs{0}
+        , m_digest{0xcbf29ce484222325ull}
+    {}
+
+    void SetPeers(SimPeers* peers) {
+        m_peers = peers;
+    }
+
+    // Accept the proxy's connections to this port, as an origin
+    void AddService(std::uint16_t port) {
+        m_services.push_back(port);
+    }
+
+    // Connect to a listener, returning the simulation's end of the connection
+    int Dial(std::uint16_t port) {
+        auto listener = m_listeners.find(port);
+        if (listener == m_listeners.end()) {
+            return -1;
+        }
+        auto local = Allocate(Type::Stream);
+        auto remote = Allocate(Type::Stream);
+        Link(local, remote);
+        m_fds[local].peerOwned = true;
+        m_fds[listener->second].backlog.push_back(remote);
+        Notify(listener->second);
+        return fdBase + local;
+    }
+
+    // Port the proxy dialled to reach this endpoint
+    std::uint16_t GetPort(int fd) const {
+        return m_fds[fd - fdBase].port;
+    }
+
+    // Call SimPeers::OnTimer(index) at the given virtual time
+    void Schedule(std::uint64_t atUs, int index) {
+        m_timers.push(Timer{atUs, m_timerSeq++, index});
+    }
+
+    EventKind GetLastKind() const {
+        return m_lastKind;
+    }
+
+    // Events returned by the last epoll_wait
+    int GetLastCount() const {
+        return m_lastCount;
+    }
+
+    // Real time spent in SimPeers since the last call, to be left out of the proxy's figures
+    std::uint64_t TakePeerNs() {
+        auto ns = m_peerNs;
+        m_peerNs = 0;
+        return ns;
+    }
+
+    std::uint64_t& GetDigest() {
+        return m_digest;
+    }
+
+    // Connections the proxy holds open
+    int CountProxyStreams() const {
+        auto count = 0;
+        for (auto& entry : m_fds) {
+            if ((entry.type == Type::Stream) && !entry.peerOwned) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    int Socket(int /*domain*/, int /*type*/, int /*protocol*/) override {
+        auto scope = SimAllocScope{};
+        return fdBase + Allocate(Type::Socket);
+    }
+
+    int Bind(int fd, const struct sockaddr* address, socklen_t /*addressSize*/) override {
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        entry->port = ntohs(reinterpret_cast<const sockaddr_in*>(address)->sin_port);
+        return 0;
+    }
+
+    int Listen(int fd, int /*backlog*/) override {
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        if (m_listeners.count(entry->port)) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        entry->type = Type::Listener;
+        m_listeners[entry->port] = fd - fdBase;
+        return 0;
+    }
+
+    int Accept(int fd, struct sockaddr* address, socklen_t* addressSize) override {
+        auto scope = SimAllocScope{};
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        if ((entry->type != Type::Listener) || entry->backlog.empty()) {
+            errno = EAGAIN;
+            return -1;
+        }
+        auto index = entry->backlog.front();
+        entry->backlog.pop_front();
+
+        // Each client has an address of its own, in 10/8
+        if (address && addressSize && (*addressSize >= sizeof(sockaddr_in))) {
+            auto* address4 = reinterpret_cast<sockaddr_in*>(address);
+            *address4 = sockaddr_in{};
+            address4->sin_family = AF_INET;
+            address4->sin_addr.s_addr = htonl((10u << 24) | static_cast<std::uint32_t>(index));
+            *addressSize = sizeof(sockaddr_in);
+        }
+        return fdBase + index;
+    }
+
+    int Connect(int fd, const struct sockaddr* address, socklen_t /*addressSize*/) override {
+        auto scope = SimAllocScope{};
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        if (entry->type != Type::Socket) {
+            errno = EISCONN;
+            return -1;
+        }
+        // The port is in the same place for both address families
+        auto port = ntohs(reinterpret_cast<const sockaddr_in*>(address)->sin_port);
+        if (std::find(m_services.begin(), m_services.end(), port) == m_services.end()) {
+            errno = ECONNREFUSED;
+            return -1;
+        }
+        auto local = fd - fdBase;
+        auto remote = Allocate(Type::Stream);
+        m_fds[local].type = Type::Stream;
+        Link(local, remote);
+        m_fds[remote].peerOwned = true;
+        m_fds[remote].port = port;
+        return 0;
+    }
+
+    int SetSockOpt(int fd, int /*level*/, int /*name*/, const void* /*value*/, socklen_t /*size*/) override {
+        return Find(fd) ? 0 : -1;
+    }
+
+    int GetSockOpt(int fd, int /*level*/, int /*name*/, void* value, socklen_t* size) override {
+        if (!Find(fd)) {
+            return -1;
+        }
+        memset(value, 0, *size);
+        return 0;
+    }
+
+    ssize_t Read(int fd, void* buf, std::size_t size) override {
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        if (entry->type == Type::EventFd) {
+            if (size < sizeof(entry->counter)) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (!entry->counter) {
+                errno = EAGAIN;
+                return -1;
+            }
+            memcpy(buf, &entry->counter, sizeof(entry->counter));
+            entry->counter = 0;
+            return sizeof(entry->counter);
+        }
+        return Receive(*entry, buf, size, 0);
+    }
+
+    ssize_t Write(int fd, const void* buf, std::size_t size) override {
+        auto scope = SimAllocScope{};
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        if (entry->type == Type::EventFd) {
+            auto value = std::uint64_t{};
+            if (size < sizeof(value)) {
+                errno = EINVAL;
+                return -1;
+            }
+            memcpy(&value, buf, sizeof(value));
+            entry->counter += value;
+            Notify(fd - fdBase);
+            return sizeof(value);
+        }
+        if (entry->type != Type::Stream) {
+            errno = ENOTCONN;
+            return -1;
+        }
+        if (entry->peer == -1) {
+            errno = EPIPE;
+            return -1;
+        }
+        auto peer = entry->peer;
+        m_fds[peer].inbound.append(static_cast<const char*>(buf), size);
+        Notify(peer);
+        return size;
+    }
+
+    ssize_t Recv(int fd, void* buf, std::size_t size, int flags) override {
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        return Receive(*entry, buf, size, flags);
+    }
+
+    // There's no SYN to carry data in, so a Fast Open connects then writes
+    ssize_t SendTo(int fd, const void* buf, std::size_t size, int flags, const struct sockaddr* address, socklen_t addressSize) override {
+        if ((flags & MSG_FASTOPEN) && (Connect(fd, address, addressSize) == -1)) {
+            return -1;
+        }
+        return Write(fd, buf, size);
+    }
+
+    int Close(int fd) override {
+        auto scope = SimAllocScope{};
+        auto* entry = Find(fd);
+        if (!entry) {
+            return -1;
+        }
+        auto index = fd - fdBase;
+        if ((entry->type == Type::Stream) && (entry->peer != -1)) {
+            auto peer = entry->peer;
+            m_fds[peer].peer = -1;
+            m_fds[peer].eof = true;
+            Notify(peer);
+        } else if (entry->type == Type::Listener) {
+            m_listeners.erase(entry->port);
+            while (!m_fds[index].backlog.empty()) {
+                auto pending = m_fds[index].backlog.front();
+                m_fds[index].backlog.pop_front();
+                Close(fdBase + pending);
+            }
+        }
+
+        // Ready list entries are left to lapse, as the fd may be reused first
+        m_fds[index].type = Type::Free;
+        m_fds[index].watched = false;
+        m_free.push(index);
+        return 0;
+    }
+
+    int EventFd(unsigned int initial, int /*flags*/) override {
+        auto index = Allocate(Type::EventFd);
+        m_fds[index].counter = initial;
+        return fdBase + index;
+    }
+
+    int EpollCreate(int /*flags*/) override {
+        return fdBase + Allocate(Type::Epoll);
+    }
+
+    int EpollCtl(int epollFd, int op, int fd, struct epoll_event* event) override {
+        auto scope = SimAllocScope{};
+        auto* entry = Find(fd);
+        if (!entry || !Find(epollFd)) {
+            return -1;
+        }
+        switch (op) {
+        case EPOLL_CTL_ADD:
+            if (entry->watched) {
+                errno = EEXIST;
+                return -1;
+            }
+            entry->watched = true;
+            entry->events = event->events;
+            entry->data = event->data;
+            break;
+        case EPOLL_CTL_MOD:
+            if (!entry->watched) {
+                errno = ENOENT;
+                return -1;
+            }
+            entry->events = event->events;
+            entry->data = event->data;
+            break;
+        case EPOLL_CTL_DEL:
+            if (!entry->watched) {
+                errno = ENOENT;
+                return -1;
+            }
+            entry->watched = false;
+            return 0;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+        Notify(fd - fdBase);
+        return 0;
+    }
+
+    int EpollWait(int epollFd, struct epoll_event* events, int maxEvents, int timeout) override {
+        auto scope = SimAllocScope{};
+        if (!Find(epollFd)) {
+            return -1;
+        }
+        maxEvents = std::min(maxEvents, m_maxBatch);
+        RunPeers();
+
+        auto deadline = (timeout < 0) ? UINT64_MAX : virtualNow + (static_cast<std::uint64_t>(timeout) * 1000);
+        while (1) {
+            auto count = Collect(events, maxEvents);
+            if (count) {
+                virtualNow += count * m_eventCost;
+                return count;
+            }
+            if (m_timers.empty() || (m_timers.top().at >= deadline)) {
+                if (deadline != UINT64_MAX) {
+                    virtualNow = deadline;
+                }
+                return 0;
+            }
+            virtualNow = m_timers.top().at;
+            RunPeers();
+        }
+    }
+
+private:
+    enum class Type : std::uint8_t {
+        Free,
+        Socket,     // not yet connected or listening
+        Listener,
+        Stream,
+        EventFd,
+        Epoll,
+    };
+
+    typedef struct {
+        Type type;
+        bool peerOwned;         // one of the simulation's endpoints
+        bool watched;           // by the (single) epoll instance
+        bool proxyQueued;       // on the proxy's ready list
+        bool peerQueued;        // on the simulation's ready list
+        bool eof;               // the other end of the stream has closed
+        std::uint32_t events;
+        epoll_data_t data;
+        int peer;               // index of the other end of the stream, or -1
+        std::uint16_t port;     // bound, listening or dialled
+        std::uint64_t counter;  // eventfd
+        std::string inbound;    // unread stream data, from readPos on
+        std::size_t readPos;
+        std::deque<int> backlog;
+    } Entry;
+
+    typedef struct {
+        std::uint64_t at;
+        std::uint64_t seq;      // timers due at once expire in the order they were set
+        int index;
+    } Timer;
+
+    struct TimerOrder {
+        bool operator()(const Timer& a, const Timer& b) const {
+            return (a.at != b.at) ? (a.at > b.at) : (a.seq > b.seq);
+        }
+    };
+
+    // Take the lowest free fd, as the kernel does.  Entries keep their buffers'
+    // capacity from one use to the next.
+    int Allocate(Type type) {
+        auto index = 0;
+        if (!m_free.empty()) {
+            index = m_free.top();
+            m_free.pop();
+        } else {
+            index = static_cast<int>(m_fds.size());
+            m_fds.emplace_back();
+            m_fds[index].proxyQueued = false;
+            m_fds[index].peerQueued = false;
+        }
+        auto& entry = m_fds[index];
+        entry.type = type;
+        entry.peerOwned = false;
+        entry.watched = false;
+        entry.eof = false;
+        entry.events = 0;
+        entry.data.u64 = 0;
+        entry.peer = -1;
+        entry.port = 0;
+        entry.counter = 0;
+        entry.inbound.clear();
+        entry.readPos = 0;
+        entry.backlog.clear();
+        return index;
+    }
+
+    Entry* Find(int fd) {
+        auto index = fd - fdBase;
+        if ((index < 0) || (index >= static_cast<int>(m_fds.size())) || (m_fds[index].type == Type::Free)) {
+            errno = EBADF;
+            return nullptr;
+        }
+        return &m_fds[index];
+    }
+
+    void Link(int a, int b) {
+        m_fds[a].peer = b;
+        m_fds[b].peer = a;
+    }
+
+    ssize_t Receive(Entry& entry, void* buf, std::size_t size, int flags) {
+        if (entry.type != Type::Stream) {
+            errno = ENOTCONN;
+            return -1;
+        }
+        auto available = entry.inbound.size() - entry.readPos;
+        if (!available) {
+            if (entry.eof) {
+                return 0;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+        auto count = std::min(size, available);
+        memcpy(buf, entry.inbound.data() + entry.readPos, count);
+        if (!(flags & MSG_PEEK)) {
+            entry.readPos += count;
+            if (entry.readPos == entry.inbound.size()) {
+                entry.inbound.clear();
+                entry.readPos = 0;
+            }
+        }
+        return count;
+    }
+
+    bool IsReadable(const Entry& entry) const {
+        switch (entry.type) {
+        case Type::Stream:   return (entry.readPos < entry.inbound.size()) || entry.eof;
+        case Type::Listener: return !entry.backlog.empty();
+        case Type::EventFd:  return entry.counter != 0;
+        default:             return false;
+        }
+    }
+
+    std::uint32_t GetReadyEvents(const Entry& entry) const {
+        auto ready = std::uint32_t{};
+        if ((entry.events & EPOLLIN) && IsReadable(entry)) {
+            ready |= EPOLLIN;
+        }
+        if ((entry.events & EPOLLOUT) && (entry.type == Type::Stream) && (entry.peer != -1)) {
+            ready |= EPOLLOUT;
+        }
+        return ready;
+    }
+
+    // Queue an fd which may have become ready for whoever owns it
+    void Notify(int index) {
+        auto& entry = m_fds[index];
+        if (entry.peerOwned) {
+            if (!entry.peerQueued && IsReadable(entry)) {
+                entry.peerQueued = true;
+                m_peerReady.push_back(index);
+            }
+        } else if (entry.watched && !entry.proxyQueued && GetReadyEvents(entry)) {
+            entry.proxyQueued = true;
+            m_proxyReady.push_back(index);
+        }
+    }
+
+    int Collect(struct epoll_event* events, int maxEvents) {
+        auto count = 0;
+        auto kinds = 0u;
+        auto toScan = m_proxyReady.size();
+        while (toScan-- && (count < maxEvents)) {
+            auto index = m_proxyReady.front();
+            m_proxyReady.pop_front();
+            auto& entry = m_fds[index];
+            entry.proxyQueued = false;
+            if ((entry.type == Type::Free) || entry.peerOwned || !entry.watched) {
+                continue;
+            }
+            auto ready = GetReadyEvents(entry);
+            if (!ready) {
+                continue;
+            }
+            events[count].events = ready;
+            events[count].data = entry.data;
+            count++;
+
+            auto kind = (entry.type == Type::Listener) ? EventKind::Accept :
+                        (entry.type == Type::EventFd) ? EventKind::Command : EventKind::Relay;
+            kinds |= 1u << static_cast<int>(kind);
+            addToDigest(m_digest, virtualNow);
+            addToDigest(m_digest, (static_cast<std::uint64_t>(index) << 32) | ready);
+
+            // Level triggered - back on the list, to be checked again next time
+            entry.proxyQueued = true;
+            m_proxyReady.push_back(index);
+        }
+
+        m_lastCount = count;
+        m_lastKind = EventKind::Maintenance;
+        for (auto kind = 0; kind < static_cast<int>(EventKind::NumKinds); kind++) {
+            if (kinds == (1u << kind)) {
+                m_lastKind = static_cast<EventKind>(kind);
+            } else if (kinds & (1u << kind)) {
+                m_lastKind = EventKind::Mixed;
+                break;
+            }
+        }
+        return count;
+    }
+
+    // Let the simulation react to what the proxy has sent, and to its timers
+    void RunPeers() {
+        auto start = realNs();
+        auto scope = SimAllocScope{};
+        while (1) {
+            if (!m_peerReady.empty()) {
+                auto index = m_peerReady.front();
+                m_peerReady.pop_front();
+                m_fds[index].peerQueued = false;
+                if ((m_fds[index].type != Type::Free) && m_fds[index].peerOwned && IsReadable(m_fds[index])) {
+                    m_peers->OnReadable(fdBase + index);
+                }
+                continue;
+            }
+            if (!m_timers.empty() && (m_timers.top().at <= virtualNow)) {
+                auto timer = m_timers.top();
+                m_timers.pop();
+                m_peers->OnTimer(timer.index);
+                continue;
+            }
+            break;
+        }
+        m_peerNs += realNs() - start;
+    }
+
+    SimPeers* m_peers;
+    unsigned m_eventCost;   // virtual us
+    int m_maxBatch;
+
+    std::vector<Entry> m_fds;
+    std::priority_queue<int, std::vector<int>, std::greater<int>> m_free;
+    std::deque<int> m_proxyReady;
+    std::deque<int> m_peerReady;
+    std::map<std::uint16_t, int> m_listeners;
+    std::vector<std::uint16_t> m_services;
+    std::priority_queue<Timer, std::vector<Timer>, TimerOrder> m_timers;
+    std::uint64_t m_timerSeq;
+
+    EventKind m_lastKind;
+    int m_lastCount;
+    std::uint64_t m_peerNs;
+    std::uint64_t m_digest;
+};
+
+const char* unknownHost = "nx.test";
+
+/**
+ * @brief The SimResolver class stands in for DNS.  Every host resolves to the
+ * same address except the unknown host, which doesn't resolve at all.  The first
+ * lookup of each host is reported as uncached.
+ */
+class SimResolver : public IHostResolver {
+public:
+    bool GetAddressesForHost(const std::string& host, const std::uint16_t /*port*/, std::vector<HostInfo>& results, bool& cached) override {
+        auto scope = SimAllocScope{};
+        if (host == unknownHost) {
+            return false;
+        }
+        cached = !m_seen.insert(host).second;
+        results.resize(1);
+        results[0].url = host;
+        results[0].address = "192.0.2.1";
+        results[0].ipVersion = 4;
+        results[0].Timestamp = Timestamp();
+        return true;
+    }
+
+    void ClearCacheForHost(const std::string& host) override {
+        auto scope = SimAllocScope{};
+        m_seen.erase(host);
+    }
+
+private:
+    std::set<std::string> m_seen;
+};
+
+// What a session's client does, and how it should turn out
+enum class Script : std::uint8_t {
+    Get,            // fetch an object - 200 and the object
+    Connect,        // tunnel to an origin, which sends back an object - 200 and the object
+    Malformed,      // a request with no host - 400
+    UnknownHost,    // a host that doesn't resolve - 404
+    Refused,        // a port with nothing listening - 404
+    HangUp,         // fetch an object, and hang up on the first byte
+    NumScripts
+};
+
+const char* scriptNames[] = { "get", "connect", "malformed", "unknown-host", "refused", "hang-up" };
+static_assert(sizeof(scriptNames) / sizeof(scriptNames[0]) == static_cast<int>(Script::NumScripts), "Missing script name");
+
+typedef struct {
+    int sessions;
+    int concurrent;
+    std::uint32_t maxSize;
+    int connectPercent;
+    int failPercent;
+    std::uint32_t originDelay;  // us
+    unsigned eventCost;         // us
+    int batch;
+    std::uint64_t seed;
+    bool verbose;
+} SimOptions;
+
+/**
+ * @brief The Simulation class runs the scripted sessions - the clients, and the
+ * origins they reach through the proxy.  Sessions start as others finish, keeping
+ * the configured number in progress.  Origins answer after a scripted delay, and
+ * close the connection once they've sent their object.
+ */
+class Simulation : public SimPeers {
+public:
+    Simulation(SimNetwork& network, const SimOptions& options)
+        : m_network{network}
+        , m_options{options}
+        , m_random{options.seed ? options.seed : 1}
+        , m_started{0}
+        , m_finished{0}
+        , m_mismatches{0}
+        , m_lastProgress{virtualNow}
+        , m_sessions(options.sessions)
+        , m_filler(65536, 'x')
+    {
+        for (auto& count : m_counts) {
+            count = 0;
+        }
+    }
+
+    void Start() {
+        while ((m_started < m_options.sessions) && (m_started < m_options.concurrent)) {
+            StartSession();
+        }
+    }
+
+    bool IsFinished() const {
+        return m_finished == m_options.sessions;
+    }
+
+    bool IsStuck() const {
+        return (virtualNow - m_lastProgress) > stuckTime;
+    }
+
+    int GetFinished() const {
+        return m_finished;
+    }
+
+    int GetMismatches() const {
+        return m_mismatches;
+    }
+
+    int GetCount(Script script) const {
+        return m_counts[static_cast<int>(script)];
+    }
+
+    void OnReadable(int fd) override {
+        auto role = GetRole(fd);
+        if (role.client) {
+            OnClientReadable(fd, role.session);
+        } else {
+            OnOriginReadable(fd, role.session);
+        }
+    }
+
+    void OnTimer(int index) override {
+        auto& session = m_sessions[index];
+        if (session.originFd == -1) {
+            return;
+        }
+        if (session.script == Script::Get) {
+            char header[128];
+            auto length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", session.size);
+            m_network.Write(session.originFd, header, length);
+        }
+        for (auto sent = std::uint32_t{}; sent < session.size; ) {
+            auto chunk = std::min<std::uint32_t>(session.size - sent, m_filler.size());
+            if (m_network.Write(session.originFd, m_filler.data(), chunk) < 0) {
+                break;
+            }
+            sent += chunk;
+        }
+        CloseOrigin(index);
+    }
+
+private:
+    typedef struct {
+        Script script;
+        std::uint32_t size;
+        std::uint32_t originDelay;  // us
+        int clientFd;               // -1 once closed
+        int originFd;               // -1 until the origin knows the session, and once closed
+        bool tunnelled;             // the tunnel's client has asked for its object
+        char head[13];              // "HTTP/1.x NNN"
+        std::size_t headSize;
+        std::uint64_t received;
+        std::uint64_t start;        // virtual us
+    } SimSession;
+
+    typedef struct {
+        bool client;
+        int session;                // -1 for an origin connection not yet matched to a session
+    } Role;
+
+    std::uint64_t Random() {
+        // xorshift64*
+        m_random ^= m_random >> 12;
+        m_random ^= m_random << 25;
+        m_random ^= m_random >> 27;
+        return m_random * 0x2545f4914f6cdd1dull;
+    }
+
+    Role GetRole(int fd) {
+        auto index = static_cast<std::size_t>(fd - fdBase);
+        if (index >= m_roles.size()) {
+            m_roles.resize(index + 1, Role{false, -1});
+            m_requests.resize(index + 1);
+        }
+        return m_roles[index];
+    }
+
+    void SetRole(int fd, bool client, int session) {
+        GetRole(fd);
+        m_roles[fd - fdBase] = Role{client, session};
+    }
+
+    void StartSession() {
+        auto index = m_started++;
+        auto& session = m_sessions[index];
+
+        auto script = Script::Get;
+        if (static_cast<int>(Random() % 100) < m_options.failPercent) {
+            static const Script failures[] = { Script::Malformed, Script::UnknownHost, Script::Refused, Script::HangUp };
+            script = failures[Random() % (sizeof(failures) / sizeof(failures[0]))];
+        } else if (static_cast<int>(Random() % 100) < m_options.connectPercent) {
+            script = Script::Connect;
+        }
+        session.script = script;
+        session.size = static_cast<std::uint32_t>(Random() % (std::uint64_t{m_options.maxSize} + 1));
+        session.originDelay = static_cast<std::uint32_t>(Random() % (std::uint64_t{m_options.originDelay} + 1));
+        session.originFd = -1;
+        session.tunnelled = false;
+        session.headSize = 0;
+        session.received = 0;
+        session.start = virtualNow;
+        m_counts[static_cast<int>(script)]++;
+
+        char request[256];
+        auto length = 0;
+        switch (script) {
+        case Script::Get:
+        case Script::HangUp:
+            length = snprintf(request, sizeof(request), "GET http://origin.test/obj/%d/%u HTTP/1.1\r\nHost: origin.test\r\n\r\n", index, session.size);
+            break;
+        case Script::Connect:
+            length = snprintf(request, sizeof(request), "CONNECT tunnel.test:%d HTTP/1.1\r\nHost: tunnel.test:%d\r\n\r\n", tunnelPort, tunnelPort);
+            break;
+        case Script::Malformed:
+            length = snprintf(request, sizeof(request), "GET /obj/%d HTTP/1.1\r\n\r\n", index);
+            break;
+        case Script::UnknownHost:
+            length = snprintf(request, sizeof(request), "GET http://%s/obj/%d/0 HTTP/1.1\r\nHost: %s\r\n\r\n", unknownHost, index, unknownHost);
+            break;
+        case Script::Refused:
+            length = snprintf(request, sizeof(request), "CONNECT refused.test:%d HTTP/1.1\r\n\r\n", refusedPort);
+            break;
+        default:
+            break;
+        }
+
+        session.clientFd = m_network.Dial(proxyPort);
+        SetRole(session.clientFd, true, index);
+        m_network.Write(session.clientFd, request, length);
+    }
+
+    void OnClientReadable(int fd, int index) {
+        auto& session = m_sessions[index];
+        char buf[65536];
+        auto rc = ssize_t{};
+        while ((rc = m_network.Read(fd, buf, sizeof(buf))) > 0) {
+            auto headBytes = std::min(static_cast<std::size_t>(rc), (sizeof(session.head) - 1) - session.headSize);
+            memcpy(session.head + session.headSize, buf, headBytes);
+            session.headSize += headBytes;
+            session.received += rc;
+        }
+
+        if ((session.script == Script::HangUp) && session.received) {
+            FinishSession(index);
+            return;
+        }
+        if (rc == 0) {
+            FinishSession(index);
+            return;
+        }
+
+        // Once the tunnel is up, ask the origin behind it for the object
+        if ((session.script == Script::Connect) && !session.tunnelled && (session.received >= tunnelReplySize)) {
+            session.tunnelled = true;
+            char line[64];
+            auto length = snprintf(line, sizeof(line), "%d %u\n", index, session.size);
+            m_network.Write(fd, line, length);
+        }
+    }
+
+    void OnOriginReadable(int fd, int index) {
+        auto& request = m_requests[fd - fdBase];
+        char buf[65536];
+        auto rc = ssize_t{};
+        while ((rc = m_network.Read(fd, buf, sizeof(buf))) > 0) {
+            if (index == -1) {
+                request.append(buf, rc);
+            }
+        }
+
+        if (index == -1) {
+            // Match the connection to its session from the request, then answer after a delay
+            auto matched = false;
+            auto size = 0u;
+            if (m_network.GetPort(fd) == httpPort) {
+                const auto* path = strstr(request.c_str(), "/obj/");
+                matched = path && strstr(path, "\r\n\r\n") && (2 == sscanf(path, "/obj/%d/%u", &index, &size));
+            } else {
+                matched = strchr(request.c_str(), '\n') && (2 == sscanf(request.c_str(), "%d %u", &index, &size));
+            }
+            if (matched && (index >= 0) && (index < m_started)) {
+                request.clear();
+                SetRole(fd, false, index);
+                m_sessions[index].originFd = fd;
+                m_network.Schedule(virtualNow + m_sessions[index].originDelay, index);
+                return;
+            }
+            index = -1;
+        }
+
+        if (rc == 0) {
+            if (index == -1) {
+                request.clear();
+                SetRole(fd, false, -1);
+                m_network.Close(fd);
+            } else {
+                CloseOrigin(index);
+            }
+        }
+    }
+
+    void CloseOrigin(int index) {
+        auto& session = m_sessions[index];
+        if (session.originFd != -1) {
+            SetRole(session.originFd, false, -1);
+            m_network.Close(session.originFd);
+            session.originFd = -1;
+        }
+    }
+
+    void FinishSession(int index) {
+        auto& session = m_sessions[index];
+        m_network.Close(session.clientFd);
+        SetRole(session.clientFd, false, -1);
+        session.clientFd = -1;
+
+        session.head[session.headSize] = '\0';
+        auto status = 0;
+        sscanf(session.head, "HTTP/1.%*d %d", &status);
+
+        auto expected = true;
+        switch (session.script) {
+        case Script::Get: {
+            char header[128];
+            auto length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", session.size);
+            expected = (status == 200) && (session.received == (length + session.size));
+        } break;
+        case Script::Connect:
+            expected = (status == 200) && (session.received == (tunnelReplySize + session.size));
+            break;
+        case Script::Malformed:
+            expected = (status == 400);
+            break;
+        case Script::UnknownHost:
+        case Script::Refused:
+            expected = (status == 404);
+            break;
+        case Script::HangUp:
+            expected = (session.received != 0);
+            break;
+        default:
+            break;
+        }
+
+        auto duration = virtualNow - session.start;
+        if (!expected) {
+            m_mismatches++;
+        }
+        if (m_options.verbose || (!expected && (m_mismatches <= 10))) {
+            printf("session %d %s: status %d, %llu bytes of %u, %llu us%s\n", index, scriptNames[static_cast<int>(session.script)],
+                   status, (unsigned long long)session.received, session.size, (unsigned long long)duration,
+                   expected ? "" : " - unexpected");
+        }
+        addToDigest(m_network.GetDigest(), (static_cast<std::uint64_t>(index) << 32) | static_cast<std::uint32_t>(status));
+        addToDigest(m_network.GetDigest(), session.received);
+        addToDigest(m_network.GetDigest(), duration);
+
+        m_finished++;
+        m_lastProgress = virtualNow;
+        if (m_started < m_options.sessions) {
+            StartSession();
+        }
+    }
+
+    SimNetwork& m_network;
+    const SimOptions& m_options;
+    std::uint64_t m_random;
+    int m_started;
+    int m_finished;
+    int m_mismatches;
+    std::uint64_t m_lastProgress;
+    std::vector<SimSession> m_sessions;
+    std::vector<Role> m_roles;          // by fd
+    std::vector<std::string> m_requests; // origin requests as they arrive, by fd
+    std::string m_filler;
+    int m_counts[static_cast<int>(Script::NumScripts)];
+};
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-n sessions] [-c sessions] [-s bytes] [-m percent] [-x percent]\n"
+                    "       [-l us] [-e us] [-b events] [-r seed] [-v]\n", program);
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    auto options = SimOptions{};
+    options.sessions = 10000;
+    options.concurrent = 64;
+    options.maxSize = 65536;
+    options.connectPercent = 40;
+    options.failPercent = 10;
+    options.originDelay = 2000;
+    options.eventCost = 5;
+    options.batch = 10;
+    options.seed = 1;
+    options.verbose = false;
+
+    auto opt = int{};
+    while ((opt = getopt(argc, argv, "n:c:s:m:x:l:e:b:r:v")) != -1) {
+        switch (opt) {
+        case 'n': options.sessions = std::max(1, atoi(optarg)); break;
+        case 'c': options.concurrent = std::max(1, atoi(optarg)); break;
+        case 's': options.maxSize = static_cast<std::uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        case 'm': options.connectPercent = std::min(100, std::max(0, atoi(optarg))); break;
+        case 'x': options.failPercent = std::min(100, std::max(0, atoi(optarg))); break;
+        case 'l': options.originDelay = static_cast<std::uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        case 'e': options.eventCost = static_cast<unsigned>(strtoul(optarg, nullptr, 10)); break;
+        case 'b': options.batch = std::max(1, atoi(optarg)); break;
+        case 'r': options.seed = strtoull(optarg, nullptr, 10); break;
+        case 'v': options.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Everything the proxy touches runs on virtual time and the simulated network, so
+    // both go in before anything is created
+    SetClockSource(virtualClock);
+    static auto network = SimNetwork{options.eventCost, options.batch};
+    SocketIo::Install(network);
+
+    LogSetVerbosity(LogSeverity::Error);
+    FlightRecorder::Instance().SetCapacity(1024);
+    ThreadPool::Instance().SetManual();
+    ThreadPool::Instance().Start();
+    network.AddService(httpPort);
+    network.AddService(tunnelPort);
+
+    // The idle pass reaches a singleton that sessions never touch - create it up
+    // front, as main does while reading the config, so it isn't counted later
+    DiskCache::Instance();
+
+    static auto resolver = SimResolver{};
+    auto socketManager = std::make_unique<SocketManager>(std::make_unique<ProxyConnector>(resolver));
+    auto server = std::make_unique<ServerSocket>();
+    if (!socketManager->Initialize() || !server->Initialize(proxyPort)) {
+        fprintf(stderr, "Unable to start the proxy\n");
+        return 1;
+    }
+    socketManager->AddSocket(std::move(server));
+    socketManager->AddSocket(std::make_unique<CommandSocket>());
+
+    printf("%d sessions, %d at once, objects up to %u bytes, %d%% CONNECT, %d%% failing, seed %llu\n",
+           options.sessions, options.concurrent, options.maxSize, options.connectPercent, options.failPercent,
+           (unsigned long long)options.seed);
+
+    auto simulation = Simulation{network, options};
+    network.SetPeers(&simulation);
+
+    constexpr auto numKinds = static_cast<int>(EventKind::NumKinds);
+    std::uint64_t kindNs[numKinds] = {};
+    std::uint64_t kindEvents[numKinds] = {};
+    std::uint64_t kindIterations[numKinds] = {};
+    auto loopAllocs = std::uint64_t{};
+    auto poolNs = std::uint64_t{};
+    auto poolAllocs = std::uint64_t{};
+    auto poolTasks = std::uint64_t{};
+    auto& pool = ThreadPool::Instance();
+
+    // Pools and tables grow to fit the load over the first sessions.  From then on,
+    // the proxy should handle each session without allocating at all.
+    auto warmup = std::max(options.sessions / 10, options.concurrent * 4);
+    auto steadyAllocs = std::uint64_t{};
+
+    // One pass of the event loop, then the pool's work, each timed without the
+    // simulation's part in them
+    auto failed = false;
+    auto runIteration = [&]() {
+        auto steady = (simulation.GetFinished() >= warmup);
+        auto start = realNs();
+        auto allocs = AllocCount();
+        if (!socketManager->ProcessSockets()) {
+            failed = true;
+        }
+        auto ns = realNs() - start - network.TakePeerNs();
+        auto iterationAllocs = AllocCount() - allocs - takeSimAllocs();
+        loopAllocs += iterationAllocs;
+        auto kind = static_cast<int>(network.GetLastKind());
+        kindNs[kind] += ns;
+        kindEvents[kind] += network.GetLastCount();
+        kindIterations[kind]++;
+
+        start = realNs();
+        allocs = AllocCount();
+        poolTasks += pool.RunPending();
+        poolNs += realNs() - start;
+        allocs = AllocCount() - allocs - takeSimAllocs();
+        poolAllocs += allocs;
+        if (steady) {
+            steadyAllocs += iterationAllocs + allocs;
+        }
+    };
+
+    auto wallStart = realNs();
+    simulation.Start();
+    while (!failed && !simulation.IsFinished() && !simulation.IsStuck()) {
+        runIteration();
+    }
+
+    // Let the proxy finish up after the last clients, until it has nothing left to do
+    do {
+        runIteration();
+    } while (!failed && network.GetLastCount());
+    auto wallNs = realNs() - wallStart;
+
+    auto leakedSockets = network.CountProxyStreams();
+    auto openSessions = SessionManager::Instance().GetActiveSessions();
+    auto unfinished = options.sessions - simulation.GetFinished();
+
+    printf("\n%-14s", "sessions");
+    for (auto i = 0; i < static_cast<int>(Script::NumScripts); i++) {
+        printf(" %s %d%s", scriptNames[i], simulation.GetCount(static_cast<Script>(i)),
+               (i + 1 < static_cast<int>(Script::NumScripts)) ? "," : "\n");
+    }
+    printf("%-14s %d unexpected, %d unfinished, %d sockets and %zu sessions left open\n", "checks",
+           simulation.GetMismatches(), unfinished, leakedSockets, openSessions);
+    printf("%-14s %.3fs\n", "virtual time", (virtualNow - startTime) / 1e6);
+
+    auto totalNs = std::uint64_t{};
+    auto totalEvents = std::uint64_t{};
+    auto totalIterations = std::uint64_t{};
+    printf("\n%-14s %12s %12s %12s\n", "handler", "iterations", "events", "ns/event");
+    for (auto i = 0; i < numKinds; i++) {
+        // A timed-out wait has no events - its cost is per iteration
+        auto per = (i == static_cast<int>(EventKind::Maintenance)) ? kindIterations[i] : kindEvents[i];
+        printf("%-14s %12llu %12llu %12llu\n", eventKindNames[i], (unsigned long long)kindIterations[i],
+               (unsigned long long)kindEvents[i], (unsigned long long)(per ? kindNs[i] / per : 0));
+        totalNs += kindNs[i];
+        totalEvents += kindEvents[i];
+        totalIterations += kindIterations[i];
+    }
+    printf("%-14s %12llu %12llu %12llu\n", "loop", (unsigned long long)totalIterations, (unsigned long long)totalEvents,
+           (unsigned long long)(totalEvents ? totalNs / totalEvents : 0));
+    printf("%-14s %12s %12llu %12llu\n", "pool tasks", "", (unsigned long long)poolTasks,
+           (unsigned long long)(poolTasks ? poolNs / poolTasks : 0));
+
+    auto sessions = static_cast<std::uint64_t>(simulation.GetFinished() ? simulation.GetFinished() : 1);
+    printf("\n%-14s %.2fus loop + %.2fus pool, %.1f + %.1f allocs\n", "per session",
+           totalNs / 1e3 / sessions, poolNs / 1e3 / sessions,
+           static_cast<double>(loopAllocs) / sessions, static_cast<double>(poolAllocs) / sessions);
+    if (simulation.GetFinished() > warmup) {
+        printf("%-14s %.3f allocs per session after the first %d\n", "steady state",
+               static_cast<double>(steadyAllocs) / (simulation.GetFinished() - warmup), warmup);
+    }
+    printf("%-14s %.3fs\n", "wall time", wallNs / 1e9);
+    printf("%-14s %016llx\n", "trace digest", (unsigned long long)network.GetDigest());
+
+    if (!AllocHookEnabled()) {
+        fprintf(stderr, "Allocation counting isn't built in - allocs will read 0\n");
+    }
+    if (failed) {
+        fprintf(stderr, "The event loop failed\n");
+    }
+    if (steadyAllocs) {
+        fprintf(stderr, "The proxy made %llu allocations after warming up\n", (unsigned long long)steadyAllocs);
+    }
+    return (failed || simulation.GetMismatches() || unfinished || leakedSockets || openSessions || steadyAllocs) ? 1 : 0;
+}
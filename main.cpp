@@ -37,13 +37,17 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "AdminSocket.hpp"
 #include "AsyncMessenger.hpp"
+#include "AuditStore.hpp"
+#include "AuditWriter.hpp"
 #include "BlackList.hpp"
 #include "ClientSocket.hpp"
 #include "CommandSocket.hpp"
 #include "HostInfoManager.hpp"
 #include "HostResolver.hpp"
 #include "Log.hpp"
+#include "LoopMonitor.hpp"
 #include "ProxyConnector.hpp"
 #include "ServerSocket.hpp"
 #include "SocketManager.hpp"
@@ -52,11 +56,19 @@
 #include "BlackList.hpp"
 #include "ConfigFile.hpp"
 #include "Policy.hpp"
+#include "DiskCache.hpp"
+#include "DiskCacheWriter.hpp"
+#include "FastOpen.hpp"
+#include "FlightRecorder.hpp"
+#include "ResponseCache.hpp"
+#include "ThreadPool.hpp"
 #include "TimeMap.hpp"
+#include "UpstreamPool.hpp"
 
 namespace {
 
 std::uint16_t g_serverPort = 10080;
+std::uint16_t g_adminPort = 0;
 bool g_authEnabled = false;
 
 void Daemonize() {
@@ -107,7 +119,9 @@ void DoConfig(const std::string& filename) {
     // Check for global logging verbosity option and apply
     auto& logVerbosity = proxyConfig.GetAttribute("log_verbosity");
     if (logVerbosity.GetValue() != "") {
-        if (logVerbosity.GetValue() == "debug") {
+        if (logVerbosity.GetValue() == "verbose") {
+            LogSetVerbosity(LogSeverity::Verbose);
+        } else if (logVerbosity.GetValue() == "debug") {
             LogSetVerbosity(LogSeverity::Debug);
         } else if (logVerbosity.GetValue() == "info") {
             LogSetVerbosity(LogSeverity::Info);
@@ -127,6 +141,20 @@ void DoConfig(const std::string& filename) {
         LogStoreToDisk(true);
     }
 
+    auto& logFileSize = proxyConfig.GetAttribute("log_file_size");
+    auto& logFileCount = proxyConfig.GetAttribute("log_file_count");
+    if ((logFileSize.GetValue() != "") || (logFileCount.GetValue() != "")) {
+        auto maxBytes = std::size_t{16};
+        auto maxFiles = 3;
+        if (logFileSize.GetValue() != "") {
+            maxBytes = std::stoul(logFileSize.GetValue());
+        }
+        if (logFileCount.GetValue() != "") {
+            maxFiles = std::stoi(logFileCount.GetValue());
+        }
+        LogSetRotation(maxBytes * 1024 * 1024, maxFiles);
+    }
+
     // Override default proxy port
     auto& proxyPort = proxyConfig.GetAttribute("port");
     if (proxyPort.GetValue() != "") {
@@ -134,6 +162,30 @@ void DoConfig(const std::string& filename) {
         Log(LogSeverity::Debug, "Setting proxy port=%d", g_serverPort);
     }
 
+    // Serve metrics on the loopback interface
+    auto& adminPort = proxyConfig.GetAttribute("admin_port");
+    if (adminPort.GetValue() != "") {
+        g_adminPort = std::uint16_t(std::stoul(adminPort.GetValue()));
+        Log(LogSeverity::Debug, "Setting admin port=%d", g_adminPort);
+    }
+
+    // Keep the most recent finished sessions for the admin endpoint
+    auto flightRecorderSize = std::size_t{1024};
+    auto& flightRecorderSizeAttr = proxyConfig.GetAttribute("flight_recorder_size");
+    if (flightRecorderSizeAttr.GetValue() != "") {
+        flightRecorderSize = std::stoul(flightRecorderSizeAttr.GetValue());
+    }
+    Log(LogSeverity::Debug, "Recording the last %zu sessions", flightRecorderSize);
+    FlightRecorder::Instance().SetCapacity(flightRecorderSize);
+
+    // Handlers blocking the event loop for longer than this are logged
+    auto& loopStallThreshold = proxyConfig.GetAttribute("loop_stall_threshold");
+    if (loopStallThreshold.GetValue() != "") {
+        auto thresholdMs = std::stoul(loopStallThreshold.GetValue());
+        Log(LogSeverity::Debug, "Setting loop stall threshold=%lums", thresholdMs);
+        LoopMonitor::Instance().SetStallThreshold(thresholdMs);
+    }
+
     // Enable authentication by IP or user/password
     auto& proxyAuthEnabled = proxyConfig.GetAttribute("auth");
     if (proxyAuthEnabled.GetValue() == "enabled") {
@@ -141,6 +193,104 @@ void DoConfig(const std::string& filename) {
         g_authEnabled = true;
     }
 
+    // Enable reuse of persistent server connections for plain-HTTP requests
+    auto& upstreamPool = proxyConfig.GetAttribute("upstream_pool");
+    if (upstreamPool.GetValue() == "enabled") {
+        Log(LogSeverity::Debug, "Enabling upstream connection pool");
+        UpstreamPool::Instance().SetEnabled(true);
+    }
+
+    auto& upstreamPoolSize = proxyConfig.GetAttribute("upstream_pool_size");
+    if (upstreamPoolSize.GetValue() != "") {
+        // stoul would accept a negative size, and wrap it around to a huge one
+        if (upstreamPoolSize.GetValue()[0] == '-') {
+            Log(LogSeverity::Error, "Invalid upstream_pool_size =%s", upstreamPoolSize.GetValue().c_str());
+        } else {
+            UpstreamPool::Instance().SetMaxSize(std::stoul(upstreamPoolSize.GetValue()));
+        }
+    }
+
+    auto& upstreamPoolIdle = proxyConfig.GetAttribute("upstream_pool_idle");
+    if (upstreamPoolIdle.GetValue() != "") {
+        UpstreamPool::Instance().SetIdleTimeout(std::stoi(upstreamPoolIdle.GetValue()));
+    }
+
+    // Size the thread pool used for detection/DNS/connects
+    auto& threadPoolSize = proxyConfig.GetAttribute("thread_pool_size");
+    if (threadPoolSize.GetValue() != "") {
+        ThreadPool::Instance().SetSize(std::stoi(threadPoolSize.GetValue()));
+    }
+
+    auto& threadPoolMax = proxyConfig.GetAttribute("thread_pool_max");
+    if (threadPoolMax.GetValue() != "") {
+        ThreadPool::Instance().SetMaxSize(std::stoi(threadPoolMax.GetValue()));
+    }
+
+    auto& threadPoolQueue = proxyConfig.GetAttribute("thread_pool_queue");
+    if (threadPoolQueue.GetValue() != "") {
+        ThreadPool::Instance().SetQueueLimit(std::stoul(threadPoolQueue.GetValue()));
+    }
+
+    // Send plain-HTTP requests in the SYN of upstream connections
+    auto& tcpFastOpen = proxyConfig.GetAttribute("tcp_fastopen");
+    if (tcpFastOpen.GetValue() == "enabled") {
+        Log(LogSeverity::Debug, "Enabling TCP Fast Open");
+        FastOpen::Instance().SetEnabled(true);
+    }
+
+    // Enable the in-memory cache of plain-HTTP responses
+    auto& responseCache = proxyConfig.GetAttribute("response_cache");
+    if (responseCache.GetValue() == "enabled") {
+        Log(LogSeverity::Debug, "Enabling response cache");
+        ResponseCache::Instance().SetEnabled(true);
+    }
+
+    auto& responseCacheSize = proxyConfig.GetAttribute("response_cache_size");
+    if (responseCacheSize.GetValue() != "") {
+        ResponseCache::Instance().SetMaxSize(std::stoul(responseCacheSize.GetValue()) * 1024 * 1024);
+    }
+
+    auto& responseCacheObject = proxyConfig.GetAttribute("response_cache_max_object");
+    if (responseCacheObject.GetValue() != "") {
+        ResponseCache::Instance().SetMaxObjectSize(std::stoul(responseCacheObject.GetValue()) * 1024);
+    }
+
+    // Enable the on-disk tier of the response cache
+    auto& diskCacheSize = proxyConfig.GetAttribute("disk_cache_size");
+    if (diskCacheSize.GetValue() != "") {
+        DiskCache::Instance().SetMaxSize(std::stoull(diskCacheSize.GetValue()) * 1024 * 1024);
+    }
+
+    auto& diskCacheObject = proxyConfig.GetAttribute("disk_cache_max_object");
+    if (diskCacheObject.GetValue() != "") {
+        DiskCache::Instance().SetMaxObjectSize(std::stoull(diskCacheObject.GetValue()) * 1024 * 1024);
+    }
+
+    auto& diskCacheDir = proxyConfig.GetAttribute("disk_cache_dir");
+    if ((diskCacheDir.GetValue() != "") && ResponseCache::Instance().IsEnabled()) {
+        Log(LogSeverity::Debug, "Enabling disk cache in %s", diskCacheDir.GetValue().c_str());
+        DiskCache::Instance().Open(diskCacheDir.GetValue());
+    }
+
+    // Append each audit period to the binary store, for querying with nermalaudit
+    auto& auditStore = proxyConfig.GetAttribute("audit_store");
+    if (auditStore.GetValue() != "") {
+        Log(LogSeverity::Debug, "Enabling audit store in %s", auditStore.GetValue().c_str());
+        AuditStore::Instance().Open(auditStore.GetValue());
+    }
+
+    // Summarize audited users' traffic approximately, in fixed memory per user
+    auto& auditMode = proxyConfig.GetAttribute("audit_mode");
+    if (auditMode.GetValue() == "approximate") {
+        auto topHosts = std::size_t{64};
+        auto& auditTopHosts = proxyConfig.GetAttribute("audit_top_hosts");
+        if (auditTopHosts.GetValue() != "") {
+            topHosts = std::stoul(auditTopHosts.GetValue());
+        }
+        Log(LogSeverity::Debug, "Approximate auditing of top %zu hosts", topHosts);
+        GlobalStats::Instance().SetApproximate(topHosts);
+    }
+
     // Load the domain-filtering files
     auto domainConfig = config.GetSection("DomainFiles");
     MultiValueAttribute* attr = nullptr;
@@ -247,6 +397,15 @@ int main(int argc, char** argv)
     // Load config file (if config file is not loaded, use default config)
     DoConfig(configFile);
 
+    // Logging goes through the background writer from here on - after daemonizing,
+    // as the writer thread wouldn't survive the fork
+    LogStart();
+
+    ThreadPool::Instance().Start();
+    AuditWriter::Instance().Start();
+    DiskCacheWriter::Instance().Start();
+    GlobalStats::Instance().Start();
+
     // Create the objects required to manage the sockets
     auto proxyConnector = std::make_unique<ProxyConnector>();
     auto socketManager = std::make_unique<SocketManager>(std::move(proxyConnector));
@@ -263,6 +422,14 @@ int main(int argc, char** argv)
     }
     socketManager->AddSocket(std::move(server));
 
+    // Create the (optional) admin endpoint, reachable only from this host
+    if (g_adminPort) {
+        auto admin = std::make_unique<AdminSocket>();
+        if (admin->Initialize(g_adminPort)) {
+            socketManager->AddSocket(std::move(admin));
+        }
+    }
+
     // Creat the object that handles local IPC requests/responses in a thread-safe way
     auto commandSocket = std::make_unique<CommandSocket>();
     socketManager->AddSocket(std::move(commandSocket));
@@ -282,5 +449,6 @@ int main(int argc, char** argv)
     }
 
     Log(LogSeverity::Error, "I'm sorry, Jon...");
+    LogFlush();
     return 0;
 }
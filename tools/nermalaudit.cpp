@@ -0,0 +1,314 @@
+/**
+ *
+ * NermalProxy
+ *
+ * Copyright 2019 Mark Slevinsky
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// nermalaudit - query the binary audit store written by nermalproxy.
+//
+// Usage: nermalaudit <store dir> [-u user] [-f YYYY-MM-DD] [-t YYYY-MM-DD]
+//                    [-s bytes|time|connections] [-n count]
+//
+// Prints each user's top hosts over the periods overlapping the date range
+// (inclusive, UTC), sorted by the chosen metric.  The store is mapped rather
+// than read, so only the periods in range are touched.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "../AuditFormat.hpp"
+
+namespace {
+
+typedef struct {
+    std::uint64_t rxBytes;
+    std::uint64_t txBytes;
+    std::uint64_t totalTime;
+    std::uint64_t connections;
+} Totals;
+
+enum class SortKey {
+    Bytes,
+    Time,
+    Connections,
+};
+
+// A read-only mapping of a whole file
+class MappedFile {
+public:
+    ~MappedFile() {
+        if (m_data) {
+            munmap(m_data, m_size);
+        }
+    }
+
+    bool Open(const std::string& path) {
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        auto st = (struct stat){};
+        if (fstat(fd, &st) == 0) {
+            m_size = st.st_size;
+        }
+        if (m_size) {
+            auto* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            m_data = (data == MAP_FAILED) ? nullptr : data;
+        }
+        ::close(fd);
+        return (m_size == 0) || (m_data != nullptr);
+    }
+
+    const std::uint8_t* Data() const {
+        return static_cast<const std::uint8_t*>(m_data);
+    }
+
+    std::size_t Size() const {
+        return m_size;
+    }
+
+private:
+    void* m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+bool parseDate(const char* text, std::uint64_t& seconds) {
+    auto tm = (struct tm){};
+    auto* end = strptime(text, "%Y-%m-%d", &tm);
+    if (!end || *end) {
+        return false;
+    }
+    seconds = static_cast<std::uint64_t>(timegm(&tm));
+    return true;
+}
+
+std::uint64_t sortValue(const Totals& totals, SortKey key) {
+    switch (key) {
+    case SortKey::Time:
+        return totals.totalTime;
+    case SortKey::Connections:
+        return totals.connections;
+    default:
+        return totals.rxBytes + totals.txBytes;
+    }
+}
+
+// Whether a range of a block's strings lies within them
+bool inStrings(const AuditBlockHeader& header, std::uint32_t offset, std::uint32_t length) {
+    return (std::uint64_t{offset} + length) <= header.stringBytes;
+}
+
+// Check that every count and offset in a block stays within it, before any of it is used
+bool isBlockValid(const std::uint8_t* block, std::uint64_t size) {
+    auto* header = reinterpret_cast<const AuditBlockHeader*>(block);
+    if ((header->magic != auditMagic) || (header->version != auditVersion)) {
+        return false;
+    }
+
+    auto blockBytes = sizeof(AuditBlockHeader) + std::uint64_t{header->userCount} * sizeof(AuditUserEntry) +
+                      std::uint64_t{header->hostCount} * sizeof(AuditHostRecord) + header->stringBytes;
+    if (blockBytes > size) {
+        return false;
+    }
+
+    auto* users = reinterpret_cast<const AuditUserEntry*>(header + 1);
+    for (auto u = std::uint32_t{0}; u < header->userCount; u++) {
+        if (!inStrings(*header, users[u].nameOffset, users[u].nameLength) ||
+            ((std::uint64_t{users[u].firstHost} + users[u].hostCount) > header->hostCount)) {
+            return false;
+        }
+    }
+
+    auto* hosts = reinterpret_cast<const AuditHostRecord*>(users + header->userCount);
+    for (auto h = std::uint32_t{0}; h < header->hostCount; h++) {
+        if (!inStrings(*header, hosts[h].hostOffset, hosts[h].hostLength)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void usage() {
+    fprintf(stderr, "usage: nermalaudit <store dir> [-u user] [-f YYYY-MM-DD] [-t YYYY-MM-DD]\n"
+                    "                   [-s bytes|time|connections] [-n count]\n");
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+    auto user = std::string{};
+    auto from = std::uint64_t{0};
+    auto to = UINT64_MAX;
+    auto sortKey = SortKey::Bytes;
+    auto count = std::size_t{10};
+
+    auto opt = int{};
+    while ((opt = getopt(argc, argv, "u:f:t:s:n:")) != -1) {
+        switch (opt) {
+        case 'u':
+            user = optarg;
+            break;
+        case 'f':
+            if (!parseDate(optarg, from)) {
+                usage();
+                return 1;
+            }
+            break;
+        case 't':
+            if (!parseDate(optarg, to)) {
+                usage();
+                return 1;
+            }
+            to += 24 * 3600;
+            break;
+        case 's':
+            if (!strcmp(optarg, "time")) {
+                sortKey = SortKey::Time;
+            } else if (!strcmp(optarg, "connections")) {
+                sortKey = SortKey::Connections;
+            } else if (strcmp(optarg, "bytes")) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'n':
+            count = strtoul(optarg, nullptr, 10);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto dir = std::string{argv[optind]};
+    auto index = MappedFile{};
+    auto data = MappedFile{};
+    if (!index.Open(dir + "/" + auditIndexFileName) || !data.Open(dir + "/" + auditDataFileName)) {
+        fprintf(stderr, "unable to open audit store in %s\n", dir.c_str());
+        return 1;
+    }
+
+    // Periods are in time order - find the first that ends after the range starts
+    auto* entries = reinterpret_cast<const AuditIndexEntry*>(index.Data());
+    auto numEntries = index.Size() / sizeof(AuditIndexEntry);
+    auto* first = std::upper_bound(entries, entries + numEntries, from,
+                                   [](std::uint64_t time, const AuditIndexEntry& entry) {
+                                       return time < entry.periodEnd;
+                                   });
+
+    auto results = std::map<std::string, std::unordered_map<std::string, Totals>>{};
+    auto periods = std::size_t{0};
+    auto records = std::size_t{0};
+    for (auto* entry = first; (entry != entries + numEntries) && (entry->periodStart < to); entry++) {
+        if ((entry->size > data.Size()) || (entry->offset > data.Size() - entry->size) ||
+            (entry->size < sizeof(AuditBlockHeader))) {
+            fprintf(stderr, "skipping truncated period at %llu\n", static_cast<unsigned long long>(entry->offset));
+            continue;
+        }
+
+        auto* block = data.Data() + entry->offset;
+        if (!isBlockValid(block, entry->size)) {
+            fprintf(stderr, "skipping corrupt period at %llu\n", static_cast<unsigned long long>(entry->offset));
+            continue;
+        }
+        periods++;
+
+        auto* header = reinterpret_cast<const AuditBlockHeader*>(block);
+        auto* users = reinterpret_cast<const AuditUserEntry*>(header + 1);
+        auto* hosts = reinterpret_cast<const AuditHostRecord*>(users + header->userCount);
+        auto* strings = reinterpret_cast<const char*>(hosts + header->hostCount);
+
+        for (auto u = std::uint32_t{0}; u < header->userCount; u++) {
+            auto& userEntry = users[u];
+            if (!user.empty() && ((user.size() != userEntry.nameLength) ||
+                                  memcmp(user.data(), strings + userEntry.nameOffset, user.size()))) {
+                continue;
+            }
+
+            auto& userTotals = results[std::string{strings + userEntry.nameOffset, userEntry.nameLength}];
+            auto last = userEntry.firstHost + userEntry.hostCount;
+            for (auto h = userEntry.firstHost; h < last; h++) {
+                auto& record = hosts[h];
+                auto& totals = userTotals[std::string{strings + record.hostOffset, record.hostLength}];
+                totals.rxBytes += record.rxBytes;
+                totals.txBytes += record.txBytes;
+                totals.totalTime += record.totalTime;
+                totals.connections += record.connections;
+                records++;
+            }
+        }
+    }
+
+    printf("%-16s %-40s %14s %14s %12s %11s\n", "user", "host", "rxBytes", "txBytes", "timeMs", "connections");
+    for (auto& userTotals : results) {
+        using HostTotals = std::pair<const std::string*, Totals>;
+        auto sorted = std::vector<HostTotals>{};
+        sorted.reserve(userTotals.second.size());
+        for (auto& host : userTotals.second) {
+            sorted.push_back(HostTotals{&host.first, host.second});
+        }
+
+        auto shown = std::min(count, sorted.size());
+        std::partial_sort(sorted.begin(), sorted.begin() + shown, sorted.end(),
+                          [sortKey](const HostTotals& a, const HostTotals& b) {
+                              return sortValue(a.second, sortKey) > sortValue(b.second, sortKey);
+                          });
+
+        for (auto i = std::size_t{0}; i < shown; i++) {
+            auto& totals = sorted[i].second;
+            printf("%-16s %-40s %14llu %14llu %12llu %11llu\n",
+                   userTotals.first.c_str(), sorted[i].first->c_str(),
+                   static_cast<unsigned long long>(totals.rxBytes),
+                   static_cast<unsigned long long>(totals.txBytes),
+                   static_cast<unsigned long long>(totals.totalTime),
+                   static_cast<unsigned long long>(totals.connections));
+        }
+    }
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    fprintf(stderr, "%zu periods, %zu records in %.2fms\n", periods, records, elapsed.count());
+    return 0;
+}